@@ -0,0 +1,42 @@
+-- LuaJack example: smoke.lua
+--
+-- Exercises the message API of an ordinary (SPSC) ringbuffer, all within
+-- the main context, and checks the results.
+
+jack = require("luajack")
+
+c = jack.client_open("smoke")
+
+rbuf = jack.ringbuffer(c, 1000)
+
+-- single messages
+assert(jack.ringbuffer_write(rbuf, 1, "hello"))
+assert(jack.ringbuffer_write(rbuf, 2))
+local tag, data = jack.ringbuffer_peek(rbuf)
+assert(tag == 1 and data == "hello")
+tag, data = jack.ringbuffer_read(rbuf)
+assert(tag == 1 and data == "hello")
+assert(jack.ringbuffer_read_advance(rbuf))
+assert(jack.ringbuffer_read(rbuf) == nil)
+
+-- batches, enough to wrap around the end of the buffer
+for i = 1, 20 do
+   local msgs = {}
+   for j = 1, 10 do
+      msgs[#msgs+1] = j
+      msgs[#msgs+1] = string.rep("x", j)
+   end
+   assert(jack.ringbuffer_write_many(rbuf, msgs) == 10)
+   local n, out = jack.ringbuffer_read_all(rbuf)
+   assert(n == 10)
+   for j = 1, 10 do
+      assert(out[2*j-1] == j and out[2*j] == string.rep("x", j))
+   end
+end
+
+local stats = jack.ringbuffer_stats(rbuf)
+assert(stats.written == 202 and stats.read == 202 and stats.fill == 0)
+print("written=" .. stats.written .. " read=" .. stats.read .. " wraps=" .. stats.wraps)
+
+jack.client_close(c)
+print("ok")
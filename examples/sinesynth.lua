@@ -86,7 +86,7 @@ function process(nframes)
    end
    jack.get_buffer(out_port)
    compute_output(nframes)
-   jack.write(out_port, table.unpack(y))
+   jack.write_from(out_port, y, 0, nframes)
 end
 
 jack.process_callback(c, process)
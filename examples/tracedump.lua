@@ -0,0 +1,24 @@
+-- LuaJack example: tracedump.lua
+-- 
+-- Dumps a trace file written by jack.trace().
+-- Usage: lua tracedump.lua filename [context]
+-- If context is given, only the xrun records are dumped, each preceded by
+-- the given number of records.
+
+trace = require("luajack.trace")
+
+filename = arg[1] or error("missing filename")
+context = tonumber(arg[2])
+
+if not context then
+   trace.dump(filename)
+else
+   h, records = assert(trace.read(filename))
+   show = {}
+   for i, r in ipairs(records) do
+      if r.xrun then
+         for j = math.max(1, i - context), i do show[records[j].seq] = true end
+      end
+   end
+   trace.dump(filename, function(r) return show[r.seq] end)
+end
@@ -0,0 +1,88 @@
+-- The MIT License (MIT)
+--
+-- Copyright (c) 2015 Stefano Trettel
+--
+-- Software repository: LuaJack, https://github.com/stetre/luajack
+--
+-- Permission is hereby granted, free of charge, to any person obtaining a copy
+-- of this software and associated documentation files (the "Software"), to deal
+-- in the Software without restriction, including without limitation the rights
+-- to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+-- copies of the Software, and to permit persons to whom the Software is
+-- furnished to do so, subject to the following conditions:
+--
+-- The above copyright notice and this permission notice shall be included in all
+-- copies or substantial portions of the Software.
+--
+-- THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+-- IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+-- FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+-- AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+-- LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+-- OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+-- SOFTWARE.
+
+-------------------------------------------------------------------------------
+-- LuaJack trace file reader
+-------------------------------------------------------------------------------
+-- Reads the files written by jack.trace() (see src/trace.c for the layout).
+
+local trace = {}
+
+trace._VERSION = "LuaJackTrace 0.1"
+
+local HDR_FMT = "=c8I4I4I4I4I8"   -- magic, version, recsize, nrecords, sample_rate, count
+local HDR_SIZE = 64
+local REC_FMT = "=I8I4I4dddI8I4I4I8"
+local REC_SIZE = 64
+
+local function decode(data, offset)
+   local r, reserved = {}
+   r.seq, r.frame, r.nframes, r.start, r["end"], r.gc, r.mem, r.xrun, reserved, r.usecs = 
+      string.unpack(REC_FMT, data, offset)
+   r.xrun = r.xrun ~= 0
+   return r
+end
+
+-- header, records = trace.read(filename)
+-- Returns the file header (a table) and the records in the ring, oldest first.
+function trace.read(filename)
+   local f, errmsg = io.open(filename, "rb")
+   if not f then return nil, errmsg end
+   local data = f:read("a")
+   f:close()
+   if #data < HDR_SIZE then return nil, "invalid trace file" end
+   local h = {}
+   h.magic, h.version, h.recsize, h.nrecords, h.sample_rate, h.count = string.unpack(HDR_FMT, data)
+   if h.magic ~= "LJTRACE1" or h.recsize ~= REC_SIZE then
+      return nil, "invalid trace file"
+   end
+   local records = {}
+   local n = math.min(h.count, h.nrecords)
+   for seq = h.count - n, h.count - 1 do
+      local r = decode(data, HDR_SIZE + (seq % h.nrecords)*REC_SIZE + 1)
+      if r.seq == seq then -- skip records being overwritten, if the file is live
+         records[#records+1] = r
+      end
+   end
+   return h, records
+end
+
+-- trace.dump(filename [, filter])
+-- Prints the records, one per line. If filter is given, it is called as
+-- filter(record) and only the records for which it returns true are printed.
+function trace.dump(filename, filter)
+   local h, records = trace.read(filename)
+   if not h then error(records, 2) end
+   print(string.format("# %s: %d records (%d written), sample rate %d",
+      filename, #records, h.count, h.sample_rate))
+   print("# seq frame nframes usecs duration(us) gc(us) mem(bytes) xrun")
+   for _, r in ipairs(records) do
+      if not filter or filter(r) then
+         print(string.format("%d %d %d %d %.1f %.1f %d %s", r.seq, r.frame, r.nframes, r.usecs,
+            (r["end"] - r.start)*1e6, r.gc*1e6, r.mem, r.xrun and "XRUN" or "-"))
+      end
+   end
+end
+
+return trace
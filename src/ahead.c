@@ -0,0 +1,515 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Compute-ahead mode														*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <jack/thread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+
+/* In compute-ahead mode, the Lua process callback is not executed in the
+ * JACK process thread, but in a dedicated worker thread that runs up to 
+ * nperiods periods ahead of it.
+ *
+ * The audio ports of the client (those registered when the mode is enabled)
+ * are backed by a ring of nperiods+1 slots of preallocated blocks, one block
+ * per port. At each cycle c, the rt-thread (AProcess):
+ * 1) copies to the output ports the blocks of the slot computed from the 
+ *    inputs of cycle c-nperiods (or silence, if the worker did not make it, 
+ *    which is counted and reported as an underrun),
+ * 2) copies the input ports in the slot for cycle c, and wakes the worker.
+ * The worker executes the Lua process callback on the slots in order, with
+ * get_buffer() returning the slot's blocks instead of the JACK port buffers.
+ *
+ * Slots are handed over between the two threads via their state only:
+ * FREE -> FULL (rt-thread), FULL -> DONE (worker), DONE -> FREE (rt-thread).
+ * The rt-thread never waits for the worker, and does no Lua at all.
+ *
+ * The added latency (nperiods*buffer_size frames) is reported to JACK in 
+ * the latency callback (see ahead_latency).
+ */
+
+#define SLOT_FREE	0
+#define SLOT_FULL	1
+#define SLOT_DONE	2
+
+typedef struct {
+	int			state;		/* SLOT_XXX */
+	uint64_t	seq;		/* cycle the inputs were captured at */
+	nframes_t	nframes;
+	/* cycle times of the capture cycle (see ahead_cycle_times) */
+	int			timesok;	/* 1 if jack_get_cycle_times() succeeded */
+	jack_nframes_t frame;
+	jack_time_t	usecs;
+	jack_time_t	next_usecs;
+	float		period_usecs;
+} slot_t;
+
+typedef struct {
+	cud_t		*cud;
+	unsigned int nperiods;
+	unsigned int nslots;	/* nperiods + 1 */
+	unsigned int nports;
+	nframes_t	blocksize;	/* max frames per block */
+	pud_t		**port;		/* the served ports (pud->ahead = index + 1) */
+	slot_t		*slot;
+	sample_t	*mem;		/* blocks (nslots * nports * blocksize samples) */
+	size_t		memsize;
+	sem_t		sem;		/* worker wakeup */
+	jack_native_thread_t thread;
+	int			running;	/* 1 if the worker thread was created */
+	int			stop;		/* tells the worker to exit */
+	/* rt-thread only */
+	uint64_t	cycle;
+	/* worker only */
+	unsigned int next;		/* next slot to be processed */
+	int			cur;		/* slot being processed (-1 if none) */
+	/* statistics (written by the rt-thread) */
+	uint64_t	underruns;	/* cycles with no block ready for output */
+	uint64_t	overruns;	/* cycles whose inputs could not be captured */
+} ahead_t;
+
+#define AHEAD(cud) ((ahead_t*)(cud)->ahead)
+#define Block(ahead, s, i) ((ahead)->mem + ((size_t)(s)*(ahead)->nports + (i))*(ahead)->blocksize)
+
+/*--------------------------------------------------------------------------*
+ | Worker thread                                   		            		|
+ *--------------------------------------------------------------------------*/
+
+static void *Worker(void *arg)
+	{
+	unsigned int i;
+	slot_t *slot;
+	ahead_t *ahead = (ahead_t*)arg;
+	cud_t *cud = ahead->cud;
+
+	for(;;)
+		{
+		while(sem_wait(&ahead->sem) != 0) 
+			{ if(errno != EINTR) return NULL; }
+		if(__atomic_load_n(&ahead->stop, __ATOMIC_ACQUIRE))
+			return NULL;
+		for(;;)
+			{
+			slot = &ahead->slot[__atomic_load_n(&ahead->next, __ATOMIC_RELAXED)];
+			if(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_FULL)
+				break;
+			/* output blocks not written by the callback are silent */
+			for(i = 0; i < ahead->nports; i++)
+				if(PortIsOutput(ahead->port[i]))
+					memset(Block(ahead, ahead->next, i), 0, slot->nframes*sizeof(sample_t));
+			ahead->cur = ahead->next;
+			process_run(cud, slot->nframes);
+			ahead->cur = -1;
+			/* next is updated before releasing the slot (see ahead_buffer_size) */
+			__atomic_store_n(&ahead->next, (ahead->next + 1) % ahead->nslots, __ATOMIC_RELAXED);
+			__atomic_store_n(&slot->state, SLOT_DONE, __ATOMIC_RELEASE);
+			}
+		}
+	return NULL;
+	}
+
+int ahead_cycle_times(cud_t *cud, jack_nframes_t *frame, jack_time_t *usecs,
+						jack_time_t *next_usecs, float *period_usecs)
+/* Same as jack_get_cycle_times(), which can be called only in the process thread.
+ * In compute-ahead mode, the process callback is executed in the worker instead,
+ * so this returns the times of the cycle whose inputs are being processed, with 
+ * next_usecs set to the deadline for the slot (the start of the cycle its output
+ * is due at). */
+	{
+	slot_t *slot;
+	ahead_t *ahead = AHEAD(cud);
+	if(!ahead)
+		return jack_get_cycle_times(cud->client, frame, usecs, next_usecs, period_usecs);
+	if(ahead->cur < 0) return -1;
+	slot = &ahead->slot[ahead->cur];
+	if(!slot->timesok) return -1;
+	*frame = slot->frame;
+	*usecs = slot->usecs;
+	*period_usecs = slot->period_usecs;
+	*next_usecs = slot->next_usecs + (jack_time_t)((ahead->nperiods - 1)*slot->period_usecs);
+	return 0;
+	}
+
+void *ahead_buffer(pud_t *pud)
+/* returns the block for the given port in the slot being processed 
+ * (called in the worker, in place of jack_port_get_buffer()) */
+	{
+	ahead_t *ahead = AHEAD(pud->cud);
+	if((ahead->cur < 0) || (pud->ahead == 0))
+		return NULL;
+	return Block(ahead, ahead->cur, pud->ahead - 1);
+	}
+
+/*--------------------------------------------------------------------------*
+ | Process callback                                		            		|
+ *--------------------------------------------------------------------------*/
+
+static void Output(ahead_t *ahead, int s, nframes_t nframes)
+/* copies the blocks of slot s to the output ports (silence if s < 0) */
+	{
+	unsigned int i;
+	sample_t *buf;
+	pud_t *pud;
+	for(i = 0; i < ahead->nports; i++)
+		{
+		pud = ahead->port[i];
+		if(!PortIsOutput(pud) || !IsPudValid(pud)) continue;
+		if((buf = (sample_t*)jack_port_get_buffer(pud->port, nframes)) == NULL) continue;
+		if(s < 0)
+			memset(buf, 0, nframes*sizeof(sample_t));
+		else
+			memcpy(buf, Block(ahead, s, i), nframes*sizeof(sample_t));
+		}
+	}
+
+static void Input(ahead_t *ahead, int s, nframes_t nframes)
+/* copies the input ports to the blocks of slot s */
+	{
+	unsigned int i;
+	sample_t *buf;
+	pud_t *pud;
+	for(i = 0; i < ahead->nports; i++)
+		{
+		pud = ahead->port[i];
+		if(!PortIsInput(pud)) continue;
+		if(!IsPudValid(pud) || (buf = (sample_t*)jack_port_get_buffer(pud->port, nframes)) == NULL)
+			memset(Block(ahead, s, i), 0, nframes*sizeof(sample_t));
+		else
+			memcpy(Block(ahead, s, i), buf, nframes*sizeof(sample_t));
+		}
+	}
+
+#define cud ((cud_t*)arg)
+static int AProcess(nframes_t nframes, void *arg)
+	{
+	int s, state;
+	slot_t *slot;
+	ahead_t *ahead = AHEAD(cud);
+	uint64_t c = ahead->cycle++;
+
+	if(luajack_exiting()) return 0;
+	if(!IsCudValid(cud)) return 0;
+	cud->buffer_size = nframes;
+
+	/* output the block computed from the inputs of cycle c - nperiods */
+	if(c >= ahead->nperiods)
+		{
+		s = (c - ahead->nperiods) % ahead->nslots;
+		slot = &ahead->slot[s];
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if((state == SLOT_DONE) && (slot->seq == c - ahead->nperiods) && (slot->nframes == nframes))
+			{
+			Output(ahead, s, nframes);
+			__atomic_store_n(&slot->state, SLOT_FREE, __ATOMIC_RELEASE);
+			}
+		else
+			{
+			Output(ahead, -1, nframes);
+			__atomic_store_n(&ahead->underruns, ahead->underruns + 1, __ATOMIC_RELAXED);
+			luajack_report(LUAJACK_WARNING, cud->key, RT_Process, "compute-ahead underrun");
+			}
+		}
+	else /* the pipeline is still filling up */
+		Output(ahead, -1, nframes);
+
+	/* the matrix is executed after Output(), which would overwrite its destinations */
+	if(cud->matrix)
+		matrix_process(cud, nframes);
+
+	/* capture the inputs of this cycle */
+	s = c % ahead->nslots;
+	slot = &ahead->slot[s];
+	state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+	if(state == SLOT_DONE) /* late block, already replaced by silence */
+		state = SLOT_FREE;
+	if((state == SLOT_FREE) && (nframes <= ahead->blocksize))
+		{
+		Input(ahead, s, nframes);
+		slot->seq = c;
+		slot->nframes = nframes;
+		slot->timesok = (jack_get_cycle_times(cud->client, &slot->frame, &slot->usecs,
+								&slot->next_usecs, &slot->period_usecs) == 0);
+		__atomic_store_n(&slot->state, SLOT_FULL, __ATOMIC_RELEASE);
+		sem_post(&ahead->sem);
+		}
+	else /* the worker is still busy with this slot */
+		__atomic_store_n(&ahead->overruns, ahead->overruns + 1, __ATOMIC_RELAXED);
+	return 0;
+	}
+
+static void ALatency(jack_latency_callback_mode_t mode, void *arg)
+/* latency callback for clients in compute-ahead mode with no Lua latency callback */
+	{ ahead_latency(cud, mode); }
+
+static int ABufferSize(nframes_t nframes, void *arg)
+/* buffer size callback for clients in compute-ahead mode with no other buffer size callback */
+	{ 
+	if(!IsCudValid(cud)) return 0;
+	cud->buffer_size = nframes;
+	ahead_buffer_size(cud, nframes);
+	return 0;
+	}
+#undef cud
+
+static int Idle(ahead_t *ahead)
+/* returns 1 if the worker is not processing, nor has to process, any slot */
+	{
+	unsigned int s;
+	for(s = 0; s < ahead->nslots; s++)
+		if(__atomic_load_n(&ahead->slot[s].state, __ATOMIC_ACQUIRE) == SLOT_FULL)
+			return 0;
+	return 1;
+	}
+
+static int Alloc(ahead_t *ahead)
+/* allocates the blocks (prefaulted and locked, so that the rt-thread never page-faults) */
+	{
+	void *mem;
+	ahead->memsize = (size_t)ahead->nslots*(ahead->nports > 0 ? ahead->nports : 1)*
+								ahead->blocksize*sizeof(sample_t);
+	mem = mmap(NULL, ahead->memsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		{ ahead->mem = NULL; return -1; }
+	ahead->mem = (sample_t*)mem;
+	memset(mem, 0, ahead->memsize);
+	if(mlock(mem, ahead->memsize) != 0)
+		luajack_verbose("cannot lock compute-ahead blocks in memory (%s)\n", strerror(errno));
+	return 0;
+	}
+
+void ahead_buffer_size(cud_t *cud, nframes_t nframes)
+/* Called in the buffer size callback, while the process cycle is suspended,
+ * before any Lua code is executed in the process_state: the pipeline is drained
+ * (i.e. the worker completes the slots it has, after which it is idle and does 
+ * not touch the process_state until the next cycle) and restarted from scratch,
+ * with new blocks if the buffer size grew beyond the block size. */
+	{
+	struct timespec ts = { 0, 100000 };
+	unsigned int s;
+	sample_t *mem;
+	size_t memsize;
+	nframes_t blocksize;
+	ahead_t *ahead = AHEAD(cud);
+	if(!ahead) return;
+	while(!Idle(ahead))
+		nanosleep(&ts, NULL);
+	if(nframes > ahead->blocksize)
+		{
+		mem = ahead->mem;
+		memsize = ahead->memsize;
+		blocksize = ahead->blocksize;
+		ahead->blocksize = nframes;
+		if(Alloc(ahead) != 0)
+			{
+			/* keep the old blocks: inputs will not be captured (overruns) */
+			ahead->mem = mem;
+			ahead->memsize = memsize;
+			ahead->blocksize = blocksize;
+			luajack_report(LUAJACK_ERROR, cud->key, RT_BufferSize, 
+					"cannot reallocate compute-ahead blocks for buffer size %u", nframes);
+			}
+		else
+			munmap(mem, memsize);
+		}
+	for(s = 0; s < ahead->nslots; s++)
+		__atomic_store_n(&ahead->slot[s].state, SLOT_FREE, __ATOMIC_RELEASE);
+	__atomic_store_n(&ahead->next, 0, __ATOMIC_RELAXED); /* the worker is idle */
+	ahead->cycle = 0;
+	}
+
+void ahead_latency(cud_t *cud, jack_latency_callback_mode_t mode)
+/* propagates the latency through the client, adding the compute-ahead latency */
+	{
+	jack_latency_range_t range, r;
+	pud_t *pud;
+	unsigned long from, to;
+	ahead_t *ahead = AHEAD(cud);
+	if(!ahead) return;
+	from = (mode == JackCaptureLatency) ? JackPortIsInput : JackPortIsOutput;
+	to = (mode == JackCaptureLatency) ? JackPortIsOutput : JackPortIsInput;
+	range.min = UINT32_MAX;
+	range.max = 0;
+	for(pud = SIMPLEQ_FIRST(&(cud->fifo)); pud; pud = SIMPLEQ_NEXT(pud, cudfifoentry))
+		{
+		if(!IsPudValid(pud) || !(pud->flags & from)) continue;
+		jack_port_get_latency_range(pud->port, mode, &r);
+		if(r.min < range.min) range.min = r.min;
+		if(r.max > range.max) range.max = r.max;
+		}
+	if(range.min > range.max)
+		range.min = range.max = 0;
+	range.min += ahead->nperiods * cud->buffer_size;
+	range.max += ahead->nperiods * cud->buffer_size;
+	for(pud = SIMPLEQ_FIRST(&(cud->fifo)); pud; pud = SIMPLEQ_NEXT(pud, cudfifoentry))
+		{
+		if(!IsPudValid(pud) || !(pud->flags & to)) continue;
+		jack_port_set_latency_range(pud->port, mode, &range);
+		}
+	}
+
+/*--------------------------------------------------------------------------*
+ | Main thread                                     		            		|
+ *--------------------------------------------------------------------------*/
+
+void ahead_free(cud_t *cud)
+/* to be called with the client deactivated */
+	{
+	unsigned int i;
+	ahead_t *ahead = AHEAD(cud);
+	if(!ahead) return;
+	if(ahead->running)
+		{
+		__atomic_store_n(&ahead->stop, 1, __ATOMIC_RELEASE);
+		sem_post(&ahead->sem);
+		pthread_join(ahead->thread, NULL);
+		}
+	sem_destroy(&ahead->sem);
+	for(i = 0; i < ahead->nports; i++)
+		ahead->port[i]->ahead = 0;
+	if(ahead->mem)
+		munmap(ahead->mem, ahead->memsize);
+	if(ahead->port) Free(ahead->port);
+	if(ahead->slot) Free(ahead->slot);
+	Free(ahead);
+	cud->ahead = NULL;
+	}
+
+static int Start(cud_t *cud, ahead_t *ahead)
+	{
+	int priority, realtime;
+	unsigned int n = 0;
+	pud_t *pud;
+
+	/* serve the audio ports registered so far */
+	for(pud = SIMPLEQ_FIRST(&(cud->fifo)); pud; pud = SIMPLEQ_NEXT(pud, cudfifoentry))
+		if(IsPudValid(pud) && PortIsAudio(pud)) n++;
+	if(n > 0 && (ahead->port = (pud_t**)Malloc(n*sizeof(pud_t*))) == NULL)
+		return -1;
+	for(pud = SIMPLEQ_FIRST(&(cud->fifo)); pud; pud = SIMPLEQ_NEXT(pud, cudfifoentry))
+		if(IsPudValid(pud) && PortIsAudio(pud)) 
+			{
+			ahead->port[ahead->nports++] = pud;
+			pud->ahead = ahead->nports;
+			}
+
+	if((ahead->slot = (slot_t*)Malloc(ahead->nslots*sizeof(slot_t))) == NULL)
+		return -1;
+	memset(ahead->slot, 0, ahead->nslots*sizeof(slot_t));
+
+	if(Alloc(ahead) != 0)
+		return -1;
+
+	/* the worker runs at a priority just below the process thread's */
+	realtime = jack_is_realtime(cud->client);
+	priority = realtime ? jack_client_real_time_priority(cud->client) - 1 : 0;
+	if(priority < 0) priority = 0;
+	if(jack_client_create_thread(cud->client, &ahead->thread, priority, realtime, Worker, ahead) != 0)
+		return -1;
+	ahead->running = 1;
+	return 0;
+	}
+
+static int ProcessAhead(lua_State *L)
+/* process_ahead(client, nperiods) */
+	{
+	ahead_t *ahead;
+	cud_t *cud = cud_check(L, 1);
+	lua_Integer nperiods = luaL_checkinteger(L, 2);
+	luajack_checkcreate();
+	if(cud->ahead)
+		return luaL_error(L, "compute-ahead mode already enabled");
+	if(nperiods < 1 || nperiods > 64)
+		return luaL_argerror(L, 2, "invalid number of periods");
+	if(cud->CProcess)
+		return luaL_error(L, "compute-ahead mode not available with C process callback");
+	if(cud->workers)
+		return luaL_error(L, "compute-ahead mode not available with process workers");
+	if(!cud->process_state || cud->Process == LUA_NOREF)
+		return luaL_error(L, "missing process callback");
+	if((cud->Sync != LUA_NOREF) || (cud->Timebase != LUA_NOREF) || 
+			(cud->TimebaseConditional != LUA_NOREF))
+		return luaL_error(L, "compute-ahead mode not available with sync or timebase callbacks");
+	if((ahead = (ahead_t*)Malloc(sizeof(ahead_t))) == NULL)
+		return luaL_error(L, "cannot allocate memory");
+	memset(ahead, 0, sizeof(ahead_t));
+	ahead->cud = cud;
+	ahead->nperiods = nperiods;
+	ahead->nslots = nperiods + 1;
+	ahead->blocksize = jack_get_buffer_size(cud->client);
+	ahead->cur = -1;
+	if(sem_init(&ahead->sem, 0, 0) != 0)
+		{ Free(ahead); return luaL_error(L, "cannot create semaphore"); }
+	cud->ahead = ahead;
+	if(Start(cud, ahead) != 0)
+		{
+		ahead_free(cud);
+		return luaL_error(L, "cannot start compute-ahead worker");
+		}
+	/* replace the process callback, and take care of latency reporting 
+	 * unless a latency callback is already registered (see callback.c) */
+	if(jack_set_process_callback(cud->client, AProcess, (void*)cud) != 0)
+		{
+		ahead_free(cud);
+		return luaL_error(L, "cannot register process callback");
+		}
+	if(cud->Latency == LUA_NOREF)
+		jack_set_latency_callback(cud->client, ALatency, (void*)cud);
+	if((cud->BufferSize == LUA_NOREF) && !cud->CBufferSize) /* else see process.c */
+		jack_set_buffer_size_callback(cud->client, ABufferSize, (void*)cud);
+	luajack_verbose("compute-ahead mode enabled (%u periods, %u ports)\n", 
+				ahead->nperiods, ahead->nports);
+	return 0;
+	}
+
+static int ProcessAheadStats(lua_State *L)
+/* underruns, overruns = process_ahead_stats(client) */
+	{
+	cud_t *cud = cud_check(L, 1);
+	ahead_t *ahead = AHEAD(cud);
+	if(!ahead)
+		return luaL_error(L, "compute-ahead mode not enabled");
+	lua_pushinteger(L, __atomic_load_n(&ahead->underruns, __ATOMIC_RELAXED));
+	lua_pushinteger(L, __atomic_load_n(&ahead->overruns, __ATOMIC_RELAXED));
+	return 2;
+	}
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "process_ahead", ProcessAhead },
+		{ "process_ahead_stats", ProcessAheadStats },
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_ahead(lua_State *L, int state_type)
+	{
+	if(state_type == ST_MAIN)
+		luaL_setfuncs(L, MFunctions, 0);
+	return 1;
+	}
+
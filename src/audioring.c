@@ -0,0 +1,430 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Audio ringbuffers														*
+ ****************************************************************************/
+
+#include "internal.h"
+
+/* An audio ringbuffer carries raw frames of sample_t for a fixed number of
+ * channels, with no message headers. Frames are stored either interleaved,
+ * in a single jack ringbuffer, or planar, in a jack ringbuffer per channel
+ * (the writer fills the channels in sequence, and the reader only sees the
+ * frames that are complete in all of them).
+ *
+ * Transfers are expressed in terms of channel pointers with a stride, so that 
+ * the same code serves planar (stride = 1) and interleaved (stride = nchannels)
+ * sources and destinations.
+ */
+
+#define MAX_CHANNELS 64
+
+typedef struct {
+	unsigned int nchannels;
+	int		interleaved;
+	jack_ringbuffer_t *rb[]; /* rb[0] if interleaved, rb[0..nchannels-1] otherwise */
+} audioring_t;
+
+#define AR(rud) ((audioring_t*)(rud)->audio)
+#define NRB(ar) ((ar)->interleaved ? 1 : (ar)->nchannels)
+
+static sample_t *Slot(jack_ringbuffer_data_t vec[2], size_t i)
+/* address of the i-th sample in a read/write vector */
+	{
+	size_t n0 = vec[0].len / sizeof(sample_t);
+	return (i < n0) ? (sample_t*)vec[0].buf + i : (sample_t*)vec[1].buf + (i - n0);
+	}
+
+size_t audioring_write_space(rud_t *rud)
+/* frames that can be written */
+	{
+	unsigned int c;
+	size_t n, space;
+	audioring_t *ar = AR(rud);
+	if(ar->interleaved)
+		return jack_ringbuffer_write_space(ar->rb[0]) / (ar->nchannels*sizeof(sample_t));
+	space = jack_ringbuffer_write_space(ar->rb[0]) / sizeof(sample_t);
+	for(c = 1; c < ar->nchannels; c++)
+		if((n = jack_ringbuffer_write_space(ar->rb[c]) / sizeof(sample_t)) < space) space = n;
+	return space;
+	}
+
+size_t audioring_read_space(rud_t *rud)
+/* frames that can be read */
+	{
+	unsigned int c;
+	size_t n, space;
+	audioring_t *ar = AR(rud);
+	if(ar->interleaved)
+		return jack_ringbuffer_read_space(ar->rb[0]) / (ar->nchannels*sizeof(sample_t));
+	space = jack_ringbuffer_read_space(ar->rb[0]) / sizeof(sample_t);
+	for(c = 1; c < ar->nchannels; c++)
+		if((n = jack_ringbuffer_read_space(ar->rb[c]) / sizeof(sample_t)) < space) space = n;
+	return space;
+	}
+
+size_t audioring_put(rud_t *rud, const sample_t *const *src, size_t stride, size_t nframes)
+/* writes up to nframes frames, sample c of frame f being at src[c][f*stride]
+ * (src[c] = NULL for silence); returns the number of frames written */
+	{
+	jack_ringbuffer_data_t vec[2];
+	unsigned int c;
+	size_t f, space;
+	audioring_t *ar = AR(rud);
+	unsigned int nch = ar->nchannels;
+
+	if((space = audioring_write_space(rud)) < nframes)
+		nframes = space;
+	if(nframes == 0) return 0;
+
+	if(ar->interleaved)
+		{
+		if((stride == nch) && src[0] && ((nch == 1) || (src[1] == src[0] + 1)))
+			/* interleaved to interleaved (assumes src[c] = src[0] + c) */
+			jack_ringbuffer_write(ar->rb[0], (const char*)src[0], nframes*nch*sizeof(sample_t));
+		else
+			{
+			jack_ringbuffer_get_write_vector(ar->rb[0], vec);
+			for(c = 0; c < nch; c++)
+				for(f = 0; f < nframes; f++)
+					*Slot(vec, f*nch + c) = src[c] ? src[c][f*stride] : 0;
+			jack_ringbuffer_write_advance(ar->rb[0], nframes*nch*sizeof(sample_t));
+			}
+		return nframes;
+		}
+
+	for(c = 0; c < nch; c++)
+		{
+		if(src[c] && (stride == 1))
+			jack_ringbuffer_write(ar->rb[c], (const char*)src[c], nframes*sizeof(sample_t));
+		else
+			{
+			jack_ringbuffer_get_write_vector(ar->rb[c], vec);
+			for(f = 0; f < nframes; f++)
+				*Slot(vec, f) = src[c] ? src[c][f*stride] : 0;
+			jack_ringbuffer_write_advance(ar->rb[c], nframes*sizeof(sample_t));
+			}
+		}
+	return nframes;
+	}
+
+size_t audioring_get(rud_t *rud, sample_t *const *dst, size_t stride, size_t nframes)
+/* reads up to nframes frames, storing sample c of frame f at dst[c][f*stride]
+ * (dst[c] = NULL to discard the channel); returns the number of frames read */
+	{
+	jack_ringbuffer_data_t vec[2];
+	unsigned int c;
+	size_t f, space;
+	audioring_t *ar = AR(rud);
+	unsigned int nch = ar->nchannels;
+
+	if((space = audioring_read_space(rud)) < nframes)
+		nframes = space;
+	if(nframes == 0) return 0;
+
+	if(ar->interleaved)
+		{
+		if((stride == nch) && dst[0] && ((nch == 1) || (dst[1] == dst[0] + 1)))
+			jack_ringbuffer_read(ar->rb[0], (char*)dst[0], nframes*nch*sizeof(sample_t));
+		else
+			{
+			jack_ringbuffer_get_read_vector(ar->rb[0], vec);
+			for(c = 0; c < nch; c++)
+				if(dst[c])
+					for(f = 0; f < nframes; f++)
+						dst[c][f*stride] = *Slot(vec, f*nch + c);
+			jack_ringbuffer_read_advance(ar->rb[0], nframes*nch*sizeof(sample_t));
+			}
+		return nframes;
+		}
+
+	for(c = 0; c < nch; c++)
+		{
+		if(dst[c] && (stride == 1))
+			jack_ringbuffer_read(ar->rb[c], (char*)dst[c], nframes*sizeof(sample_t));
+		else
+			{
+			if(dst[c])
+				{
+				jack_ringbuffer_get_read_vector(ar->rb[c], vec);
+				for(f = 0; f < nframes; f++)
+					dst[c][f*stride] = *Slot(vec, f);
+				}
+			jack_ringbuffer_read_advance(ar->rb[c], nframes*sizeof(sample_t));
+			}
+		}
+	return nframes;
+	}
+
+size_t audioring_put_interleaved(rud_t *rud, const sample_t *buf, size_t nframes)
+	{
+	unsigned int c;
+	const sample_t *src[MAX_CHANNELS];
+	for(c = 0; c < AR(rud)->nchannels; c++) src[c] = buf + c;
+	return audioring_put(rud, src, AR(rud)->nchannels, nframes);
+	}
+
+size_t audioring_get_interleaved(rud_t *rud, sample_t *buf, size_t nframes)
+	{
+	unsigned int c;
+	sample_t *dst[MAX_CHANNELS];
+	for(c = 0; c < AR(rud)->nchannels; c++) dst[c] = buf + c;
+	return audioring_get(rud, dst, AR(rud)->nchannels, nframes);
+	}
+
+void audioring_free(rud_t *rud)
+	{
+	unsigned int c;
+	audioring_t *ar = AR(rud);
+	if(!ar) return;
+	for(c = 0; c < NRB(ar); c++)
+		if(ar->rb[c]) ringbuffer_free(ar->rb[c]);
+	Free(ar);
+	rud->audio = NULL;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Lua functions                                                            |
+ *--------------------------------------------------------------------------*/
+
+static rud_t *CheckAudioRing(lua_State *L, int arg)
+	{
+	rud_t *rud = rud_check(L, arg);
+	if(!rud->audio)
+		luaL_argerror(L, arg, "not an audio ringbuffer");
+	return rud;
+	}
+
+static sample_t *PortBuffer(lua_State *L, pud_t *pud)
+/* retrieves the buffer of an audio port in the current process cycle
+ * (without affecting get_buffer()) */
+	{
+	cud_t *cud = pud->cud;
+	if(!IsProcessCallback(cud))
+		luaL_error(L, "function available only in process callback");
+	if(!PortIsAudio(pud))
+		luaL_error(L, "not an audio port");
+	if(pud->buf)
+		return (sample_t*)pud->buf;
+	return (sample_t*)(cud->ahead ? ahead_buffer(pud) : jack_port_get_buffer(pud->port, cud->nframes));
+	}
+
+static unsigned int CheckPorts(lua_State *L, int arg, rud_t *rud, sample_t **bufs, int output)
+/* gets the buffers of a port or of a table of ports (one per channel) */
+	{
+	pud_t *pud;
+	unsigned int c, n;
+	audioring_t *ar = AR(rud);
+	if(lua_type(L, arg) != LUA_TTABLE)
+		{
+		n = 1;
+		lua_pushvalue(L, arg);
+		}
+	else
+		n = luaL_len(L, arg);
+	if(n != ar->nchannels)
+		luaL_argerror(L, arg, "the number of ports does not match the number of channels");
+	for(c = 0; c < n; c++)
+		{
+		if(lua_type(L, arg) == LUA_TTABLE)
+			lua_rawgeti(L, arg, c + 1);
+		pud = pud_check(L, -1);
+		lua_pop(L, 1);
+		if(output && !PortIsOutput(pud))
+			luaL_argerror(L, arg, "output port expected");
+		if((bufs[c] = PortBuffer(L, pud)) == NULL)
+			luaL_error(L, "cannot get port buffer");
+		}
+	return n;
+	}
+
+static int PortToRing(lua_State *L)
+/* n = port_to_ring(port | ports, rbuf [, nframes]) */
+	{
+	sample_t *bufs[MAX_CHANNELS];
+	rud_t *rud = CheckAudioRing(L, 2);
+	lua_Integer nframes;
+	CheckPorts(L, 1, rud, bufs, 0);
+	nframes = luaL_optinteger(L, 3, rud->cud->nframes);
+	if((nframes < 0) || (nframes > (lua_Integer)rud->cud->nframes))
+		return luaL_argerror(L, 3, "invalid number of frames");
+	lua_pushinteger(L, audioring_put(rud, (const sample_t *const*)bufs, 1, nframes));
+	return 1;
+	}
+
+static int RingToPort(lua_State *L)
+/* n = ring_to_port(port | ports, rbuf [, nframes]) 
+ * frames not available in the ringbuffer are zeroed */
+	{
+	sample_t *bufs[MAX_CHANNELS];
+	unsigned int c, nch;
+	size_t n;
+	rud_t *rud = CheckAudioRing(L, 2);
+	lua_Integer nframes;
+	nch = CheckPorts(L, 1, rud, bufs, 1);
+	nframes = luaL_optinteger(L, 3, rud->cud->nframes);
+	if((nframes < 0) || (nframes > (lua_Integer)rud->cud->nframes))
+		return luaL_argerror(L, 3, "invalid number of frames");
+	n = audioring_get(rud, bufs, 1, nframes);
+	if(n < (size_t)nframes)
+		for(c = 0; c < nch; c++)
+			memset(bufs[c] + n, 0, (nframes - n)*sizeof(sample_t));
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
+static int AudioRingbufferWrite(lua_State *L)
+/* n = audio_ringbuffer_write(rbuf, data)
+ * data = string of interleaved native samples */
+	{
+	size_t len, framesize;
+	rud_t *rud = CheckAudioRing(L, 1);
+	const char *data = luaL_checklstring(L, 2, &len);
+	framesize = AR(rud)->nchannels*sizeof(sample_t);
+	if(len % framesize)
+		return luaL_argerror(L, 2, "length is not a multiple of the frame size");
+	if((uintptr_t)data % sizeof(sample_t) != 0) /* should not happen */
+		return luaL_error(L, UNEXPECTED_ERROR);
+	lua_pushinteger(L, audioring_put_interleaved(rud, (const sample_t*)data, len/framesize));
+	return 1;
+	}
+
+static int AudioRingbufferRead(lua_State *L)
+/* data = audio_ringbuffer_read(rbuf [, nframes])
+ * data = string of interleaved native samples (possibly empty) */
+	{
+	luaL_Buffer b;
+	size_t n, framesize;
+	rud_t *rud = CheckAudioRing(L, 1);
+	lua_Integer nframes = luaL_optinteger(L, 2, audioring_read_space(rud));
+	framesize = AR(rud)->nchannels*sizeof(sample_t);
+	if(nframes < 0)
+		return luaL_argerror(L, 2, "invalid number of frames");
+	if((n = audioring_read_space(rud)) < (size_t)nframes)
+		nframes = n;
+	n = audioring_get_interleaved(rud, (sample_t*)luaL_buffinitsize(L, &b, nframes*framesize), nframes);
+	luaL_pushresultsize(&b, n*framesize);
+	return 1;
+	}
+
+static int AudioRingbufferSpace(lua_State *L)
+/* readable, writable = audio_ringbuffer_space(rbuf) (in frames) */
+	{
+	rud_t *rud = CheckAudioRing(L, 1);
+	lua_pushinteger(L, audioring_read_space(rud));
+	lua_pushinteger(L, audioring_write_space(rud));
+	return 2;
+	}
+
+static int AudioRingbuffer(lua_State *L)
+/* rbuf = audio_ringbuffer(client, nframes, nchannels [, interleaved [, mlock]]) */
+	{
+	rud_t *rud;
+	audioring_t *ar;
+	unsigned int c, nrb;
+	size_t sz;
+	cud_t *cud = cud_check(L, 1);
+	lua_Integer nframes = luaL_checkinteger(L, 2);
+	lua_Integer nchannels = luaL_checkinteger(L, 3);
+	int interleaved = lua_toboolean(L, 4);
+	int mlock = lua_toboolean(L, 5);
+
+	luajack_checkcreate();
+	if(nframes < 1)
+		return luaL_argerror(L, 2, "invalid number of frames");
+	if((nchannels < 1) || (nchannels > MAX_CHANNELS))
+		return luaL_argerror(L, 3, "invalid number of channels");
+
+	nrb = interleaved ? 1 : nchannels;
+	if((ar = (audioring_t*)Malloc(sizeof(audioring_t) + nrb*sizeof(jack_ringbuffer_t*))) == NULL)
+		return luaL_error(L, "cannot allocate memory");
+	memset(ar, 0, sizeof(audioring_t) + nrb*sizeof(jack_ringbuffer_t*));
+	ar->nchannels = nchannels;
+	ar->interleaved = interleaved;
+	/* one byte more, since a jack ringbuffer can not be filled up completely */
+	sz = nframes*(interleaved ? nchannels : 1)*sizeof(sample_t) + 1;
+	for(c = 0; c < nrb; c++)
+		if((ar->rb[c] = ringbuffer_new(sz, mlock)) == NULL)
+			{
+			while(c-- > 0) ringbuffer_free(ar->rb[c]);
+			Free(ar);
+			return luaL_error(L, "cannot create ringbuffer");
+			}
+
+	if((rud = rud_new()) == NULL)
+		{
+		for(c = 0; c < nrb; c++) ringbuffer_free(ar->rb[c]);
+		Free(ar);
+		return luaL_error(L, "cannot create userdata");
+		}
+	rud->cud = cud;
+	rud->pipefd[0] = rud->pipefd[1] = -1;
+	rud->audio = ar;
+	luajack_verbose("created audio ringbuffer %u (frames=%u, channels=%u, interleaved=%d)\n",
+			rud->key, (unsigned int)nframes, ar->nchannels, interleaved);
+	lua_pushinteger(L, rud->key);
+	return 1;
+	}
+
+#define METHODS  \
+		{ "audio_ringbuffer_write", AudioRingbufferWrite },	\
+		{ "audio_ringbuffer_read", AudioRingbufferRead },	\
+		{ "audio_ringbuffer_space", AudioRingbufferSpace }	\
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "audio_ringbuffer", AudioRingbuffer },
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+static const struct luaL_Reg PFunctions[] = 
+	{
+		{ "port_to_ring", PortToRing },
+		{ "ring_to_port", RingToPort },
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+static const struct luaL_Reg TFunctions[] = 
+	{
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_audioring(lua_State *L, int state_type)
+	{
+	switch(state_type)
+		{
+		case ST_MAIN: luaL_setfuncs(L, MFunctions, 0); break;
+		case ST_PROCESS: luaL_setfuncs(L, PFunctions, 0); break;
+		case ST_THREAD: luaL_setfuncs(L, TFunctions, 0); break;
+		default:
+			break;
+		}
+	return 1;
+	}
+
@@ -0,0 +1,368 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Broadcast rings															*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <sys/mman.h>
+
+/* A broadcast ring carries tag/len messages (same format as in ringbuffer.c)
+ * from a single writer to any number of readers, each with its own cursor.
+ * Messages are written once, and the writer never waits for the readers: 
+ * when it needs space it just overwrites the oldest messages, and the readers
+ * that were left behind skip to the oldest message still available (overrun).
+ *
+ * Positions are 64-bit byte counters that never wrap (the byte at position p
+ * is at p & mask in the buffer):
+ * - head is the end of the last published message;
+ * - tail is the start of the oldest message not yet overwritten.
+ * The writer advances tail before overwriting, and a reader checks tail after
+ * copying a message (seqlock-like), so it never returns torn data.
+ */
+
+typedef struct { /* same as in ringbuffer.c */
+	int32_t	tag;
+	uint32_t len;	/* length of data that follow */
+} hdr_t;
+
+typedef struct {
+	char	*buf;
+	size_t	size;		/* power of 2 */
+	size_t	mask;
+	uint64_t head;		/* atomic */
+	char	pad[64];
+	uint64_t tail;		/* atomic */
+} bcast_t;
+
+typedef struct {
+	bcast_t	*bc;
+	uint64_t pos;		/* next message to read */
+	uint64_t overruns;	/* number of times the reader was left behind */
+} bcreader_t;
+
+#define BC(rud) ((bcast_t*)(rud)->bcast)
+#define RD(rud) ((bcreader_t*)(rud)->bcreader)
+
+static void CopyIn(bcast_t *bc, uint64_t pos, const void *src, size_t n)
+	{
+	size_t ofs = pos & bc->mask;
+	size_t n0 = bc->size - ofs;
+	if(n0 >= n)
+		memcpy(bc->buf + ofs, src, n);
+	else
+		{
+		memcpy(bc->buf + ofs, src, n0);
+		memcpy(bc->buf, (const char*)src + n0, n - n0);
+		}
+	}
+
+static void CopyOut(bcast_t *bc, uint64_t pos, void *dst, size_t n)
+	{
+	size_t ofs = pos & bc->mask;
+	size_t n0 = bc->size - ofs;
+	if(n0 >= n)
+		memcpy(dst, bc->buf + ofs, n);
+	else
+		{
+		memcpy(dst, bc->buf + ofs, n0);
+		memcpy((char*)dst + n0, bc->buf, n - n0);
+		}
+	}
+
+int bcast_write(rud_t *rud, uint32_t tag, const void *data, size_t len)
+/* returns 1 on success, or 0 if the message does not fit in the ring */
+	{
+	hdr_t hdr, old;
+	bcast_t *bc = BC(rud);
+	uint64_t head = bc->head; /* owned by the writer */
+	uint64_t tail = bc->tail;
+	size_t need = sizeof(hdr) + len;
+	if(need > bc->size) return 0;
+	/* make room, discarding the oldest messages */
+	if(head + need - tail > bc->size)
+		{
+		while(head + need - tail > bc->size)
+			{
+			CopyOut(bc, tail, &old, sizeof(old));
+			tail += sizeof(old) + old.len;
+			}
+		__atomic_store_n(&bc->tail, tail, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE); /* before overwriting (see ReadAt) */
+		}
+	hdr.tag = tag;
+	hdr.len = len;
+	CopyIn(bc, head, &hdr, sizeof(hdr));
+	if(len) CopyIn(bc, head + sizeof(hdr), data, len);
+	__atomic_store_n(&bc->head, head + need, __ATOMIC_RELEASE);
+	return 1;
+	}
+
+static int Valid(bcast_t *bc, uint64_t pos)
+/* checks, after reading at pos, that what was read was not being overwritten */
+	{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&bc->tail, __ATOMIC_RELAXED) <= pos;
+	}
+
+static int Next(bcreader_t *rd, hdr_t *hdr, int *overrun)
+/* gets the header of the next message, skipping to the oldest available one
+ * if the reader was left behind. Returns 0 if there are no new messages */
+	{
+	bcast_t *bc = rd->bc;
+	uint64_t head, tail;
+	for(;;)
+		{
+		head = __atomic_load_n(&bc->head, __ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&bc->tail, __ATOMIC_ACQUIRE);
+		if(rd->pos < tail)
+			{
+			rd->pos = tail;
+			rd->overruns++;
+			*overrun = 1;
+			continue;
+			}
+		if(rd->pos >= head) return 0;
+		CopyOut(bc, rd->pos, hdr, sizeof(*hdr));
+		if(Valid(bc, rd->pos)) return 1;
+		}
+	}
+
+int bcast_read(rud_t *rud, uint32_t *tag, void *buf, size_t bufsz, size_t *len, int *overrun)
+/* C version: returns 1 on success and 0 if there are no new messages */
+	{
+	hdr_t hdr;
+	bcreader_t *rd = RD(rud);
+	*overrun = 0;
+	for(;;)
+		{
+		if(!Next(rd, &hdr, overrun)) return 0;
+		if(hdr.len > bufsz)
+			return luajack_error("not enough space for broadcast_read() "
+						"(at least %u bytes needed)", hdr.len);
+		CopyOut(rd->bc, rd->pos + sizeof(hdr), buf, hdr.len);
+		if(Valid(rd->bc, rd->pos)) break;
+		/* else overwritten while copying: retry */
+		}
+	rd->pos += sizeof(hdr) + hdr.len;
+	*tag = hdr.tag;
+	*len = hdr.len;
+	return 1;
+	}
+
+uint64_t bcast_overruns(rud_t *rud)
+	{
+	return RD(rud)->overruns;
+	}
+
+void bcast_free(rud_t *rud)
+	{
+	bcast_t *bc = BC(rud);
+	if(bc)
+		{
+		munmap(bc->buf, bc->size);
+		Free(bc);
+		rud->bcast = NULL;
+		}
+	if(rud->bcreader)
+		{
+		Free(rud->bcreader);
+		rud->bcreader = NULL;
+		}
+	}
+
+/*--------------------------------------------------------------------------*
+ | Lua functions                                                            |
+ *--------------------------------------------------------------------------*/
+
+static rud_t *CheckBroadcast(lua_State *L, int arg)
+	{
+	rud_t *rud = rud_check(L, arg);
+	if(!rud->bcast)
+		luaL_argerror(L, arg, "not a broadcast ring");
+	return rud;
+	}
+
+static rud_t *CheckReader(lua_State *L, int arg)
+	{
+	rud_t *rud = rud_check(L, arg);
+	if(!rud->bcreader)
+		luaL_argerror(L, arg, "not a broadcast reader");
+	return rud;
+	}
+
+static int BroadcastWrite(lua_State *L)
+/* ok = broadcast_write(bcast, tag [, data]) */
+	{
+	int isnum;
+	size_t len = 0;
+	const char *data;
+	rud_t *rud = CheckBroadcast(L, 1);
+	uint32_t tag = (uint32_t)lua_tointegerx(L, 2, &isnum);
+	if(!isnum)
+		return luaL_error(L, "invalid tag");
+	data = luaL_optlstring(L, 3, NULL, &len);
+	lua_pushboolean(L, bcast_write(rud, tag, data, len));
+	return 1;
+	}
+
+static int BroadcastRead(lua_State *L)
+/* tag, data, overrun = broadcast_read(reader) 
+ * overrun = true if some messages were lost before this one */
+	{
+	hdr_t hdr;
+	luaL_Buffer b;
+	int overrun = 0;
+	rud_t *rud = CheckReader(L, 1);
+	bcreader_t *rd = RD(rud);
+	for(;;)
+		{
+		if(!Next(rd, &hdr, &overrun))
+			{ lua_pushnil(L); lua_pushnil(L); lua_pushboolean(L, overrun); return 3; }
+		CopyOut(rd->bc, rd->pos + sizeof(hdr), luaL_buffinitsize(L, &b, hdr.len), hdr.len);
+		luaL_pushresultsize(&b, hdr.len);
+		if(Valid(rd->bc, rd->pos)) break;
+		lua_pop(L, 1); /* overwritten while copying: retry */
+		}
+	rd->pos += sizeof(hdr) + hdr.len;
+	lua_pushinteger(L, hdr.tag);
+	lua_insert(L, -2);
+	lua_pushboolean(L, overrun);
+	return 3;
+	}
+
+static int BroadcastOverruns(lua_State *L)
+/* n = broadcast_overruns(reader) */
+	{
+	rud_t *rud = CheckReader(L, 1);
+	lua_pushinteger(L, bcast_overruns(rud));
+	return 1;
+	}
+
+static int Broadcast(lua_State *L)
+/* bcast = broadcast(client, size [, mlock]) */
+	{
+	rud_t *rud;
+	bcast_t *bc;
+	size_t sz;
+	void *mem;
+	cud_t *cud = cud_check(L, 1);
+	lua_Integer size = luaL_checkinteger(L, 2);
+	int mlock_ = lua_toboolean(L, 3);
+
+	luajack_checkcreate();
+	if((size < 1) || (size > UINT32_MAX))
+		return luaL_argerror(L, 2, "invalid size");
+	for(sz = 1; sz < (size_t)size; sz <<= 1);
+	if((bc = (bcast_t*)Malloc(sizeof(bcast_t))) == NULL)
+		return luaL_error(L, "cannot allocate memory");
+	memset(bc, 0, sizeof(bcast_t));
+	mem = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		{ Free(bc); return luaL_error(L, "cannot allocate memory"); }
+	if(mlock_ && (mlock(mem, sz) != 0))
+		luajack_verbose("cannot lock broadcast ring in memory (%s)\n", strerror(errno));
+	bc->buf = (char*)mem;
+	bc->size = sz;
+	bc->mask = sz - 1;
+	if((rud = rud_new()) == NULL)
+		{
+		munmap(mem, sz);
+		Free(bc);
+		return luaL_error(L, "cannot create userdata");
+		}
+	rud->cud = cud;
+	rud->pipefd[0] = rud->pipefd[1] = -1;
+	rud->bcast = bc;
+	luajack_verbose("created broadcast ring %u (size=%u)\n", rud->key, (unsigned int)sz);
+	lua_pushinteger(L, rud->key);
+	return 1;
+	}
+
+static int BroadcastReader(lua_State *L)
+/* reader = broadcast_reader(bcast) 
+ * the reader starts from the messages written after its creation */
+	{
+	rud_t *rud;
+	bcreader_t *rd;
+	rud_t *brud = CheckBroadcast(L, 1);
+	luajack_checkcreate();
+	if((rd = (bcreader_t*)Malloc(sizeof(bcreader_t))) == NULL)
+		return luaL_error(L, "cannot allocate memory");
+	memset(rd, 0, sizeof(bcreader_t));
+	rd->bc = BC(brud);
+	rd->pos = __atomic_load_n(&rd->bc->head, __ATOMIC_ACQUIRE);
+	if((rud = rud_new()) == NULL)
+		{
+		Free(rd);
+		return luaL_error(L, "cannot create userdata");
+		}
+	rud->cud = brud->cud;
+	rud->pipefd[0] = rud->pipefd[1] = -1;
+	rud->bcreader = rd;
+	luajack_verbose("created broadcast reader %u (ring %u)\n", rud->key, brud->key);
+	lua_pushinteger(L, rud->key);
+	return 1;
+	}
+
+#define METHODS  \
+		{ "broadcast_write", BroadcastWrite },	\
+		{ "broadcast_read", BroadcastRead },	\
+		{ "broadcast_overruns", BroadcastOverruns }	\
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "broadcast", Broadcast },
+		{ "broadcast_reader", BroadcastReader },
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+static const struct luaL_Reg PFunctions[] = 
+	{
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+static const struct luaL_Reg TFunctions[] = 
+	{
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_bcast(lua_State *L, int state_type)
+	{
+	switch(state_type)
+		{
+		case ST_MAIN: luaL_setfuncs(L, MFunctions, 0); break;
+		case ST_PROCESS: luaL_setfuncs(L, PFunctions, 0); break;
+		case ST_THREAD: luaL_setfuncs(L, TFunctions, 0); break;
+		default:
+			break;
+		}
+	return 1;
+	}
+
@@ -59,6 +59,7 @@ static nframes_t Avail(pud_t * pud) /* available space / frames */
 }
 
 static size_t MidiSpace(pud_t *pud);
+static int PushView(lua_State *L, pud_t *pud);
 
 static int GetBuffer(lua_State *L)
     {
@@ -67,9 +68,14 @@ static int GetBuffer(lua_State *L)
     CheckProcess(L, pud);
     if(pud->buf != NULL) 
         luaL_error(L, "buffer already retrieved");
+    if(pud->worker != worker_self())
+        luaL_error(L, "port is owned by another process context");
 
     pud->nframes = pud->cud->nframes;
-    pud->buf = jack_port_get_buffer(pud->port, pud->nframes);
+    if(pud->cud->ahead) /* compute-ahead worker */
+        pud->buf = ahead_buffer(pud);
+    else
+        pud->buf = jack_port_get_buffer(pud->port, pud->nframes);
     if(pud->buf == NULL) 
         luaL_error((L), "cannot get port buffer");
     pud->bufp = 0;
@@ -91,6 +97,8 @@ static int GetBuffer(lua_State *L)
             }
         }
     lua_pushinteger(L, pud->nframes);
+    if(PortIsAudio(pud) && lua_toboolean(L, 2))
+        return 1 + PushView(L, pud);
     return 1;
     }
 
@@ -210,7 +218,7 @@ static int AudioCopy(lua_State *L, pud_t *pud)
     /* eventually copy the samples and advance the positions */
     if(count > 0)
         {
-        memcpy(pud->buf, srcpud->buf, count * sizeof(nframes_t));
+        memcpy(&BUF(pud)[pud->bufp], &BUF(srcpud)[srcpud->bufp], count * sizeof(sample_t));
         srcpud->bufp += count;
         pud->bufp += count;
         }
@@ -219,6 +227,272 @@ static int AudioCopy(lua_State *L, pud_t *pud)
     return 1;
     }
 
+/*--------------------------------------------------------------------------*
+ | Bulk table I/O (audio ports only)                                        |
+ *--------------------------------------------------------------------------*/
+
+#define CheckIsAudio(L, pud) do {                                   \
+    if(!PortIsAudio((pud)))                                         \
+        luaL_error((L), "method not available for this port type"); \
+} while(0)
+
+static int ReadInto(lua_State *L)
+/* count = read_into(port, tbl [, dst_off [, n]])
+ * copies up to n samples from the current position of the (input) port
+ * buffer into tbl[dst_off+1], ..., tbl[dst_off+n] (array part, raw access)
+ */
+    {
+    lua_Integer dst_off, count;
+    nframes_t i, n, avail;
+    pud_t *pud = pud_check(L, 1);
+    CheckProcess(L, pud);
+    CheckIsAudio(L, pud);
+    CheckBuffer(L, pud);
+    CheckIsInput(L, pud);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    dst_off = luaL_optinteger(L, 3, 0);
+    if(dst_off < 0)
+        return luaL_argerror(L, 3, "offset must be non-negative");
+    avail = Avail(pud);
+    count = luaL_optinteger(L, 4, avail);
+    if(count < 0)
+        return luaL_argerror(L, 4, "count must be non-negative");
+    n = count > (lua_Integer)avail ? avail : (nframes_t)count;
+    for(i = 0; i < n; i++)
+        {
+        lua_pushnumber(L, BUF(pud)[pud->bufp + i]);
+        lua_rawseti(L, 2, dst_off + i + 1);
+        }
+    pud->bufp += n;
+    lua_pushinteger(L, n);
+    return 1;
+    }
+
+static int WriteFrom(lua_State *L)
+/* count = write_from(port, tbl [, src_off [, n]])
+ * copies up to n samples from tbl[src_off+1], ..., tbl[src_off+n] (array part,
+ * raw access) to the current position of the (output) port buffer;
+ * stops at the first element that is not a number
+ */
+    {
+    int isnum;
+    lua_Integer src_off, len, count;
+    nframes_t i, n, space;
+    sample_t sample;
+    pud_t *pud = pud_check(L, 1);
+    CheckProcess(L, pud);
+    CheckIsAudio(L, pud);
+    CheckBuffer(L, pud);
+    CheckIsOutput(L, pud);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    src_off = luaL_optinteger(L, 3, 0);
+    if(src_off < 0)
+        return luaL_argerror(L, 3, "offset must be non-negative");
+    space = Avail(pud);
+    len = (lua_Integer)lua_rawlen(L, 2) - src_off;
+    if(len < 0) len = 0;
+    if((lua_Integer)space > len) space = len;
+    count = luaL_optinteger(L, 4, space);
+    if(count < 0)
+        return luaL_argerror(L, 4, "count must be non-negative");
+    n = count > (lua_Integer)space ? space : (nframes_t)count;
+    for(i = 0; i < n; i++)
+        {
+        lua_rawgeti(L, 2, src_off + i + 1);
+        sample = lua_tonumberx(L, -1, &isnum);
+        lua_pop(L, 1);
+        if(!isnum) break;
+        BUF(pud)[pud->bufp + i] = sample;
+        }
+    pud->bufp += i;
+    lua_pushinteger(L, i);
+    return 1;
+    }
+
+/*--------------------------------------------------------------------------*
+ | Buffer views (audio ports only)                                          |
+ *--------------------------------------------------------------------------*/
+
+/* A buffer view is a userdata that aliases the port buffer memory, so that
+ * the script can access samples with buf[i] and #buf, without pushing and
+ * popping them one by one on the Lua stack.
+ * There is (at most) one view per port, created at the first get_buffer() call
+ * that requests it and then reused at each process cycle. The view is anchored
+ * in the process_state registry, so it is never collected, and it is invalidated
+ * by buffer_drop_all() at the end of the process callback.
+ */
+
+#define BUFVIEW_MT "luajack_bufview"
+
+typedef struct {
+    pud_t       *pud;   /* the port the view belongs to */
+    sample_t    *buf;   /* aliases pud->buf (NULL if the view is not valid) */
+    nframes_t   nframes;
+} bufview_t;
+
+#define CheckView(L, view) do {                                             \
+    if((view)->buf == NULL)                                                 \
+        luaL_error((L), "buffer view is not valid (missing get_buffer() call?)");\
+} while(0)
+
+#define CheckViewIsOutput(L, view) do {                                     \
+    if(!PortIsOutput((view)->pud))                                          \
+        luaL_error((L), "operation allowed only on output ports");          \
+} while(0)
+
+static int PushView(lua_State *L, pud_t *pud)
+    {
+    bufview_t *view = (bufview_t*)pud->view;
+    if(!view)
+        {
+        view = (bufview_t*)lua_newuserdata(L, sizeof(bufview_t));
+        view->pud = pud;
+        luaL_setmetatable(L, BUFVIEW_MT);
+        lua_pushvalue(L, -1);
+        pud->viewref = luaL_ref(L, LUA_REGISTRYINDEX);
+        pud->view = (void*)view;
+        }
+    else
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pud->viewref);
+    view->buf = BUF(pud);
+    view->nframes = pud->nframes;
+    return 1;
+    }
+
+static int ViewIndex(lua_State *L)
+/* sample = buf[i] (or method lookup) */
+    {
+    int isnum;
+    lua_Integer i;
+    bufview_t *view = (bufview_t*)lua_touserdata(L, 1);
+    i = lua_tointegerx(L, 2, &isnum);
+    if(!isnum) /* method */
+        {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+        return 1;
+        }
+    CheckView(L, view);
+    if((i < 1) || (i > (lua_Integer)view->nframes))
+        { lua_pushnil(L); return 1; }
+    lua_pushnumber(L, view->buf[i-1]);
+    return 1;
+    }
+
+static int ViewNewindex(lua_State *L)
+/* buf[i] = sample */
+    {
+    int isnum;
+    lua_Integer i;
+    bufview_t *view = (bufview_t*)lua_touserdata(L, 1);
+    CheckView(L, view);
+    CheckViewIsOutput(L, view);
+    i = lua_tointegerx(L, 2, &isnum);
+    if(!isnum || (i < 1) || (i > (lua_Integer)view->nframes))
+        return luaL_error(L, "index is out of range");
+    view->buf[i-1] = luaL_checknumber(L, 3);
+    return 0;
+    }
+
+static int ViewLen(lua_State *L)
+    {
+    bufview_t *view = (bufview_t*)lua_touserdata(L, 1);
+    lua_pushinteger(L, view->buf ? view->nframes : 0);
+    return 1;
+    }
+
+static int ViewFill(lua_State *L)
+/* count = buf:fill(value [, first [, count]]) */
+    {
+    nframes_t first, count, i;
+    sample_t value;
+    bufview_t *view = (bufview_t*)luaL_checkudata(L, 1, BUFVIEW_MT);
+    CheckView(L, view);
+    CheckViewIsOutput(L, view);
+    value = luaL_checknumber(L, 2);
+    first = luaL_optinteger(L, 3, 1);
+    if((first < 1) || (first > view->nframes))
+        return luaL_error(L, "index is out of range");
+    first--;
+    count = luaL_optinteger(L, 4, view->nframes - first);
+    if(count > view->nframes - first)
+        count = view->nframes - first;
+    if(value == 0)
+        memset(&view->buf[first], 0, sizeof(sample_t)*count);
+    else
+        for(i = 0; i < count; i++)
+            view->buf[first + i] = value;
+    lua_pushinteger(L, count);
+    return 1;
+    }
+
+static int ViewCopyFrom(lua_State *L)
+/* count = buf:copy_from(srcbuf [, count]) */
+    {
+    nframes_t count;
+    bufview_t *view = (bufview_t*)luaL_checkudata(L, 1, BUFVIEW_MT);
+    bufview_t *src = (bufview_t*)luaL_checkudata(L, 2, BUFVIEW_MT);
+    CheckView(L, view);
+    CheckView(L, src);
+    CheckViewIsOutput(L, view);
+    count = view->nframes < src->nframes ? view->nframes : src->nframes;
+    count = luaL_optinteger(L, 3, count);
+    if(count > view->nframes) count = view->nframes;
+    if(count > src->nframes) count = src->nframes;
+    if((count > 0) && (view->buf != src->buf))
+        memcpy(view->buf, src->buf, sizeof(sample_t)*count);
+    lua_pushinteger(L, count);
+    return 1;
+    }
+
+static const struct luaL_Reg VMethods [] = 
+    {
+        { "fill", ViewFill },
+        { "copy_from", ViewCopyFrom },
+        { NULL, NULL } /* sentinel */
+    };
+
+sample_t* buffer_checksamples(lua_State *L, int arg, nframes_t *nframes, int output)
+/* Checks that the value at arg is either an audio port whose buffer was retrieved
+ * in the current process cycle, or a valid buffer view, and returns the buffer
+ * (and its size in nframes). If output!=0, it also checks that it is an output port.
+ */
+    {
+    pud_t *pud;
+    bufview_t *view;
+    if(lua_type(L, arg) == LUA_TUSERDATA)
+        {
+        view = (bufview_t*)luaL_checkudata(L, arg, BUFVIEW_MT);
+        CheckView(L, view);
+        if(output) CheckViewIsOutput(L, view);
+        *nframes = view->nframes;
+        return view->buf;
+        }
+    pud = pud_check(L, arg);
+    CheckProcess(L, pud);
+    CheckIsAudio(L, pud);
+    CheckBuffer(L, pud);
+    if(output) CheckIsOutput(L, pud);
+    *nframes = pud->nframes;
+    return BUF(pud);
+    }
+
+static void ViewCreateMetatable(lua_State *L)
+    {
+    if(luaL_newmetatable(L, BUFVIEW_MT))
+        {
+        lua_newtable(L); /* methods table (upvalue for __index) */
+        luaL_setfuncs(L, VMethods, 0);
+        lua_pushcclosure(L, ViewIndex, 1);
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, ViewNewindex);
+        lua_setfield(L, -2, "__newindex");
+        lua_pushcfunction(L, ViewLen);
+        lua_setfield(L, -2, "__len");
+        }
+    lua_pop(L, 1);
+    }
+
 #undef BUF
 
 /*--------------------------------------------------------------------------*
@@ -430,6 +704,8 @@ void buffer_drop_all(cud_t *cud)
         pud->buf = NULL; 
         pud->nframes = 0; 
         pud->bufp = 0;
+        if(pud->view)
+            ((bufview_t*)pud->view)->buf = NULL;
         pud = SIMPLEQ_NEXT(pud, cudfifoentry);
         }
     }
@@ -443,6 +719,8 @@ static const struct luaL_Reg PFunctions [] =
         { "read", SwitchRead },
         { "seek", SwitchSeek },
         { "copy", SwitchCopy },
+        { "read_into", ReadInto },
+        { "write_from", WriteFrom },
         { NULL, NULL } /* sentinel */
     };
 
@@ -450,7 +728,12 @@ static const struct luaL_Reg PFunctions [] =
 int luajack_open_buffer(lua_State *L, int state_type)
     {
     if(state_type==ST_PROCESS)
+        {
         luaL_setfuncs(L, PFunctions, 0);
+        ViewCreateMetatable(L);
+        dsp_open(L);
+        lua_setfield(L, -2, "dsp");
+        }
     return 1;
     }
 
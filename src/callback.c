@@ -34,8 +34,8 @@
  *--------------------------------------------------------------------------*/
 
 #define BEGIN(cbname) do {                                              \
-    if(luajack_exiting())                                               \
-        { evt_free(evt); return 0; }                                    \
+    if(luajack_exiting()) /* evt is released by callback_flush() */     \
+        return 0;                                                       \
     /* push the callback on the stack */                                \
     if(lua_rawgeti(L, LUA_REGISTRYINDEX, cud->cbname) != LUA_TFUNCTION) \
         { evt_free(evt); return luaL_error(L, UNEXPECTED_ERROR); }      \
@@ -166,27 +166,251 @@ static int Lua_Session(lua_State *L, cud_t *cud, evt_t *evt)
 #undef EXEC
 #undef END
 
-int callback_flush(lua_State* L)
+/*--------------------------------------------------------------------------*
+ | Main state garbage collection                                            |
+ *--------------------------------------------------------------------------*/
+/* After dispatching the events, callback_flush() does some garbage collection
+ * in the main state according to the policy set with jack.main_gc():
+ * MGC_FULL:  a full collection every GcFlushes flushes, or every GcPeriod 
+ *            seconds (if GcPeriod > 0), whichever comes first (the default
+ *            is a full collection at every flush);
+ * MGC_STEP:  incremental steps until the cycle is completed or GcBudget
+ *            seconds are spent;
+ * MGC_GEN:   none (the collector is in generational mode, Lua 5.4 only);
+ * MGC_OFF:   none (only Lua's automatic collection).
+ * The time spent is accumulated in GcStat (see jack.main_gc_stats()).
+ */
+
+#define MGC_FULL    0
+#define MGC_STEP    1
+#define MGC_GEN     2
+#define MGC_OFF     3
+
+static int GcPolicy = MGC_FULL;
+static int GcFlushes = 1;
+static int GcCount = 0; /* flushes since the last full collection */
+static double GcPeriod = 0;
+static double GcBudget = 0.001;
+static double GcLast = 0; /* time of the last full collection */
+static stat_t GcStat;
+
+static void Gc(lua_State *L)
+    {
+    double ts, now;
+    switch(GcPolicy)
+        {
+        case MGC_FULL:
+            ts = luajack_now();
+            if((++GcCount < GcFlushes) && ((GcPeriod <= 0) || (ts - GcLast < GcPeriod)))
+                return;
+            lua_gc(L, LUA_GCCOLLECT, 0);
+            GcCount = 0;
+            GcLast = now = luajack_now();
+            break;
+        case MGC_STEP:
+            ts = now = luajack_now();
+            while((lua_gc(L, LUA_GCSTEP, 0) == 0) && ((now = luajack_now()) - ts < GcBudget))
+                ;
+            break;
+        case MGC_GEN:
+        case MGC_OFF:
+        default:
+            return;
+        }
+    luajack_stat_update(&GcStat, now - ts);
+    }
+
+static int MainGc(lua_State *L)
+/* main_gc(policy [, ...]) */
+    {
+    const char *policy = luaL_checkstring(L, 1);
+    int flushes = 1;
+    double period = 0, budget = 0.001;
+    int gcpolicy;
+    if(strcmp(policy, "full") == 0)
+        {
+        flushes = luaL_optinteger(L, 2, 1);
+        period = luaL_optnumber(L, 3, 0);
+        if(flushes < 1)
+            return luaL_argerror(L, 2, "positive integer expected");
+        gcpolicy = MGC_FULL;
+        }
+    else if(strcmp(policy, "step") == 0)
+        {
+        budget = luaL_optnumber(L, 2, 0.001);
+        if(budget <= 0)
+            return luaL_argerror(L, 2, "positive number expected");
+        gcpolicy = MGC_STEP;
+        }
+    else if(strcmp(policy, "generational") == 0)
+        {
+#ifdef LUA_GCGEN
+        gcpolicy = MGC_GEN;
+#else
+        return luaL_argerror(L, 1, "generational mode requires Lua 5.4");
+#endif
+        }
+    else if(strcmp(policy, "off") == 0)
+        gcpolicy = MGC_OFF;
+    else
+        return luaL_argerror(L, 1, "invalid gc policy");
+#ifdef LUA_GCGEN
+    if(gcpolicy == MGC_GEN)
+        lua_gc(L, LUA_GCGEN, 0, 0);
+    else if(GcPolicy == MGC_GEN)
+        lua_gc(L, LUA_GCINC, 0, 0, 0);
+#endif
+    GcPolicy = gcpolicy;
+    GcFlushes = flushes;
+    GcPeriod = period;
+    GcBudget = budget;
+    GcCount = 0;
+    GcLast = luajack_now();
+    return 0;
+    }
+
+static int MainGcStats(lua_State *L)
+/* n, min, max, mean, var = main_gc_stats([reset]) */
+    {
+    lua_pushinteger(L, luajack_stat_n(&GcStat));
+    lua_pushnumber(L, luajack_stat_n(&GcStat) ? luajack_stat_min(&GcStat) : 0);
+    lua_pushnumber(L, luajack_stat_max(&GcStat));
+    lua_pushnumber(L, luajack_stat_mean(&GcStat));
+    lua_pushnumber(L, luajack_stat_variance(&GcStat));
+    if(lua_toboolean(L, 1))
+        luajack_stat_reset(&GcStat);
+    return 5;
+    }
+
+/*--------------------------------------------------------------------------*
+ | Batched callbacks                                                        |
+ *--------------------------------------------------------------------------*/
+/* The events to be dispatched are moved from the queue into Batch[] so that,
+ * for clients with callbacks in batched mode, all the events of the same type
+ * can be collapsed and delivered with a single call.
+ * Events in Batch[] that are not dispatched because of an error in a callback
+ * remain there and are dispatched at the next flush.
+ */
+
+static evt_t *Batch[EVT_POOLSIZE];
+static unsigned int BatchLen = 0;
+static unsigned int BatchPos = 0;
+
+#define IsBatched(cud, type) (((cud)->batched & (1U << (type))) != 0)
+
+static int SameChange(evt_t *evt1, evt_t *evt2)
+/* returns 1 if the two events concern the same port/client/connection */
+    {
+    if((evt1->client_key != evt2->client_key) || (evt1->type != evt2->type))
+        return 0;
+    if(strcmp(evt1->arg1, evt2->arg1) != 0)
+        return 0;
+    return (evt1->type != CT_PortConnect) || (strcmp(evt1->arg2, evt2->arg2) == 0);
+    }
+
+static void Collapse(void)
+/* drops the pairs of events that cancel each other (e.g. a port registered 
+ * and unregistered within the same flush), for callbacks in batched mode */
     {
+    unsigned int i, j;
     evt_t *evt;
     cud_t *cud;
-    unsigned int n;
-
-    luajack_checkmain();    
+    for(i = BatchPos; i < BatchLen; i++)
+        {
+        if(((evt = Batch[i]) == NULL) || evt->op) /* only unregister/disconnect */
+            continue;
+        if((evt->type != CT_PortRegistration) && (evt->type != CT_ClientRegistration) &&
+                (evt->type != CT_PortConnect))
+            continue;
+        cud = cud_search(evt->client_key);
+        if(!cud || !IsCudValid(cud) || !IsBatched(cud, evt->type))
+            continue;
+        for(j = i; j > BatchPos; j--) /* search the matching register/connect */
+            {
+            if(Batch[j-1] && Batch[j-1]->op && SameChange(Batch[j-1], evt))
+                {
+                evt_free(Batch[j-1]); Batch[j-1] = NULL;
+                evt_free(evt); Batch[i] = NULL;
+                break;
+                }
+            }
+        }
+    }
 
-    if(luajack_exiting()) return 0;
+static void PushChange(lua_State *L, evt_t *evt, int n)
+/* adds the change described by evt to the array of changes on top of the stack */
+    {
+    int i = 0;
+    lua_newtable(L);
+    lua_pushstring(L, evt->arg1);
+    lua_rawseti(L, -2, ++i);
+    if(evt->type == CT_PortConnect)
+        {
+        lua_pushstring(L, evt->arg2);
+        lua_rawseti(L, -2, ++i);
+        lua_pushstring(L, evt->op ? "connected" : "disconnected");
+        }
+    else
+        lua_pushstring(L, evt->op ? "registered" : "unregistered");
+    lua_rawseti(L, -2, ++i);
+    lua_rawseti(L, -2, n);
+    }
 
-    n = evt_count(); 
-    /* Only events scheduled up to now are dispatched.
-     * The corresponding callbacks are executed in the main context, so that
-     * the main script can be considered virtually single-threaded. */
+static int Lua_Batch(lua_State *L, cud_t *cud, evt_t *evt)
+/* executes a batched callback with evt and all the following events of the 
+ * same type for the same client, and releases them */
+    {
+    unsigned int i;
+    int n = 0, ref, nargs = 0;
+    switch(evt->type)
+        {
+        case CT_GraphOrder: ref = cud->GraphOrder; break;
+        case CT_ClientRegistration: ref = cud->ClientRegistration; break;
+        case CT_PortRegistration: ref = cud->PortRegistration; break;
+        case CT_PortConnect: ref = cud->PortConnect; break;
+        default:
+            evt_free(evt);
+            return luaL_error(L, UNEXPECTED_ERROR);
+        }
+    if(luajack_exiting())
+        { evt_free(evt); return 0; }
+    if(lua_rawgeti(L, LUA_REGISTRYINDEX, ref) != LUA_TFUNCTION)
+        { evt_free(evt); return luaL_error(L, UNEXPECTED_ERROR); }
+    lua_pushinteger(L, evt->client_key);
+    if(evt->type != CT_GraphOrder) /* graph order events are just collapsed */
+        {
+        lua_newtable(L);
+        PushChange(L, evt, ++n);
+        nargs = 1;
+        }
+    for(i = BatchPos; i < BatchLen; i++)
+        {
+        if(!Batch[i] || (Batch[i]->client_key != evt->client_key) || (Batch[i]->type != evt->type))
+            continue;
+        if(nargs) PushChange(L, Batch[i], ++n);
+        evt_free(Batch[i]); Batch[i] = NULL;
+        }
+    evt_free(evt);
+    if(lua_pcall(L, nargs + 1, 0, 0) != LUA_OK)
+        return lua_error(L);
+    return 0;
+    }
 
-    while( n>0 && ((evt = evt_remove()) != NULL))
+static int Dispatch(lua_State *L)
+/* dispatches the events in Batch[] (see callback_flush) */
+    {
+    evt_t *evt;
+    cud_t *cud;
+    while(BatchPos < BatchLen)
         {
-        n--;
+        evt = Batch[BatchPos];
+        Batch[BatchPos++] = NULL;
+        if(!evt) continue; /* collapsed, or delivered with a batch */
         cud = cud_search(evt->client_key);
         if(!cud || !IsCudValid(cud)) /* client was closed: skip event */
             { evt_free(evt); continue; }
+        if(IsBatched(cud, evt->type))
+            { Lua_Batch(L, cud, evt); continue; }
         switch(evt->type)
             {
             case CT_SampleRate: Lua_SampleRate(L, cud, evt); break;
@@ -206,9 +430,47 @@ int callback_flush(lua_State* L)
             }
         evt_free(evt);
         }
-#if 1
-    lua_gc(L, LUA_GCCOLLECT, 0);
-#endif
+    return 0;
+    }
+
+int callback_flush(lua_State* L)
+    {
+    evt_t *evt;
+    unsigned int n;
+
+    luajack_checkmain();    
+
+    if(luajack_exiting()) return 0;
+
+    evt_rearm();
+    n = evt_count(); 
+    /* Only events scheduled up to now are dispatched.
+     * The corresponding callbacks are executed in the main context, so that
+     * the main script can be considered virtually single-threaded. */
+
+    /* If Batch[] is not empty, there are leftovers from a flush aborted by an
+     * error in a callback: they are dispatched first, then the new events. */
+    while((BatchPos < BatchLen) || (n > 0))
+        {
+        if(BatchPos == BatchLen)
+            {
+            BatchPos = BatchLen = 0;
+            while( n>0 && ((evt = evt_remove()) != NULL))
+                { n--; Batch[BatchLen++] = evt; }
+            n = 0;
+            Collapse();
+            }
+        lua_pushcfunction(L, Dispatch);
+        if(lua_pcall(L, 0, 0, 0) != LUA_OK)
+            {
+            /* make sure the remaining events are not left waiting for an
+             * unrelated wakeup, then propagate the error */
+            if((BatchPos < BatchLen) || (evt_count() > 0))
+                evt_signal();
+            return lua_error(L);
+            }
+        }
+    Gc(L);
     return 0;
     }
 
@@ -230,8 +492,8 @@ int callback_flush(lua_State* L)
 #define BEGIN(cbname) evt_t *evt; do {                          \
     if(!IsCudValid(cud)) return 0;                              \
     if(cud->cbname == LUA_NOREF) return 0;                      \
-    if((evt = evt_new()) == NULL)                               \
-        return luajack_error("cannot allocate callback event"); \
+    if((evt = evt_new()) == NULL) /* pool exhausted */          \
+        return 0; /* dropped (counted by evt_new) */            \
     evt->client_key = cud->key;                                 \
     evt->type = CT_##cbname;                                    \
 } while(0)
@@ -241,13 +503,9 @@ int callback_flush(lua_State* L)
     return rc;                              \
 } while(0)
 
-#define MAX_ARG_LEN 1024 /* should be enough ... */
-#define Copy(dst, src)  do {                                        \
-    size_t len = strnlen((src), MAX_ARG_LEN);                       \
-    if(len == MAX_ARG_LEN) luajack_error(UNEXPECTED_ERROR);         \
-    (dst) = (char*)Malloc(len+1); /* deallocated by evt_free() */  	\
-    if(!(dst)) luajack_error(UNEXPECTED_ERROR);                     \
-    strncpy((dst), (src), len);                                     \
+#define Copy(dst, src)  do { /* dst is an inline array of EVT_ARGLEN chars */ \
+    size_t len = strnlen((src), EVT_ARGLEN-1); /* truncate if longer */ \
+    memcpy((dst), (src), len);                                      \
     (dst)[len]='\0';                                                \
 } while(0)
 
@@ -352,7 +610,16 @@ static void Shutdown(jack_status_t code, const char *reason, void *arg)
 
 static int Latency_(jack_latency_callback_mode_t mode, void *arg)
     {
-    BEGIN(Latency);
+    evt_t *evt;
+    if(cud->ahead) /* propagate latency first (see ahead.c) */
+        ahead_latency(cud, mode);
+    /* as BEGIN(), with evt declared above */
+    if(!IsCudValid(cud)) return 0;
+    if(cud->Latency == LUA_NOREF) return 0;
+    if((evt = evt_new()) == NULL) /* pool exhausted */
+        return 0;
+    evt->client_key = cud->key;
+    evt->type = CT_Latency;
     evt->mode = mode;
     END(0);
     }
@@ -362,7 +629,14 @@ static void Latency(jack_latency_callback_mode_t mode, void *arg)
 
 static int Session_(jack_session_event_t *event, void *arg)
     {
-    BEGIN(Session);
+    evt_t *evt;
+    /* as BEGIN(), but the event must be freed also if it is dropped */
+    if(!IsCudValid(cud)) return 0;
+    if(cud->Session == LUA_NOREF) return 0;
+    if((evt = evt_new()) == NULL)
+        { jack_session_event_free(event); return 0; }
+    evt->client_key = cud->key;
+    evt->type = CT_Session;
     evt->session_event = event;
     END(0);
     }
@@ -426,14 +700,27 @@ static int Callback##cb (lua_State *L)  \
     return 0;                           \
     }
 
+#define BATCHED_REGISTRATION_FUNCTION(cb)   \
+static int Callback##cb (lua_State *L)  \
+    {                                   \
+    cud_t *cud = cud_check(L, 1);       \
+    CheckFunction();                    \
+    Register(cud, cb);                  \
+    if(lua_toboolean(L, 3))             \
+        cud->batched |= (1U << CT_##cb);    \
+    else                                \
+        cud->batched &= ~(1U << CT_##cb);   \
+    return 0;                           \
+    }
+
 REGISTRATION_FUNCTION(Shutdown)
 REGISTRATION_FUNCTION(Freewheel)
 REGISTRATION_FUNCTION(SampleRate)
-REGISTRATION_FUNCTION(ClientRegistration)
-REGISTRATION_FUNCTION(PortRegistration)
+BATCHED_REGISTRATION_FUNCTION(ClientRegistration)
+BATCHED_REGISTRATION_FUNCTION(PortRegistration)
 REGISTRATION_FUNCTION(PortRename)
-REGISTRATION_FUNCTION(PortConnect)
-REGISTRATION_FUNCTION(GraphOrder)
+BATCHED_REGISTRATION_FUNCTION(PortConnect)
+BATCHED_REGISTRATION_FUNCTION(GraphOrder)
 REGISTRATION_FUNCTION(Xrun)
 REGISTRATION_FUNCTION(Latency)
 REGISTRATION_FUNCTION(Session)
@@ -453,6 +740,12 @@ void callback_unregister(lua_State *L, cud_t *cud)
     Unregister(cud, Latency);
     }
 
+static int CallbackOverflows(lua_State *L)
+    {
+    lua_pushinteger(L, evt_overflows());
+    return 1;
+    }
+
 /*--------------------------------------------------------------------------*
  | Registration                                                             |
  *--------------------------------------------------------------------------*/
@@ -470,12 +763,18 @@ static const struct luaL_Reg MFunctions[] =
         { "xrun_callback", CallbackXrun },
         { "latency_callback", CallbackLatency },
         { "session_callback", CallbackSession },
+        { "callback_overflows", CallbackOverflows },
+        { "main_gc", MainGc },
+        { "main_gc_stats", MainGcStats },
         { NULL, NULL } /* sentinel */
     };
 
 int luajack_open_callback(lua_State *L, int state_type)
     {
     if(state_type == ST_MAIN) 
+        {
+        luajack_stat_reset(&GcStat);
         luaL_setfuncs(L, MFunctions, 0);
+        }
     return 1;
     }
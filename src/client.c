@@ -256,6 +256,10 @@ static int client_close(lua_State *L, cud_t *cud)
     Deactivate_(cud); /* no more callbacks, please... */
     thread_free_all(cud);
     rbuf_free_all(cud);
+    matrix_free(cud);
+    trace_close(cud);
+    ahead_free(cud);
+    worker_free(cud);
     port_close_all(cud);
     /* close client */
     name = jack_get_client_name(cud->client);
@@ -0,0 +1,294 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Binary codec for Lua tables												*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <limits.h>
+
+/* A compact binary encoding for Lua values, used to send tables over 
+ * ringbuffers without intermediate strings (see ringbuffer_write_table()).
+ * The encoder runs in two passes: the first computes the encoded size (and
+ * checks that the value can be encoded), so that the space can be reserved 
+ * in the ringbuffer, and the second writes directly in the reserved segments.
+ *
+ * Each value is a type byte, followed by:
+ * T_INT: the integer, zigzag encoded as a varint (1 byte for -64..63);
+ * T_FLT: a double, in native byte order;
+ * T_STR: the length as a varint, followed by the bytes;
+ * T_TAB: key-value pairs of values, terminated by T_END.
+ * Nothing follows T_NIL, T_FALSE, T_TRUE and T_END.
+ */
+
+#define T_NIL	0
+#define T_FALSE	1
+#define T_TRUE	2
+#define T_INT	3
+#define T_FLT	4
+#define T_STR	5
+#define T_TAB	6
+#define T_END	7
+
+typedef struct {
+	jack_ringbuffer_data_t *vec; /* segments (NULL while sizing) */
+	size_t	seg;	/* current segment */
+	size_t	pos;	/* position in the current segment */
+	size_t	size;	/* bytes encoded so far */
+	size_t	maxsize;
+	int		maxdepth;
+} codec_t;
+
+static void Put(codec_t *c, const void *src, size_t n)
+	{
+	size_t cnt;
+	const char *p = (const char*)src;
+	c->size += n;
+	if(!c->vec) return;
+	while(n > 0)
+		{
+		cnt = c->vec[c->seg].len - c->pos;
+		if(cnt > n) cnt = n;
+		memcpy(c->vec[c->seg].buf + c->pos, p, cnt);
+		c->pos += cnt;
+		p += cnt;
+		n -= cnt;
+		if(c->pos == c->vec[c->seg].len)
+			{ c->seg++; c->pos = 0; }
+		}
+	}
+
+static int Get(codec_t *c, void *dst, size_t n)
+/* returns 0 if there are less than n bytes left */
+	{
+	size_t cnt;
+	char *p = (char*)dst;
+	while(n > 0)
+		{
+		if(c->seg > 1) return 0;
+		cnt = c->vec[c->seg].len - c->pos;
+		if(cnt > n) cnt = n;
+		memcpy(p, c->vec[c->seg].buf + c->pos, cnt);
+		c->pos += cnt;
+		p += cnt;
+		n -= cnt;
+		if(c->pos == c->vec[c->seg].len)
+			{ c->seg++; c->pos = 0; }
+		}
+	return 1;
+	}
+
+static void PutByte(codec_t *c, unsigned char b)
+	{
+	Put(c, &b, 1);
+	}
+
+static void PutVarint(codec_t *c, uint64_t u)
+	{
+	unsigned char b[10];
+	size_t n = 0;
+	while(u >= 0x80)
+		{ b[n++] = (u & 0x7f) | 0x80; u >>= 7; }
+	b[n++] = u;
+	Put(c, b, n);
+	}
+
+static int GetVarint(codec_t *c, uint64_t *u)
+	{
+	unsigned char b;
+	int shift = 0;
+	*u = 0;
+	do {
+		if((shift > 63) || !Get(c, &b, 1)) return 0;
+		*u |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while(b & 0x80);
+	return 1;
+	}
+
+static int Encode(lua_State *L, codec_t *c, int arg, int depth)
+/* encodes the value at index arg, returns 0 if maxsize is exceeded */
+	{
+	lua_Integer i;
+	lua_Number x;
+	size_t len;
+	const char *s;
+	arg = lua_absindex(L, arg);
+	switch(lua_type(L, arg))
+		{
+		case LUA_TNIL: PutByte(c, T_NIL); break;
+		case LUA_TBOOLEAN: PutByte(c, lua_toboolean(L, arg) ? T_TRUE : T_FALSE); break;
+		case LUA_TNUMBER:
+			if(lua_isinteger(L, arg))
+				{
+				i = lua_tointeger(L, arg);
+				PutByte(c, T_INT);
+				PutVarint(c, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63)); /* zigzag */
+				}
+			else
+				{
+				x = lua_tonumber(L, arg);
+				PutByte(c, T_FLT);
+				Put(c, &x, sizeof(x));
+				}
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring(L, arg, &len);
+			PutByte(c, T_STR);
+			PutVarint(c, len);
+			Put(c, s, len);
+			break;
+		case LUA_TTABLE:
+			if(depth >= c->maxdepth)
+				return luaL_error(L, "table nesting too deep (max depth is %d)", c->maxdepth);
+			luaL_checkstack(L, 3, "table nesting too deep");
+			PutByte(c, T_TAB);
+			lua_pushnil(L);
+			while(lua_next(L, arg))
+				{
+				if(!Encode(L, c, -2, depth + 1) || !Encode(L, c, -1, depth + 1))
+					{ lua_pop(L, 2); return 0; }
+				lua_pop(L, 1);
+				}
+			PutByte(c, T_END);
+			break;
+		default:
+			return luaL_error(L, "cannot encode values of type %s", luaL_typename(L, arg));
+		}
+	return c->size <= c->maxsize;
+	}
+
+static int Decode(lua_State *L, codec_t *c, int target, int depth);
+
+static int DecodeTable(lua_State *L, codec_t *c, int depth)
+/* decodes the key-value pairs in the table at the top of the stack */
+	{
+	int t = lua_gettop(L);
+	if(depth >= c->maxdepth) return 0;
+	luaL_checkstack(L, 3, "table nesting too deep");
+	for(;;)
+		{
+		if(!Decode(L, c, 0, depth + 1)) return 0;
+		if(lua_isnil(L, -1)) /* T_END (keys can not be nil) */
+			{ lua_pop(L, 1); return 1; }
+		if(lua_type(L, -1) == LUA_TNUMBER && !lua_isinteger(L, -1) && 
+				(lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+			return 0; /* NaN keys are not valid (lua_rawset() would raise an error) */
+		if(!Decode(L, c, 0, depth + 1)) return 0;
+		lua_rawset(L, t);
+		}
+	}
+
+static int Decode(lua_State *L, codec_t *c, int target, int depth)
+/* decodes a value and pushes it (T_END is pushed as nil); if target != 0 and
+ * the value is a table, decodes it in the table at index target (after clearing
+ * it). Returns 0 if malformed. */
+	{
+	unsigned char type;
+	uint64_t u;
+	lua_Number x;
+	luaL_Buffer b;
+	if(!Get(c, &type, 1)) return 0;
+	switch(type)
+		{
+		case T_NIL: /* only as a table value, where it means 'no entry' */
+		case T_END: lua_pushnil(L); return 1;
+		case T_FALSE: lua_pushboolean(L, 0); return 1;
+		case T_TRUE: lua_pushboolean(L, 1); return 1;
+		case T_INT:
+			if(!GetVarint(c, &u)) return 0;
+			lua_pushinteger(L, (lua_Integer)((u >> 1) ^ (~(u & 1) + 1))); /* zigzag */
+			return 1;
+		case T_FLT:
+			if(!Get(c, &x, sizeof(x))) return 0;
+			lua_pushnumber(L, x);
+			return 1;
+		case T_STR:
+			if(!GetVarint(c, &u)) return 0;
+			if(u > (c->vec[0].len + c->vec[1].len)) return 0;
+			if(!Get(c, luaL_buffinitsize(L, &b, u), u)) return 0;
+			luaL_pushresultsize(&b, u);
+			return 1;
+		case T_TAB:
+			if(target)
+				{
+				lua_pushvalue(L, target);
+				lua_pushnil(L); /* clear it */
+				while(lua_next(L, -2))
+					{
+					lua_pop(L, 1);
+					lua_pushvalue(L, -1);
+					lua_pushnil(L);
+					lua_rawset(L, -4);
+					}
+				}
+			else
+				lua_newtable(L);
+			return DecodeTable(L, c, depth);
+		default:
+			return 0;
+		}
+	}
+
+size_t codec_size(lua_State *L, int arg, int maxdepth, size_t maxsize)
+/* returns the encoded size of the value at index arg, or 0 if it exceeds maxsize 
+ * (raises an error if the value can not be encoded) */
+	{
+	codec_t c;
+	memset(&c, 0, sizeof(c));
+	c.maxdepth = maxdepth;
+	c.maxsize = maxsize;
+	if(!Encode(L, &c, arg, 0)) return 0;
+	return c.size;
+	}
+
+void codec_encode(lua_State *L, int arg, jack_ringbuffer_data_t vec[2])
+/* encodes the value at index arg in the segments, which must be long enough 
+ * (i.e. codec_size() was called before) */
+	{
+	codec_t c;
+	memset(&c, 0, sizeof(c));
+	c.vec = vec;
+	c.maxdepth = INT_MAX;
+	c.maxsize = (size_t)-1;
+	Encode(L, &c, arg, 0);
+	}
+
+int codec_decode(lua_State *L, jack_ringbuffer_data_t vec[2], int target, int maxdepth)
+/* decodes the value encoded in the segments and pushes it; tables are decoded
+ * into the table at index target, if target != 0. Returns 0 if malformed. */
+	{
+	codec_t c;
+	int top = lua_gettop(L);
+	memset(&c, 0, sizeof(c));
+	c.vec = vec;
+	c.maxdepth = maxdepth;
+	if(target) target = lua_absindex(L, target);
+	if(!Decode(L, &c, target, 0) || (c.seg < 2 && c.pos < c.vec[c.seg].len))
+		{ lua_settop(L, top); return 0; }
+	return 1;
+	}
+
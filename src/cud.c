@@ -29,43 +29,22 @@
 
 #include "internal.h"
 
-static int cmp(cud_t *cud1, cud_t *cud2) /* the compare function */
-    { return (cud1->key < cud2->key ? -1 : cud1->key > cud2->key); } 
+static handletab_t Tab;
 
-static RB_HEAD(cudtree_s, cud_s) Head = RB_INITIALIZER(&Head);
-
-RB_PROTOTYPE_STATIC(cudtree_s, cud_s, entry, cmp) 
-RB_GENERATE_STATIC(cudtree_s, cud_s, entry, cmp) 
- 
-static cud_t *cud_remove(cud_t *cud) 
-    { return RB_REMOVE(cudtree_s, &Head, cud); }
-static cud_t *cud_insert(cud_t *cud) 
-    { return RB_INSERT(cudtree_s, &Head, cud); }
 cud_t *cud_search(uintptr_t key) 
-    { cud_t tmp; tmp.key = key; return RB_FIND(cudtree_s, &Head, &tmp); }
+    { return (cud_t*)handle_get(&Tab, key); }
 cud_t *cud_first(uintptr_t key) 
-    { cud_t tmp; tmp.key = key; return RB_NFIND(cudtree_s, &Head, &tmp); }
+    { return (cud_t*)handle_first(&Tab, key); }
 cud_t *cud_next(cud_t *cud)
-    { return RB_NEXT(cudtree_s, &Head, cud); }
-#if 0
-cud_t *cud_prev(cud_t *cud)
-    { return RB_PREV(cudtree_s, &Head, cud); }
-cud_t *cud_min(void)
-    { return RB_MIN(cudtree_s, &Head); }
-cud_t *cud_max(void)
-    { return RB_MAX(cudtree_s, &Head); }
-cud_t *cud_root(void)
-    { return RB_ROOT(&Head); }
-#endif
+    { return (cud_t*)handle_next(&Tab, cud->key); }
 
 cud_t *cud_new(void)
     {
     cud_t *cud;
     if((cud = (cud_t*)Malloc(sizeof(cud_t))) == NULL) return NULL;
     memset(cud, 0, sizeof(cud_t));
-    cud->key = (uintptr_t)cud;
-    if(cud_search(cud->key))
-        { Free(cud); luajack_error(UNEXPECTED_ERROR); return NULL; }
+    if((cud->key = handle_new(&Tab, cud)) == 0)
+        { Free(cud); return NULL; }
     cud->obj.type = LUAJACK_TCLIENT;
     cud->obj.xud = (void*)cud;
     cud->SampleRate = LUA_NOREF;
@@ -86,7 +65,6 @@ cud_t *cud_new(void)
     cud->TimebaseConditional = LUA_NOREF;
     SIMPLEQ_INIT(&(cud->fifo));
 	luajack_stat_reset(&(cud->stat));
-    cud_insert(cud);
     MarkCudValid(cud);
     return cud;
     }
@@ -94,7 +72,7 @@ cud_t *cud_new(void)
 static void cud_free(cud_t* cud)
     {
     if(cud_search(cud->key) == cud)
-        cud_remove(cud);
+        handle_free(&Tab, cud->key);
     Free(cud);  
     DBG("cud_free()\n");
     }
@@ -104,6 +82,7 @@ void cud_free_all(void)
     cud_t *cud;
     while((cud = cud_first(0)))
         cud_free(cud);
+    handle_freetab(&Tab);
     }
 
 cud_t* cud_check(lua_State *L, int arg)
@@ -0,0 +1,441 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * DSP kernels on port buffers (process context only)						*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <math.h>
+
+/* This module provides the jack.dsp table, with basic signal processing
+ * operations executed entirely in C on whole port buffers, so that the process
+ * chunk can leave per-sample loops to C and use Lua for control logic only.
+ *
+ * The kernels come in three flavors: plain C, SSE2 and AVX2. The best flavor
+ * supported by the CPU is selected at runtime, when the module is opened.
+ * Compile with -DLUAJACK_NO_SIMD to use the plain C kernels only.
+ */
+
+#if !defined(LUAJACK_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DSP_X86
+#include <immintrin.h>
+#endif
+
+typedef struct {
+	const char *name;
+	void (*gain)(sample_t *dst, const sample_t *src, size_t n, float g);
+	void (*ramp)(sample_t *dst, const sample_t *src, size_t n, float g0, float dg);
+	void (*add)(sample_t *dst, const sample_t *a, const sample_t *b, size_t n);
+	void (*mix)(sample_t *dst, const sample_t *src, size_t n, float g);
+	void (*mac)(sample_t *dst, const sample_t *a, const sample_t *b, size_t n);
+	void (*clip)(sample_t *dst, const sample_t *src, size_t n, float lo, float hi);
+	float (*peak)(const sample_t *src, size_t n);
+	double (*sumsq)(const sample_t *src, size_t n);
+} kernels_t;
+
+static kernels_t K; /* the selected kernels */
+
+/*--------------------------------------------------------------------------*
+ | Plain C kernels                                                         	|
+ *--------------------------------------------------------------------------*/
+
+/* These are also used by the SIMD kernels for the tail of the buffers */
+
+static void GainC(sample_t *dst, const sample_t *src, size_t n, float g)
+	{ size_t i; for(i = 0; i < n; i++) dst[i] = src[i]*g; }
+
+static void RampC(sample_t *dst, const sample_t *src, size_t n, float g0, float dg)
+	{ size_t i; for(i = 0; i < n; i++) dst[i] = src[i]*(g0 + i*dg); }
+
+static void AddC(sample_t *dst, const sample_t *a, const sample_t *b, size_t n)
+	{ size_t i; for(i = 0; i < n; i++) dst[i] = a[i] + b[i]; }
+
+static void MixC(sample_t *dst, const sample_t *src, size_t n, float g)
+	{ size_t i; for(i = 0; i < n; i++) dst[i] += src[i]*g; }
+
+static void MacC(sample_t *dst, const sample_t *a, const sample_t *b, size_t n)
+	{ size_t i; for(i = 0; i < n; i++) dst[i] += a[i]*b[i]; }
+
+static void ClipC(sample_t *dst, const sample_t *src, size_t n, float lo, float hi)
+	{
+	size_t i;
+	for(i = 0; i < n; i++)
+		dst[i] = src[i] < lo ? lo : (src[i] > hi ? hi : src[i]);
+	}
+
+static float PeakC(const sample_t *src, size_t n)
+	{
+	size_t i;
+	float peak = 0, x;
+	for(i = 0; i < n; i++)
+		{ x = fabsf(src[i]); if(x > peak) peak = x; }
+	return peak;
+	}
+
+static double SumsqC(const sample_t *src, size_t n)
+	{
+	size_t i;
+	double sum = 0;
+	for(i = 0; i < n; i++) sum += (double)src[i]*src[i];
+	return sum;
+	}
+
+static const kernels_t KernelsC = 
+	{ "c", GainC, RampC, AddC, MixC, MacC, ClipC, PeakC, SumsqC };
+
+/*--------------------------------------------------------------------------*
+ | SIMD kernels                                                          	|
+ *--------------------------------------------------------------------------*/
+
+#ifdef DSP_X86
+
+/* SIMD_KERNELS(sfx, isa, W, V, ...) defines the kernels for a vector type V
+ * of W floats, using the given intrinsics. Unaligned loads and stores are used
+ * throughout, since JACK does not guarantee any particular alignment. */
+#define SIMD_KERNELS(sfx, isa, W, V, LOAD, STORE, SET1, SETR, ADD, MUL, MIN, MAX, ANDNOT)\
+__attribute__((target(isa)))												\
+static void Gain##sfx(sample_t *dst, const sample_t *src, size_t n, float g)	\
+	{																		\
+	size_t i = 0;															\
+	V vg = SET1(g);															\
+	for(; i + W <= n; i += W) STORE(dst + i, MUL(LOAD(src + i), vg));		\
+	GainC(dst + i, src + i, n - i, g);										\
+	}																		\
+__attribute__((target(isa)))												\
+static void Ramp##sfx(sample_t *dst, const sample_t *src, size_t n, float g0, float dg)\
+	{																		\
+	size_t i = 0;															\
+	V vg = ADD(SET1(g0), MUL(SET1(dg), SETR));								\
+	V vstep = SET1(dg*W);													\
+	for(; i + W <= n; i += W)												\
+		{ STORE(dst + i, MUL(LOAD(src + i), vg)); vg = ADD(vg, vstep); }	\
+	RampC(dst + i, src + i, n - i, g0 + i*dg, dg);							\
+	}																		\
+__attribute__((target(isa)))												\
+static void Add##sfx(sample_t *dst, const sample_t *a, const sample_t *b, size_t n)\
+	{																		\
+	size_t i = 0;															\
+	for(; i + W <= n; i += W) STORE(dst + i, ADD(LOAD(a + i), LOAD(b + i)));\
+	AddC(dst + i, a + i, b + i, n - i);										\
+	}																		\
+__attribute__((target(isa)))												\
+static void Mix##sfx(sample_t *dst, const sample_t *src, size_t n, float g)	\
+	{																		\
+	size_t i = 0;															\
+	V vg = SET1(g);															\
+	for(; i + W <= n; i += W)												\
+		STORE(dst + i, ADD(LOAD(dst + i), MUL(LOAD(src + i), vg)));			\
+	MixC(dst + i, src + i, n - i, g);										\
+	}																		\
+__attribute__((target(isa)))												\
+static void Mac##sfx(sample_t *dst, const sample_t *a, const sample_t *b, size_t n)\
+	{																		\
+	size_t i = 0;															\
+	for(; i + W <= n; i += W)												\
+		STORE(dst + i, ADD(LOAD(dst + i), MUL(LOAD(a + i), LOAD(b + i))));	\
+	MacC(dst + i, a + i, b + i, n - i);										\
+	}																		\
+__attribute__((target(isa)))												\
+static void Clip##sfx(sample_t *dst, const sample_t *src, size_t n, float lo, float hi)\
+	{																		\
+	size_t i = 0;															\
+	V vlo = SET1(lo), vhi = SET1(hi);										\
+	for(; i + W <= n; i += W)												\
+		STORE(dst + i, MIN(MAX(LOAD(src + i), vlo), vhi));					\
+	ClipC(dst + i, src + i, n - i, lo, hi);									\
+	}																		\
+__attribute__((target(isa)))												\
+static float Peak##sfx(const sample_t *src, size_t n)						\
+	{																		\
+	size_t i = 0, k;														\
+	float tmp[W], peak;														\
+	V vsign = SET1(-0.0f), vpeak = SET1(0);									\
+	for(; i + W <= n; i += W)												\
+		vpeak = MAX(vpeak, ANDNOT(vsign, LOAD(src + i)));					\
+	STORE(tmp, vpeak);														\
+	peak = PeakC(src + i, n - i);											\
+	for(k = 0; k < W; k++) if(tmp[k] > peak) peak = tmp[k];					\
+	return peak;															\
+	}																		\
+__attribute__((target(isa)))												\
+static double Sumsq##sfx(const sample_t *src, size_t n)						\
+	{																		\
+	size_t i = 0, k;														\
+	float tmp[W];															\
+	double sum;																\
+	V x, vsum = SET1(0);													\
+	for(; i + W <= n; i += W)												\
+		{ x = LOAD(src + i); vsum = ADD(vsum, MUL(x, x)); }					\
+	STORE(tmp, vsum);														\
+	sum = SumsqC(src + i, n - i);											\
+	for(k = 0; k < W; k++) sum += tmp[k];									\
+	return sum;																\
+	}																		\
+static const kernels_t Kernels##sfx = 										\
+	{ isa, Gain##sfx, Ramp##sfx, Add##sfx, Mix##sfx, Mac##sfx, Clip##sfx, Peak##sfx, Sumsq##sfx };
+
+SIMD_KERNELS(SSE2, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps,
+		_mm_setr_ps(0, 1, 2, 3), _mm_add_ps, _mm_mul_ps, _mm_min_ps, _mm_max_ps, _mm_andnot_ps)
+
+SIMD_KERNELS(AVX2, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps,
+		_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_add_ps, _mm256_mul_ps, 
+		_mm256_min_ps, _mm256_max_ps, _mm256_andnot_ps)
+
+#undef SIMD_KERNELS
+
+#endif /* DSP_X86 */
+
+static void SelectKernels(void)
+	{
+	K = KernelsC;
+#ifdef DSP_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		K = KernelsAVX2;
+	else if(__builtin_cpu_supports("sse2"))
+		K = KernelsSSE2;
+#endif
+	luajack_verbose("using '%s' dsp kernels\n", K.name);
+	}
+
+/*--------------------------------------------------------------------------*
+ | Functions                                                               	|
+ *--------------------------------------------------------------------------*/
+
+/* The sample buffer arguments may be either audio ports (whose buffers must
+ * have been retrieved with get_buffer() in the current process cycle), or
+ * buffer views. The operations are always executed on whole buffers, starting
+ * from the first sample (current positions are neither used nor modified),
+ * and on the minimum number of samples amongst the involved buffers.
+ */
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static int Gain(lua_State *L)
+/* n = dsp.gain(dst, src, g) */
+	{
+	nframes_t n, nsrc;
+	sample_t *dst = buffer_checksamples(L, 1, &n, 1);
+	sample_t *src = buffer_checksamples(L, 2, &nsrc, 0);
+	float g = luaL_checknumber(L, 3);
+	n = MIN(n, nsrc);
+	K.gain(dst, src, n, g);
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
+static int GainRamp(lua_State *L)
+/* n = dsp.gain_ramp(dst, src, g0, g1)
+ * applies a gain linearly ramping from g0 (first sample) to g1 (past the last)
+ */
+	{
+	nframes_t n, nsrc;
+	sample_t *dst = buffer_checksamples(L, 1, &n, 1);
+	sample_t *src = buffer_checksamples(L, 2, &nsrc, 0);
+	float g0 = luaL_checknumber(L, 3);
+	float g1 = luaL_checknumber(L, 4);
+	n = MIN(n, nsrc);
+	if(n > 0)
+		K.ramp(dst, src, n, g0, (g1 - g0)/n);
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
+static int Add(lua_State *L)
+/* n = dsp.add(dst, a, b) */
+	{
+	nframes_t n, na, nb;
+	sample_t *dst = buffer_checksamples(L, 1, &n, 1);
+	sample_t *a = buffer_checksamples(L, 2, &na, 0);
+	sample_t *b = buffer_checksamples(L, 3, &nb, 0);
+	n = MIN(n, MIN(na, nb));
+	K.add(dst, a, b, n);
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
+static int Mix(lua_State *L)
+/* n = dsp.mix(dst, src [, g]) */
+	{
+	nframes_t n, nsrc;
+	sample_t *dst = buffer_checksamples(L, 1, &n, 1);
+	sample_t *src = buffer_checksamples(L, 2, &nsrc, 0);
+	float g = luaL_optnumber(L, 3, 1.0);
+	n = MIN(n, nsrc);
+	K.mix(dst, src, n, g);
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
+static int Mac(lua_State *L)
+/* n = dsp.mac(dst, a, b) */
+	{
+	nframes_t n, na, nb;
+	sample_t *dst = buffer_checksamples(L, 1, &n, 1);
+	sample_t *a = buffer_checksamples(L, 2, &na, 0);
+	sample_t *b = buffer_checksamples(L, 3, &nb, 0);
+	n = MIN(n, MIN(na, nb));
+	K.mac(dst, a, b, n);
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
+static int Clip(lua_State *L)
+/* n = dsp.clip(dst, src, lo [, hi])  (hi defaults to -lo, lo to -|lo|) */
+	{
+	nframes_t n, nsrc;
+	float lo, hi;
+	sample_t *dst = buffer_checksamples(L, 1, &n, 1);
+	sample_t *src = buffer_checksamples(L, 2, &nsrc, 0);
+	lo = luaL_checknumber(L, 3);
+	if(lua_isnoneornil(L, 4))
+		{ hi = fabsf(lo); lo = -hi; }
+	else
+		hi = luaL_checknumber(L, 4);
+	if(lo > hi)
+		return luaL_error(L, "invalid clipping range");
+	n = MIN(n, nsrc);
+	K.clip(dst, src, n, lo, hi);
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
+static int Peak(lua_State *L)
+/* peak = dsp.peak(src) */
+	{
+	nframes_t n;
+	sample_t *src = buffer_checksamples(L, 1, &n, 0);
+	lua_pushnumber(L, K.peak(src, n));
+	return 1;
+	}
+
+static int Rms(lua_State *L)
+/* rms = dsp.rms(src) */
+	{
+	nframes_t n;
+	sample_t *src = buffer_checksamples(L, 1, &n, 0);
+	lua_pushnumber(L, n > 0 ? sqrt(K.sumsq(src, n)/n) : 0);
+	return 1;
+	}
+
+#define MAX_CHANNELS 64
+
+static int Interleave(lua_State *L)
+/* data = dsp.interleave(src1, ..., srcN)
+ * returns the interleaved samples as a binary string (native sample_t format)
+ */
+	{
+	luaL_Buffer b;
+	sample_t *src[MAX_CHANNELS], *dst;
+	nframes_t n, nsrc, i;
+	int k, nch = lua_gettop(L);
+	if(nch < 1 || nch > MAX_CHANNELS)
+		return luaL_error(L, "invalid number of channels");
+	n = JACK_MAX_FRAMES;
+	for(k = 0; k < nch; k++)
+		{
+		src[k] = buffer_checksamples(L, k + 1, &nsrc, 0);
+		n = MIN(n, nsrc);
+		}
+	dst = (sample_t*)luaL_buffinitsize(L, &b, sizeof(sample_t)*n*nch);
+	for(i = 0; i < n; i++)
+		for(k = 0; k < nch; k++)
+			*dst++ = src[k][i];
+	luaL_pushresultsize(&b, sizeof(sample_t)*n*nch);
+	return 1;
+	}
+
+static int Deinterleave(lua_State *L)
+/* n = dsp.deinterleave(data, dst1, ..., dstN)
+ * data is a binary string of interleaved samples, as returned by interleave()
+ */
+	{
+	size_t len;
+	sample_t *dst[MAX_CHANNELS];
+	const sample_t *src;
+	nframes_t n, ndst, i;
+	int k, nch = lua_gettop(L) - 1;
+	const char *data = luaL_checklstring(L, 1, &len);
+	if(nch < 1 || nch > MAX_CHANNELS)
+		return luaL_error(L, "invalid number of channels");
+	n = len/(sizeof(sample_t)*nch);
+	for(k = 0; k < nch; k++)
+		{
+		dst[k] = buffer_checksamples(L, k + 2, &ndst, 1);
+		n = MIN(n, ndst);
+		}
+	src = (const sample_t*)data; /* Lua strings are suitably aligned */
+	for(i = 0; i < n; i++)
+		for(k = 0; k < nch; k++)
+			dst[k][i] = *src++;
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
+#undef MIN
+#undef MAX_CHANNELS
+
+/*--------------------------------------------------------------------------*
+ | Registration                              								|
+ *--------------------------------------------------------------------------*/
+
+static const struct luaL_Reg Functions[] = 
+	{
+		{ "gain", Gain },
+		{ "gain_ramp", GainRamp },
+		{ "add", Add },
+		{ "mix", Mix },
+		{ "mac", Mac },
+		{ "clip", Clip },
+		{ "peak", Peak },
+		{ "rms", Rms },
+		{ "interleave", Interleave },
+		{ "deinterleave", Deinterleave },
+		{ NULL, NULL } /* sentinel */
+	};
+
+void dsp_init(void)
+/* selects the kernels (main thread only) */
+	{
+	if(K.name == NULL)
+		SelectKernels();
+	}
+
+void dsp_mix(sample_t *dst, const sample_t *src, size_t n, float g)
+/* dst += src*g, for internal use (see matrix.c) */
+	{ K.mix(dst, src, n, g); }
+
+int dsp_open(lua_State *L)
+/* creates the dsp table and leaves it on top of the stack */
+	{
+	dsp_init();
+	lua_newtable(L);
+	luaL_setfuncs(L, Functions, 0);
+	lua_pushstring(L, K.name);
+	lua_setfield(L, -2, "KERNELS");
+	return 1;
+	}
+
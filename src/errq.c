@@ -0,0 +1,303 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Non-fatal error reports queue											*
+ ****************************************************************************/
+
+#include "internal.h"
+
+/* Errors that occur in threads other than the main one (in particular, in the
+ * JACK real-time thread) cannot be raised directly. Fatal errors are handled
+ * by luajack_error() (see main.c). Non-fatal ones are reported with luajack_report(),
+ * which enqueues an error record in a preallocated lock-free queue (a bounded 
+ * MPSC queue, after D.Vyukov) and wakes up the main thread, which drains the 
+ * queue in jack.sleep() and passes the records to the script's error handler.
+ *
+ * Reports are coalesced: while a record from a given (client, source, severity)
+ * is pending in the queue, further reports from the same origin are only counted,
+ * and the count is delivered with the record. So a storm of errors (e.g. one per 
+ * process cycle) results in at most one record per origin per main loop iteration.
+ * The pending origins are kept in a small open-addressing table (Coalesce), whose
+ * slots hold the full origin key, so different origins are never merged: if no
+ * slot is available for an origin, its reports are queued separately.
+ * Also the wakeups are coalesced: the pipe is written only if the main thread 
+ * has not been already woken up since its last drain.
+ */
+
+#define ERRQ_LEN		64	/* must be a power of 2 */
+#define ERRQ_MSG_LEN	256
+#define COALESCE_LEN	32	/* must be a power of 2 */
+#define COALESCE_PROBE	4	/* max slots probed per origin */
+#define NOSLOT			COALESCE_LEN
+
+typedef struct {
+	size_t		seq;
+	int			severity;
+	int			source;
+	uintptr_t	client_key;
+	unsigned int h;			/* index in Coalesce, or NOSLOT */
+	char		msg[ERRQ_MSG_LEN];
+} errrec_t;
+
+static errrec_t Queue[ERRQ_LEN];
+static size_t Tail;		/* producers position */
+static size_t Head;		/* consumer position (main thread) */
+
+/* A Coalesce slot is FREE, CLAIMED (by a producer that is writing the origin
+ * key), or QUEUED (a record from the origin is pending). The state, a generation 
+ * number (incremented at each claim, to avoid ABA) and the count of reports 
+ * coalesced in the pending record are packed in a single word, so that the 
+ * count is incremented only if the slot still holds the same pending record. */
+#define FREE		0
+#define CLAIMED		1
+#define QUEUED		2
+#define State(w)		((unsigned int)((w) & 3))
+#define Gen(w)			((w) & 0xfffffffc)
+#define Suppressed(w)	((unsigned int)((w) >> 32))
+
+static struct {
+	uint64_t	 word;		/* suppressed << 32 | generation << 2 | state */
+	uintptr_t	 client_key;
+	int			 source;
+	int			 severity;
+} Coalesce[COALESCE_LEN];
+
+static unsigned int Dropped;	/* reports lost because the queue was full */
+static int Woken;				/* 1 if the main thread has been woken up */
+static int Wakefd = -1;
+
+#define Load(x)			__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define Store(x, v)		__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define Exchange(x, v)	__atomic_exchange_n(&(x), (v), __ATOMIC_ACQ_REL)
+
+static unsigned int Hash(uintptr_t client_key, int source, int severity)
+	{ 
+	return (unsigned int)((client_key*2654435761u) ^ ((unsigned)(source + 1)*40503u) ^ 
+			(unsigned)severity) & (COALESCE_LEN - 1);
+	}
+
+#define Relaxed(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define SetRelaxed(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static unsigned int Slot(uintptr_t client_key, int source, int severity)
+/* If a record from the given origin is pending, counts the report in it and
+ * returns -1. Otherwise claims a slot for the origin and returns its index,
+ * or returns NOSLOT if there are none available. */
+	{
+	unsigned int i, h;
+	uint64_t w;
+	h = Hash(client_key, source, severity);
+	for(i = 0; i < COALESCE_PROBE; i++, h = (h + 1) & (COALESCE_LEN - 1))
+		{
+		w = Load(Coalesce[h].word);
+		while(1)
+			{
+			if(State(w) == FREE)
+				{
+				if(!__atomic_compare_exchange_n(&Coalesce[h].word, &w, Gen(w + 4) | CLAIMED,
+						0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+					continue; /* w was updated */
+				SetRelaxed(Coalesce[h].client_key, client_key);
+				SetRelaxed(Coalesce[h].source, source);
+				SetRelaxed(Coalesce[h].severity, severity);
+				Store(Coalesce[h].word, Gen(w + 4) | QUEUED);
+				return h;
+				}
+			if(State(w) == CLAIMED)
+				break;
+			/* QUEUED */
+			if((Relaxed(Coalesce[h].client_key) != client_key) || 
+					(Relaxed(Coalesce[h].source) != source) ||
+					(Relaxed(Coalesce[h].severity) != severity))
+				break;
+			/* count it, unless in the meanwhile the record was delivered */
+			if(__atomic_compare_exchange_n(&Coalesce[h].word, &w, w + ((uint64_t)1 << 32),
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return (unsigned int)-1;
+			}
+		}
+	return NOSLOT;
+	}
+
+static unsigned int Release(unsigned int h)
+/* frees the slot h, and returns the count of the reports coalesced in it */
+	{
+	uint64_t w;
+	if(h == NOSLOT) return 0;
+	w = Load(Coalesce[h].word); /* the generation does not change until freed */
+	return Suppressed(Exchange(Coalesce[h].word, Gen(w) | FREE));
+	}
+
+static void Wakeup(void)
+	{
+	if(Exchange(Woken, 1) == 0)
+		syncpipe_write(Wakefd);
+	}
+
+int luajack_reportv(int severity, uintptr_t client_key, int source, const char *fmt, va_list ap)
+/* reports a non-fatal error (may be called from any thread, real-time ones included) */
+	{
+	errrec_t *rec;
+	size_t pos, seq;
+	intptr_t dif;
+	unsigned int h = Slot(client_key, source, severity);
+
+	if(h == (unsigned int)-1) /* coalesced */
+		return 0;
+
+	pos = __atomic_load_n(&Tail, __ATOMIC_RELAXED);
+	while(1)
+		{
+		rec = &Queue[pos & (ERRQ_LEN - 1)];
+		seq = Load(rec->seq);
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if(dif == 0)
+			{
+			if(__atomic_compare_exchange_n(&Tail, &pos, pos + 1, 1, 
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			}
+		else if(dif < 0) /* full */
+			{
+			/* drop it, together with the reports already coalesced in it */
+			__atomic_add_fetch(&Dropped, 1 + Release(h), __ATOMIC_RELAXED);
+			Wakeup();
+			return 0;
+			}
+		else
+			pos = __atomic_load_n(&Tail, __ATOMIC_RELAXED);
+		}
+
+	rec->severity = severity;
+	rec->source = source;
+	rec->client_key = client_key;
+	rec->h = h;
+	if(vsnprintf(rec->msg, ERRQ_MSG_LEN, fmt, ap) < 0)
+		rec->msg[0] = '\0';
+	Store(rec->seq, pos + 1);
+	Wakeup();
+	return 0;
+	}
+
+int luajack_report(int severity, uintptr_t client_key, int source, const char *fmt, ...)
+	{
+	va_list ap;
+	va_start(ap, fmt);
+	luajack_reportv(severity, client_key, source, fmt, ap);
+	va_end(ap);
+	return 0;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Main thread                                                              |
+ *--------------------------------------------------------------------------*/
+
+static void PushSource(lua_State *L, int source)
+	{
+	switch(source)
+		{
+		case RT_Process: lua_pushstring(L, "process"); break;
+		case RT_BufferSize: lua_pushstring(L, "buffer_size"); break;
+		case RT_Sync: lua_pushstring(L, "sync"); break;
+		case RT_Timebase: lua_pushstring(L, "timebase"); break;
+		default: lua_pushnil(L);
+		}
+	}
+
+static void Deliver(lua_State *L, int severity, uintptr_t client_key, int source,
+					const char *msg, unsigned int suppressed)
+	{
+	if(lua_getfield(L, LUA_REGISTRYINDEX, ERRQ_HANDLER) != LUA_TFUNCTION)
+		{
+		lua_pop(L, 1);
+		fprintf(stderr, "%s: %s", severity == LUAJACK_WARNING ? "warning" : "error", msg);
+		if(suppressed)
+			fprintf(stderr, " (repeated %u more times)", suppressed);
+		fprintf(stderr, "\n");
+		return;
+		}
+	lua_pushstring(L, msg);
+	lua_pushstring(L, severity == LUAJACK_WARNING ? "warning" : "error");
+	if(client_key) lua_pushinteger(L, client_key); else lua_pushnil(L);
+	PushSource(L, source);
+	lua_pushinteger(L, suppressed);
+	lua_call(L, 5, 0);
+	}
+
+void errq_drain(lua_State *L)
+/* delivers the pending reports (main thread) */
+	{
+	errrec_t *rec, tmp;
+	unsigned int dropped;
+	Store(Woken, 0);
+	while(1)
+		{
+		rec = &Queue[Head & (ERRQ_LEN - 1)];
+		if(Load(rec->seq) != Head + 1) /* empty */
+			break;
+		tmp = *rec;
+		Store(rec->seq, Head + ERRQ_LEN);
+		Head++;
+		/* new reports from the same origin will be queued again */
+		Deliver(L, tmp.severity, tmp.client_key, tmp.source, tmp.msg, Release(tmp.h));
+		}
+	if((dropped = Exchange(Dropped, 0)) > 0)
+		Deliver(L, LUAJACK_WARNING, 0, -1, "error reports queue full", dropped);
+	}
+
+void errq_init(int wakefd)
+	{
+	size_t i;
+	for(i = 0; i < ERRQ_LEN; i++)
+		Queue[i].seq = i;
+	Head = Tail = 0;
+	Wakefd = wakefd;
+	}
+
+static int ErrorHandler(lua_State *L)
+/* error_handler(func) */
+	{
+	luajack_checkmain();
+	if(!lua_isnoneornil(L, 1))
+		luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, ERRQ_HANDLER);
+	return 0;
+	}
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "error_handler", ErrorHandler },
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_errq(lua_State *L, int state_type)
+	{
+	if(state_type == ST_MAIN)
+		luaL_setfuncs(L, MFunctions, 0);
+	return 1;
+	}
+
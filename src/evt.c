@@ -27,89 +27,137 @@
  * Non-rt callbacks queue                                                   *
  ****************************************************************************/
 
+/* Events are taken from a fixed-size pool of preallocated records (with inline
+ * storage for names), so that the JACK notification threads never call the
+ * allocator nor take a lock:
+ * - free records are kept in a lock-free stack (popped by the JACK threads and
+ *   pushed back by the main pthread only), whose head is tagged to avoid ABA;
+ * - ready records are passed to the main pthread through an MPSC queue (see
+ *   mpsc.c) of record indices, which can not fill up since it is as large as
+ *   the pool;
+ * - the evtpipe is written only by the producer that finds no wakeup pending,
+ *   so a burst of events costs a single write() and a single pselect() return.
+ * If the pool is exhausted, the event is dropped and counted as an overflow.
+ */
+
 #include "internal.h"
 
-static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
-#define evt_lock() pthread_mutex_lock(&Lock)
-#define evt_unlock() pthread_mutex_unlock(&Lock)
+static evt_t *Pool = NULL;
+static uint32_t Next[EVT_POOLSIZE]; /* free stack links (index+1, 0=none) */
+static uint64_t FreeHead = 0; /* aba tag << 32 | (index+1) */
+static mpsc_t *Ready = NULL;
+static rbstats_t ReadyStats; /* unused, but required by mpsc_new() */
+static unsigned int Counter = 0; /* no. of events in the Ready queue */
+static unsigned int Overflows = 0; /* no. of events dropped because of a full pool */
+static int Wakeup = 0; /* 1 if a byte was written to the evtpipe and not yet consumed */
 
-static SIMPLEQ_HEAD(myfifo_s, evt_s) head = SIMPLEQ_HEAD_INITIALIZER(head);
-static unsigned int counter = 0;
+#define Index(head) ((uint32_t)((head) & 0xffffffff))
+#define Tag(head)   ((head) >> 32)
+#define Head(tag, index) (((uint64_t)(tag) << 32) | (uint64_t)(index))
+
+static void Push(uint32_t i)
+/* pushes the record with index i on the free stack (main pthread only) */
+    {
+    uint64_t head = __atomic_load_n(&FreeHead, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&Next[i], Index(head), __ATOMIC_RELAXED);
+    } while(!__atomic_compare_exchange_n(&FreeHead, &head, Head(Tag(head)+1, i+1),
+                    1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+static evt_t* Pop(void)
+/* pops a record from the free stack, or returns NULL if the pool is exhausted */
+    {
+    uint32_t index;
+    uint64_t head = __atomic_load_n(&FreeHead, __ATOMIC_ACQUIRE);
+    do {
+        if((index = Index(head)) == 0) return NULL;
+    } while(!__atomic_compare_exchange_n(&FreeHead, &head,
+                    Head(Tag(head)+1, __atomic_load_n(&Next[index-1], __ATOMIC_RELAXED)),
+                    1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return &Pool[index-1];
+    }
+
+int evt_init(void)
+/* called once, by the main pthread at initialization */
+    {
+    uint32_t i;
+    if((Pool = (evt_t*)Malloc(EVT_POOLSIZE * sizeof(evt_t))) == NULL)
+        return -1;
+    if((Ready = mpsc_new(EVT_POOLSIZE, sizeof(uint32_t), 0, &ReadyStats)) == NULL)
+        { Free(Pool); Pool = NULL; return -1; }
+    for(i = EVT_POOLSIZE; i > 0; i--)
+        Push(i-1);
+    return 0;
+    }
 
 evt_t* evt_new(void)
     { 
-    evt_t *evt = (evt_t*)Malloc(sizeof(evt_t));
-    if(!evt) return NULL;
-    memset(evt, 0, sizeof(evt_t));
+    evt_t *evt = Pop();
+    if(!evt) 
+        { __atomic_add_fetch(&Overflows, 1, __ATOMIC_RELAXED); return NULL; }
+    memset(evt, 0, offsetof(evt_t, arg1));
+    evt->arg1[0] = evt->arg2[0] = '\0';
     return evt;
     }
 
 unsigned int evt_count(void)
-    { return counter; }
+    { return __atomic_load_n(&Counter, __ATOMIC_ACQUIRE); }
+
+unsigned int evt_overflows(void)
+    { return __atomic_load_n(&Overflows, __ATOMIC_RELAXED); }
 
 void evt_free(evt_t *evt)
     { 
-    if(evt->arg1) Free(evt->arg1);
-    if(evt->arg2) Free(evt->arg2);
     if(evt->session_event) jack_session_event_free(evt->session_event);
-    Free(evt);
+    evt->session_event = NULL;
+    Push((uint32_t)(evt - Pool));
     }
 
 void evt_insert(evt_t *evt) 
     { 
-    evt_lock();
-    SIMPLEQ_INSERT_TAIL(&head, evt, entry);
-    counter++;
-    syncpipe_write(luajack_evtpipe[1]); /* to make pselect() return */
-    evt_unlock();
+    uint32_t index = (uint32_t)(evt - Pool);
+    mpsc_cwrite(Ready, 0, &index, sizeof(index)); /* can't fail */
+    __atomic_add_fetch(&Counter, 1, __ATOMIC_RELEASE);
+    evt_signal();
     }
 
-static evt_t* remove_nolock(void)
-    { 
-    evt_t *evt = SIMPLEQ_FIRST(&head);
-    if(evt) 
-        { 
-        SIMPLEQ_REMOVE_HEAD(&head, entry);
-        syncpipe_read(luajack_evtpipe[0]);
-        counter--;
-        }
-    return evt;
-    }
-
-evt_t* evt_remove(void)
-    { 
-    evt_t *evt;
-    evt_lock();
-    evt = remove_nolock();
-    evt_unlock();
-    return evt;
+void evt_signal(void)
+/* wakes up the main pthread, unless a wakeup is already pending */
+    {
+    if(__atomic_exchange_n(&Wakeup, 1, __ATOMIC_SEQ_CST) == 0)
+        syncpipe_write(luajack_evtpipe[1]); /* to make pselect() return */
     }
 
-evt_t* evt_first(void)
-    { 
-    evt_t *evt;
-    evt_lock();
-    evt = SIMPLEQ_FIRST(&head);
-    evt_unlock();
-    return evt; 
+void evt_rearm(void)
+/* Called by the main pthread before dispatching the events: re-enables the 
+ * wakeup and consumes the pending one. Events inserted after this call will
+ * write to the evtpipe again, so none is left behind. */
+    {
+    __atomic_store_n(&Wakeup, 0, __ATOMIC_SEQ_CST);
+    syncpipe_readn(luajack_evtpipe[0], EVT_POOLSIZE); /* drain it (including stray bytes) */
     }
 
-evt_t* evt_next(evt_t *evt)
+evt_t* evt_remove(void)
     { 
-    evt_t *evt1;
-    evt_lock();
-    evt1 = SIMPLEQ_NEXT(evt, entry);
-    evt_unlock();
-    return evt1; 
+    uint32_t index, tag;
+    size_t len;
+    if(!mpsc_cread(Ready, &index, sizeof(index), 1, &tag, &len))
+        return NULL;
+    __atomic_sub_fetch(&Counter, 1, __ATOMIC_RELAXED);
+    return &Pool[index];
     }
 
 void evt_free_all(void)
     {
     evt_t *evt;
 /* called only at exit, from the main thread and with all other threads inactive */
-/* evt_lock(); */
-    while((evt = remove_nolock()) != NULL)
+    if(!Pool) return;
+    while((evt = evt_remove()) != NULL)
         evt_free(evt);
-/* evt_lock(); */
+    mpsc_free(Ready);
+    Free(Pool);
+    Ready = NULL;
+    Pool = NULL;
     }
 
@@ -0,0 +1,151 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Handle tables                                                            *
+ ****************************************************************************/
+
+#include "internal.h"
+
+/* A handle table maps integer handles (the references to LuaJack objects that
+ * are passed to Lua scripts) to the objects' records, in O(1).
+ *
+ * A handle encodes the index of a slot in the table (in its lower HANDLE_INDEX_BITS)
+ * and the generation of the slot when the handle was created (in the upper bits).
+ * When a slot is released its generation is incremented, so that stale handles 
+ * are detected and rejected even if the slot is later reused.
+ *
+ * The slots are allocated in pages that, once allocated, are never moved or
+ * released (until handle_freetab() is called at exit), so lookups can be done 
+ * lock-free from any thread, while insertions and removals are done by the main 
+ * thread only.
+ */
+
+#define INDEX(key)	((uint32_t)((key) & (HANDLE_MAX - 1)))
+#define GEN(key)	((uintptr_t)(key) >> HANDLE_INDEX_BITS)
+#define KEY(gen, index) (((uintptr_t)(gen) << HANDLE_INDEX_BITS) | (uintptr_t)(index))
+#define GENMASK		((uintptr_t)-1 >> HANDLE_INDEX_BITS)
+
+static handleslot_t *Slot(handletab_t *tab, uint32_t index)
+	{
+	handleslot_t *page = __atomic_load_n(&tab->page[index >> HANDLE_PAGE_LOG2], __ATOMIC_ACQUIRE);
+	return page ? &page[index & (HANDLE_PAGE - 1)] : NULL;
+	}
+
+uintptr_t handle_new(handletab_t *tab, void *ptr)
+/* inserts ptr in the table and returns its handle (0 if the table is full) */
+	{
+	uint32_t index;
+	handleslot_t *slot, *page;
+	if(tab->freelist) /* reuse a released slot */
+		{
+		index = tab->freelist - 1;
+		slot = Slot(tab, index);
+		tab->freelist = slot->nextfree;
+		}
+	else
+		{
+		if(tab->n >= HANDLE_MAX)
+			return 0;
+		index = tab->n;
+		if((slot = Slot(tab, index)) == NULL)
+			{
+			if((page = (handleslot_t*)Malloc(HANDLE_PAGE*sizeof(handleslot_t))) == NULL)
+				return 0;
+			memset(page, 0, HANDLE_PAGE*sizeof(handleslot_t));
+			__atomic_store_n(&tab->page[index >> HANDLE_PAGE_LOG2], page, __ATOMIC_RELEASE);
+			slot = &page[index & (HANDLE_PAGE - 1)];
+			}
+		__atomic_store_n(&tab->n, tab->n + 1, __ATOMIC_RELEASE);
+		}
+	if(slot->gen == 0) /* so that handles are never 0 */
+		__atomic_store_n(&slot->gen, 1, __ATOMIC_RELAXED);
+	slot->nextfree = 0;
+	__atomic_store_n(&slot->ptr, ptr, __ATOMIC_RELEASE);
+	return KEY(slot->gen, index);
+	}
+
+void *handle_get(handletab_t *tab, uintptr_t key)
+/* returns the object with the given handle, or NULL if the handle is not valid */
+	{
+	handleslot_t *slot;
+	void *ptr;
+	if(INDEX(key) >= __atomic_load_n(&tab->n, __ATOMIC_ACQUIRE))
+		return NULL;
+	if((slot = Slot(tab, INDEX(key))) == NULL)
+		return NULL;
+	ptr = __atomic_load_n(&slot->ptr, __ATOMIC_ACQUIRE);
+	return (__atomic_load_n(&slot->gen, __ATOMIC_RELAXED) == GEN(key)) ? ptr : NULL;
+	}
+
+void handle_free(handletab_t *tab, uintptr_t key)
+/* releases the slot of the given handle (main thread) */
+	{
+	handleslot_t *slot;
+	if(handle_get(tab, key) == NULL)
+		return;
+	slot = Slot(tab, INDEX(key));
+	__atomic_store_n(&slot->ptr, NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&slot->gen, (slot->gen + 1) & GENMASK, __ATOMIC_RELAXED);
+	slot->nextfree = tab->freelist;
+	tab->freelist = INDEX(key) + 1;
+	}
+
+void *handle_first(handletab_t *tab, uintptr_t key)
+/* returns the first object whose slot index is greater than or equal to 
+ * the index of key (key = 0 means from the beginning), or NULL */
+	{
+	uint32_t index;
+	handleslot_t *slot;
+	for(index = INDEX(key); index < tab->n; index++)
+		{
+		if(((slot = Slot(tab, index)) != NULL) && slot->ptr)
+			return slot->ptr;
+		}
+	return NULL;
+	}
+
+void *handle_next(handletab_t *tab, uintptr_t key)
+/* returns the object following the one with the given handle, or NULL */
+	{
+	if(INDEX(key) + 1 >= HANDLE_MAX) 
+		return NULL;
+	return handle_first(tab, INDEX(key) + 1);
+	}
+
+void handle_freetab(handletab_t *tab)
+/* releases all the pages (to be called when the table is no longer used) */
+	{
+	int i;
+	for(i = 0; i < HANDLE_NPAGES; i++)
+		{
+		if(tab->page[i]) 
+			Free(tab->page[i]);
+		tab->page[i] = NULL;
+		}
+	tab->n = 0;
+	tab->freelist = 0;
+	}
+
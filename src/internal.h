@@ -40,7 +40,6 @@
 #include <pthread.h>
 #include <jack/session.h>
 #include "luajack.h"
-#include "tree.h"
 #include "queue.h"
 
 #define TOSTR_(x) #x
@@ -68,6 +67,7 @@
 
 /* Registry keys used by luajack */
 #define LUAJACK_OSEXIT "luajack_osexit"  /* the original os.exit() */
+#define ERRQ_HANDLER "luajack_errhandler"  /* the error handler (see errq.c) */
 
 /* Lua-state types */
 #define ST_MAIN		1
@@ -133,6 +133,10 @@ int process_ccallback_sync(cud_t *cud, JackSyncCallback cb, void *arg);
 int process_ccallback_timebase(cud_t *cud, int conditional,  JackTimebaseCallback cb, void *arg);
 #define process_ccallback_release_timebase luajack_process_ccallback_release_timebase
 int process_ccallback_release_timebase(cud_t *cud);
+#define process_ccallback_matrix luajack_process_ccallback_matrix
+int process_ccallback_matrix(cud_t *cud);
+#define process_run luajack_process_run
+int process_run(cud_t *cud, nframes_t nframes);
 
 /* callback.c */
 #define callback_flush luajack_callback_flush
@@ -149,12 +153,16 @@ void evt_free(evt_t *evt);
 void evt_insert(evt_t *evt); 
 #define evt_remove luajack_evt_remove
 evt_t* evt_remove(void);
-#define evt_first luajack_evt_first
-evt_t* evt_first(void);
-#define evt_next luajack_evt_next
-evt_t* evt_next(evt_t *evt);
+#define evt_rearm luajack_evt_rearm
+void evt_rearm(void);
+#define evt_signal luajack_evt_signal
+void evt_signal(void);
 #define evt_count luajack_evt_count
 unsigned int evt_count(void);
+#define evt_overflows luajack_evt_overflows
+unsigned int evt_overflows(void);
+#define evt_init luajack_evt_init
+int evt_init(void);
 #define evt_free_all luajack_evt_free_all
 void evt_free_all(void);
 
@@ -167,6 +175,148 @@ int transport_pushposition(lua_State *L, jack_position_t *pos);
 /* buffer.c */
 #define buffer_drop_all luajack_buffer_drop_all
 void buffer_drop_all(cud_t *cud);
+#define buffer_checksamples luajack_buffer_checksamples
+sample_t* buffer_checksamples(lua_State *L, int arg, nframes_t *nframes, int output);
+
+/* dsp.c */
+#define dsp_open luajack_dsp_open
+int dsp_open(lua_State *L);
+#define dsp_init luajack_dsp_init
+void dsp_init(void);
+#define dsp_mix luajack_dsp_mix
+void dsp_mix(sample_t *dst, const sample_t *src, size_t n, float g);
+
+/* matrix.c */
+#define matrix_process luajack_matrix_process
+void matrix_process(cud_t *cud, nframes_t nframes);
+#define matrix_free luajack_matrix_free
+void matrix_free(cud_t *cud);
+
+/* rtalloc.c */
+#define rtalloc_new luajack_rtalloc_new
+rtpool_t *rtalloc_new(size_t size);
+#define rtalloc_free luajack_rtalloc_free
+void rtalloc_free(rtpool_t *pool);
+#define rtalloc_allocf luajack_rtalloc_allocf
+void *rtalloc_allocf(void *ud, void *ptr, size_t osize, size_t nsize);
+
+/* errq.c */
+#define LUAJACK_ERROR	1	/* non-fatal error reports severity */
+#define LUAJACK_WARNING	2
+int luajack_report(int severity, uintptr_t client_key, int source, const char *fmt, ...);
+int luajack_reportv(int severity, uintptr_t client_key, int source, const char *fmt, va_list ap);
+#define errq_init luajack_errq_init
+void errq_init(int wakefd);
+#define errq_drain luajack_errq_drain
+void errq_drain(lua_State *L);
+
+/* trace.c */
+#define trace_record luajack_trace_record
+void trace_record(cud_t *cud, double start, double end, double gc);
+#define trace_close luajack_trace_close
+void trace_close(cud_t *cud);
+
+/* ahead.c */
+#define ahead_buffer luajack_ahead_buffer
+void *ahead_buffer(pud_t *pud);
+#define ahead_latency luajack_ahead_latency
+void ahead_latency(cud_t *cud, jack_latency_callback_mode_t mode);
+#define ahead_buffer_size luajack_ahead_buffer_size
+void ahead_buffer_size(cud_t *cud, nframes_t nframes);
+#define ahead_cycle_times luajack_ahead_cycle_times
+int ahead_cycle_times(cud_t *cud, jack_nframes_t *frame, jack_time_t *usecs,
+						jack_time_t *next_usecs, float *period_usecs);
+#define ahead_free luajack_ahead_free
+void ahead_free(cud_t *cud);
+
+/* worker.c */
+#define worker_self luajack_worker_self
+unsigned int worker_self(void);
+#define worker_fork luajack_worker_fork
+void worker_fork(cud_t *cud, nframes_t nframes);
+#define worker_join luajack_worker_join
+void worker_join(cud_t *cud);
+#define worker_callback luajack_worker_callback
+int worker_callback(lua_State *L, cud_t *cud);
+#define worker_free luajack_worker_free
+void worker_free(cud_t *cud);
+
+/* audioring.c */
+#define audioring_read_space luajack_audioring_read_space
+size_t audioring_read_space(rud_t *rud);
+#define audioring_write_space luajack_audioring_write_space
+size_t audioring_write_space(rud_t *rud);
+#define audioring_put luajack_audioring_put
+size_t audioring_put(rud_t *rud, const sample_t *const *src, size_t stride, size_t nframes);
+#define audioring_get luajack_audioring_get
+size_t audioring_get(rud_t *rud, sample_t *const *dst, size_t stride, size_t nframes);
+#define audioring_put_interleaved luajack_audioring_put_interleaved
+size_t audioring_put_interleaved(rud_t *rud, const sample_t *buf, size_t nframes);
+#define audioring_get_interleaved luajack_audioring_get_interleaved
+size_t audioring_get_interleaved(rud_t *rud, sample_t *buf, size_t nframes);
+#define audioring_free luajack_audioring_free
+void audioring_free(rud_t *rud);
+
+/* mpsc.c */
+typedef struct mpsc_s mpsc_t;
+#define mpsc_new luajack_mpsc_new
+mpsc_t *mpsc_new(size_t ncells, size_t maxlen, int mlock_, rbstats_t *stats);
+#define mpsc_free luajack_mpsc_free
+void mpsc_free(mpsc_t *q);
+#define mpsc_maxlen luajack_mpsc_maxlen
+size_t mpsc_maxlen(mpsc_t *q);
+#define mpsc_size luajack_mpsc_size
+size_t mpsc_size(mpsc_t *q);
+#define mpsc_fill luajack_mpsc_fill
+size_t mpsc_fill(mpsc_t *q);
+#define mpsc_cwrite luajack_mpsc_cwrite
+int mpsc_cwrite(mpsc_t *q, uint32_t tag, const void *data, size_t len);
+#define mpsc_cread luajack_mpsc_cread
+int mpsc_cread(mpsc_t *q, void *buf, size_t bufsz, int advance, uint32_t *tag, size_t *len);
+#define mpsc_cread_advance luajack_mpsc_cread_advance
+int mpsc_cread_advance(mpsc_t *q);
+#define mpsc_luawrite luajack_mpsc_luawrite
+int mpsc_luawrite(mpsc_t *q, lua_State *L, int arg);
+#define mpsc_luaread luajack_mpsc_luaread
+int mpsc_luaread(mpsc_t *q, lua_State *L, int advance);
+#define mpsc_luaread_advance luajack_mpsc_luaread_advance
+int mpsc_luaread_advance(mpsc_t *q, lua_State *L);
+
+/* mailbox.c */
+#define mbox_write luajack_mbox_write
+int mbox_write(rud_t *rud, const void *data, size_t len);
+#define mbox_read luajack_mbox_read
+int mbox_read(rud_t *rud, void *buf, size_t bufsz, size_t *len);
+#define mbox_size luajack_mbox_size
+size_t mbox_size(rud_t *rud);
+#define mbox_free luajack_mbox_free
+void mbox_free(rud_t *rud);
+
+/* bcast.c */
+#define bcast_write luajack_bcast_write
+int bcast_write(rud_t *rud, uint32_t tag, const void *data, size_t len);
+#define bcast_read luajack_bcast_read
+int bcast_read(rud_t *rud, uint32_t *tag, void *buf, size_t bufsz, size_t *len, int *overrun);
+#define bcast_overruns luajack_bcast_overruns
+uint64_t bcast_overruns(rud_t *rud);
+#define bcast_free luajack_bcast_free
+void bcast_free(rud_t *rud);
+
+/* codec.c */
+#define codec_size luajack_codec_size
+size_t codec_size(lua_State *L, int arg, int maxdepth, size_t maxsize);
+#define codec_encode luajack_codec_encode
+void codec_encode(lua_State *L, int arg, jack_ringbuffer_data_t vec[2]);
+#define codec_decode luajack_codec_decode
+int codec_decode(lua_State *L, jack_ringbuffer_data_t vec[2], int target, int maxdepth);
+
+/* shmring.c */
+#define shmring_create luajack_shmring_create
+int shmring_create(lua_State *L, rud_t *rud, const char *name, size_t sz, int mlock_, int usepipe);
+#define shmring_attach luajack_shmring_attach
+int shmring_attach(lua_State *L, rud_t *rud, const char *name, int mlock_);
+#define shmring_free luajack_shmring_free
+void shmring_free(rud_t *rud);
 
 /* syncpipe.c */
 #define syncpipe_new luajack_syncpipe_new
@@ -175,9 +325,27 @@ int syncpipe_new(int pipefd[2]);
 int syncpipe_write(int writefd);
 #define syncpipe_read luajack_syncpipe_read
 int syncpipe_read(int readfd);
+#define syncpipe_writen luajack_syncpipe_writen
+int syncpipe_writen(int writefd, size_t n);
+#define syncpipe_readn luajack_syncpipe_readn
+int syncpipe_readn(int readfd, size_t n);
 #define syncpipe_init luajack_syncpipe_init
 int syncpipe_init(void);
 
+/* handle.c */
+#define handle_new luajack_handle_new
+uintptr_t handle_new(handletab_t *tab, void *ptr);
+#define handle_get luajack_handle_get
+void *handle_get(handletab_t *tab, uintptr_t key);
+#define handle_free luajack_handle_free
+void handle_free(handletab_t *tab, uintptr_t key);
+#define handle_first luajack_handle_first
+void *handle_first(handletab_t *tab, uintptr_t key);
+#define handle_next luajack_handle_next
+void *handle_next(handletab_t *tab, uintptr_t key);
+#define handle_freetab luajack_handle_freetab
+void handle_freetab(handletab_t *tab);
+
 /* cud.c */
 #define cud_new luajack_cud_new
 cud_t *cud_new(void);
@@ -257,6 +425,12 @@ int ringbuffer_luawrite(jack_ringbuffer_t *rbuf, lua_State *L, int arg);
 int ringbuffer_luaread(jack_ringbuffer_t *rbuf, lua_State *L, int advance);
 #define ringbuffer_luaread_advance luajack_ringbuffer_luaread_advance
 int ringbuffer_luaread_advance(jack_ringbuffer_t *rbuf, lua_State *L);
+#define ringbuffer_creserve luajack_ringbuffer_creserve
+int ringbuffer_creserve(jack_ringbuffer_t *rbuf, size_t len, jack_ringbuffer_data_t vec[2]);
+#define ringbuffer_ccommit luajack_ringbuffer_ccommit
+int ringbuffer_ccommit(jack_ringbuffer_t *rbuf, uint32_t tag, size_t len);
+#define ringbuffer_cacquire luajack_ringbuffer_cacquire
+int ringbuffer_cacquire(jack_ringbuffer_t *rbuf, uint32_t *tag, jack_ringbuffer_data_t vec[2]);
 
 /* latency.c */
 #define latency_pushmode luajack_latency_pushmode
@@ -279,6 +453,12 @@ int rbuf_tables(lua_State *L);
 void rbuf_pipe_write(lua_State *L, rud_t *rud);
 #define rbuf_pipe_read luajack_rbuf_pipe_read
 void rbuf_pipe_read(lua_State *L, rud_t *rud);
+#define rbuf_wstats luajack_rbuf_wstats
+void rbuf_wstats(rud_t *rud, size_t wptr, size_t nmsg, int rejected);
+#define rbuf_rstats luajack_rbuf_rstats
+void rbuf_rstats(rud_t *rud, size_t rptr, size_t nmsg);
+#define rbuf_getstats luajack_rbuf_getstats
+void rbuf_getstats(rud_t *rud, luajack_ringbuffer_stats_t *stats);
 
 /* thread.c */
 #define thread_free_all luajack_thread_free_all
@@ -303,7 +483,17 @@ int luajack_open_rbuf(lua_State *L, int state_type);
 int luajack_open_thread(lua_State *L, int state_type);
 int luajack_open_process(lua_State *L, int state_type);
 int luajack_open_buffer(lua_State *L, int state_type);
+int luajack_open_matrix(lua_State *L, int state_type);
+int luajack_open_rtalloc(lua_State *L, int state_type);
+int luajack_open_trace(lua_State *L, int state_type);
+int luajack_open_errq(lua_State *L, int state_type);
+int luajack_open_ahead(lua_State *L, int state_type);
+int luajack_open_worker(lua_State *L, int state_type);
 int luajack_open_session(lua_State *L, int state_type);
+int luajack_open_audioring(lua_State *L, int state_type);
+int luajack_open_mpsc(lua_State *L, int state_type);
+int luajack_open_mailbox(lua_State *L, int state_type);
+int luajack_open_bcast(lua_State *L, int state_type);
 
 /*----------------------------------------------------------------------*
  | Debug utilities                                    					|
@@ -317,6 +507,11 @@ void luajack_stat_update(stat_t *stat, double sample);
 #define luajack_stat_max(stat)	(stat)->max
 #define luajack_stat_mean(stat)	(stat)->mean
 double luajack_stat_variance(stat_t *stat);
+void luajack_hist_update(hist_t *hist, double sample);
+void luajack_hist_reset(hist_t *hist);
+uint64_t luajack_hist_n(hist_t *hist);
+double luajack_hist_percentile(hist_t *hist, double p);
+double luajack_hist_max(hist_t *hist);
 
 #if 1 /*@@ Linux */
 #include <sys/syscall.h>
@@ -139,7 +139,10 @@ void* luajack_get_buffer(luajack_t *port)
 	if(pud->buf)
 		{ luajack_error("buffer already retrieved"); return NULL; }
 	pud->nframes = cud->nframes;
-	pud->buf = jack_port_get_buffer(pud->port, pud->nframes);
+	if(cud->ahead) /* compute-ahead worker */
+		pud->buf = ahead_buffer(pud);
+	else
+		pud->buf = jack_port_get_buffer(pud->port, pud->nframes);
 	if(!pud->buf)
 		{ luajack_error("cannot get port buffer"); return NULL; }
 	pud->bufp = 0;
@@ -165,39 +168,194 @@ size_t luajack_get_buffer_midi_out(luajack_t *port);
 
 int luajack_ringbuffer_write(luajack_t *ringbuffer, uint32_t tag, const void *data, size_t len)
 	{
+	int rc;
+	size_t wptr;
 	rud_t *rud = get_rud(ringbuffer);
 	if(!rud) return 0;
-	return ringbuffer_cwrite(rud->rbuf, tag, data, len);
+	if(rud->mpsc) return mpsc_cwrite(rud->mpsc, tag, data, len);
+	if(!rud->rbuf) return 0;
+	wptr = rud->rbuf->write_ptr;
+	rc = ringbuffer_cwrite(rud->rbuf, tag, data, len);
+	rbuf_wstats(rud, wptr, rc, !rc);
+	return rc;
 	}
 
 int luajack_ringbuffer_read(luajack_t *ringbuffer, uint32_t *tag, void *buf, size_t bufsz, size_t *len)
 	{
+	int rc;
+	size_t rptr;
 	rud_t *rud = get_rud(ringbuffer);
 	if(!rud) return 0;
-	return ringbuffer_cread(rud->rbuf, buf, bufsz, 1, tag, len);
+	if(rud->mpsc) return mpsc_cread(rud->mpsc, buf, bufsz, 1, tag, len);
+	if(!rud->rbuf) return 0;
+	rptr = rud->rbuf->read_ptr;
+	rc = ringbuffer_cread(rud->rbuf, buf, bufsz, 1, tag, len);
+	rbuf_rstats(rud, rptr, rc);
+	return rc;
 	}
 
 int luajack_ringbuffer_peek(luajack_t *ringbuffer, uint32_t *tag, void *buf, size_t bufsz, size_t *len)
 	{
 	rud_t *rud = get_rud(ringbuffer);
 	if(!rud) return 0;
+	if(rud->mpsc) return mpsc_cread(rud->mpsc, buf, bufsz, 0, tag, len);
+	if(!rud->rbuf) return 0;
 	return ringbuffer_cread(rud->rbuf, buf, bufsz, 0, tag, len);
 	}
 
 int luajack_ringbuffer_read_advance(luajack_t *ringbuffer)
 	{
+	int rc;
+	size_t rptr;
 	rud_t *rud = get_rud(ringbuffer);
 	if(!rud) return 0;
-	return ringbuffer_cread_advance(rud->rbuf);
+	if(rud->mpsc) return mpsc_cread_advance(rud->mpsc);
+	if(!rud->rbuf) return 0;
+	rptr = rud->rbuf->read_ptr;
+	rc = ringbuffer_cread_advance(rud->rbuf);
+	rbuf_rstats(rud, rptr, rc);
+	return rc;
 	}
 
 int luajack_ringbuffer_reset(luajack_t *ringbuffer)
 	{
 	rud_t *rud = get_rud(ringbuffer);
-	if(!rud) return 0;
+	if(!rud || !rud->rbuf) return 0;
 	return ringbuffer_creset(rud->rbuf);
 	}
 
+int luajack_ringbuffer_reserve(luajack_t *ringbuffer, size_t len, jack_ringbuffer_data_t vec[2])
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->rbuf) return 0;
+	if(!ringbuffer_creserve(rud->rbuf, len, vec))
+		{ rbuf_wstats(rud, 0, 0, 1); return 0; }
+	return 1;
+	}
+
+int luajack_ringbuffer_commit(luajack_t *ringbuffer, uint32_t tag, size_t len)
+	{
+	int rc;
+	size_t wptr;
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->rbuf) return 0;
+	wptr = rud->rbuf->write_ptr;
+	rc = ringbuffer_ccommit(rud->rbuf, tag, len);
+	rbuf_wstats(rud, wptr, rc, 0);
+	return rc;
+	}
+
+int luajack_ringbuffer_acquire(luajack_t *ringbuffer, uint32_t *tag, jack_ringbuffer_data_t vec[2])
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->rbuf) return 0;
+	return ringbuffer_cacquire(rud->rbuf, tag, vec);
+	}
+
+int luajack_ringbuffer_release(luajack_t *ringbuffer)
+	{
+	int rc;
+	size_t rptr;
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->rbuf) return 0;
+	rptr = rud->rbuf->read_ptr;
+	rc = ringbuffer_cread_advance(rud->rbuf);
+	rbuf_rstats(rud, rptr, rc);
+	return rc;
+	}
+
+int luajack_ringbuffer_stats(luajack_t *ringbuffer, luajack_ringbuffer_stats_t *stats)
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || (!rud->rbuf && !rud->mpsc)) return 0;
+	rbuf_getstats(rud, stats);
+	return 1;
+	}
+
+int luajack_mailbox_write(luajack_t *mailbox, const void *data, size_t len)
+	{
+	rud_t *rud = get_rud(mailbox);
+	if(!rud || !rud->mailbox) return 0;
+	return mbox_write(rud, data, len);
+	}
+
+int luajack_mailbox_read(luajack_t *mailbox, void *buf, size_t bufsz, size_t *len)
+	{
+	rud_t *rud = get_rud(mailbox);
+	if(!rud || !rud->mailbox) return 0;
+	return mbox_read(rud, buf, bufsz, len);
+	}
+
+size_t luajack_mailbox_size(luajack_t *mailbox)
+	{
+	rud_t *rud = get_rud(mailbox);
+	if(!rud || !rud->mailbox) return 0;
+	return mbox_size(rud);
+	}
+
+int luajack_broadcast_write(luajack_t *bcast, uint32_t tag, const void *data, size_t len)
+	{
+	rud_t *rud = get_rud(bcast);
+	if(!rud || !rud->bcast) return 0;
+	return bcast_write(rud, tag, data, len);
+	}
+
+int luajack_broadcast_read(luajack_t *reader, uint32_t *tag, void *buf, size_t bufsz, size_t *len, int *overrun)
+	{
+	rud_t *rud = get_rud(reader);
+	if(!rud || !rud->bcreader) return 0;
+	return bcast_read(rud, tag, buf, bufsz, len, overrun);
+	}
+
+uint64_t luajack_broadcast_overruns(luajack_t *reader)
+	{
+	rud_t *rud = get_rud(reader);
+	if(!rud || !rud->bcreader) return 0;
+	return bcast_overruns(rud);
+	}
+
+size_t luajack_audio_ringbuffer_write(luajack_t *ringbuffer, const jack_default_audio_sample_t *const *bufs, size_t nframes)
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->audio) return 0;
+	return audioring_put(rud, bufs, 1, nframes);
+	}
+
+size_t luajack_audio_ringbuffer_read(luajack_t *ringbuffer, jack_default_audio_sample_t *const *bufs, size_t nframes)
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->audio) return 0;
+	return audioring_get(rud, bufs, 1, nframes);
+	}
+
+size_t luajack_audio_ringbuffer_write_interleaved(luajack_t *ringbuffer, const jack_default_audio_sample_t *buf, size_t nframes)
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->audio) return 0;
+	return audioring_put_interleaved(rud, buf, nframes);
+	}
+
+size_t luajack_audio_ringbuffer_read_interleaved(luajack_t *ringbuffer, jack_default_audio_sample_t *buf, size_t nframes)
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->audio) return 0;
+	return audioring_get_interleaved(rud, buf, nframes);
+	}
+
+size_t luajack_audio_ringbuffer_read_space(luajack_t *ringbuffer)
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->audio) return 0;
+	return audioring_read_space(rud);
+	}
+
+size_t luajack_audio_ringbuffer_write_space(luajack_t *ringbuffer)
+	{
+	rud_t *rud = get_rud(ringbuffer);
+	if(!rud || !rud->audio) return 0;
+	return audioring_write_space(rud);
+	}
+
 /*------------------------------------------------------------------------------*
  | Real-time scheduling															|
  *------------------------------------------------------------------------------*/
@@ -112,6 +112,41 @@ int luajack_ringbuffer_read(luajack_t *ringbuffer, uint32_t *tag, void *buf, siz
 int luajack_ringbuffer_peek(luajack_t *ringbuffer, uint32_t *tag, void *buf, size_t bufsz, size_t *len);
 int luajack_ringbuffer_read_advance(luajack_t *ringbuffer);
 int luajack_ringbuffer_reset(luajack_t *ringbuffer);
+int luajack_ringbuffer_reserve(luajack_t *ringbuffer, size_t len, jack_ringbuffer_data_t vec[2]);
+int luajack_ringbuffer_commit(luajack_t *ringbuffer, uint32_t tag, size_t len);
+int luajack_ringbuffer_acquire(luajack_t *ringbuffer, uint32_t *tag, jack_ringbuffer_data_t vec[2]);
+int luajack_ringbuffer_release(luajack_t *ringbuffer);
+
+typedef struct {
+	uint64_t written;		/* messages written */
+	uint64_t read;			/* messages read */
+	uint64_t bytes_written;	/* bytes written (message headers included) */
+	uint64_t bytes_read;	/* bytes read (message headers included) */
+	uint64_t rejected;		/* writes failed for lack of space */
+	uint64_t wraps;			/* messages split across the end of the buffer */
+	uint64_t fill;			/* current fill level (bytes, or messages for MPSC) */
+	uint64_t peak;			/* peak fill level */
+	uint64_t size;			/* capacity (bytes, or messages for MPSC) */
+} luajack_ringbuffer_stats_t;
+int luajack_ringbuffer_stats(luajack_t *ringbuffer, luajack_ringbuffer_stats_t *stats);
+
+/* mailboxes (see jack.mailbox) */
+int luajack_mailbox_write(luajack_t *mailbox, const void *data, size_t len);
+int luajack_mailbox_read(luajack_t *mailbox, void *buf, size_t bufsz, size_t *len);
+size_t luajack_mailbox_size(luajack_t *mailbox);
+
+/* broadcast rings (see jack.broadcast) */
+int luajack_broadcast_write(luajack_t *bcast, uint32_t tag, const void *data, size_t len);
+int luajack_broadcast_read(luajack_t *reader, uint32_t *tag, void *buf, size_t bufsz, size_t *len, int *overrun);
+uint64_t luajack_broadcast_overruns(luajack_t *reader);
+
+/* audio ringbuffers (planar buffers, one per channel, or interleaved frames) */
+size_t luajack_audio_ringbuffer_write(luajack_t *ringbuffer, const jack_default_audio_sample_t *const *bufs, size_t nframes);
+size_t luajack_audio_ringbuffer_read(luajack_t *ringbuffer, jack_default_audio_sample_t *const *bufs, size_t nframes);
+size_t luajack_audio_ringbuffer_write_interleaved(luajack_t *ringbuffer, const jack_default_audio_sample_t *buf, size_t nframes);
+size_t luajack_audio_ringbuffer_read_interleaved(luajack_t *ringbuffer, jack_default_audio_sample_t *buf, size_t nframes);
+size_t luajack_audio_ringbuffer_read_space(luajack_t *ringbuffer);
+size_t luajack_audio_ringbuffer_write_space(luajack_t *ringbuffer);
 
 /* server operations control */
 int luajack_set_freewheel(luajack_t *client, int onoff); 
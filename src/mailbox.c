@@ -0,0 +1,247 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Mailboxes																*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <sys/mman.h>
+
+/* A mailbox is a lossy register holding the latest value written in it, for
+ * telemetry-like data where only the most recent value matters (e.g. meters). 
+ * It is a triple buffer: the writer owns a 'back' slot, the reader owns a 
+ * 'front' slot, and the third one is exchanged between the two through the 
+ * atomic 'middle' variable, which also carries a 'fresh' flag:
+ * - the writer fills its slot, then swaps it with the middle one (marking it
+ *   as fresh), so that it never waits for the reader;
+ * - the reader, if the middle slot is fresh, swaps it with its own slot, so
+ *   that it always gets the newest complete value.
+ * Both operations are wait-free. The value is a payload of up to 'size' bytes.
+ */
+
+#define FRESH 4
+
+typedef struct {
+	size_t	len;
+	/* followed by the payload */
+} slot_t;
+
+typedef struct {
+	size_t	size;		/* max payload size */
+	size_t	slotsize;
+	size_t	memsize;
+	char	*mem;
+	int		middle;		/* slot index | FRESH (atomic) */
+	int		back;		/* writer's slot */
+	int		front;		/* reader's slot */
+	int		written;	/* 1 after the first read of a fresh value */
+} mailbox_t;
+
+#define MB(rud) ((mailbox_t*)(rud)->mailbox)
+#define Slot(mb, i) ((slot_t*)((mb)->mem + (i)*(mb)->slotsize))
+#define SlotData(slot) ((char*)((slot) + 1))
+
+static void *Reserve(mailbox_t *mb)
+	{
+	return SlotData(Slot(mb, mb->back));
+	}
+
+static void Publish(mailbox_t *mb, size_t len)
+	{
+	Slot(mb, mb->back)->len = len;
+	mb->back = __atomic_exchange_n(&mb->middle, mb->back | FRESH, __ATOMIC_ACQ_REL) & ~FRESH;
+	}
+
+static slot_t *Fetch(mailbox_t *mb, int *fresh)
+/* returns the newest slot (NULL if nothing was ever written) */
+	{
+	*fresh = 0;
+	if(__atomic_load_n(&mb->middle, __ATOMIC_RELAXED) & FRESH)
+		{
+		mb->front = __atomic_exchange_n(&mb->middle, mb->front, __ATOMIC_ACQ_REL) & ~FRESH;
+		mb->written = 1;
+		*fresh = 1;
+		}
+	return mb->written ? Slot(mb, mb->front) : NULL;
+	}
+
+int mbox_write(rud_t *rud, const void *data, size_t len)
+/* returns 1 on success, or 0 if len exceeds the mailbox size */
+	{
+	mailbox_t *mb = MB(rud);
+	if(len > mb->size) return 0;
+	if(len) memcpy(Reserve(mb), data, len);
+	Publish(mb, len);
+	return 1;
+	}
+
+int mbox_read(rud_t *rud, void *buf, size_t bufsz, size_t *len)
+/* copies the newest value in buf, and returns 1 if it is a new value since the
+ * last read or 0 if not (*len = 0 if nothing was ever written) */
+	{
+	int fresh;
+	slot_t *slot = Fetch(MB(rud), &fresh);
+	*len = 0;
+	if(!slot) return 0;
+	if(slot->len > bufsz)
+		return luajack_error("not enough space for mailbox_read() "
+						"(at least %u bytes needed)", (unsigned int)slot->len);
+	memcpy(buf, SlotData(slot), slot->len);
+	*len = slot->len;
+	return fresh;
+	}
+
+size_t mbox_size(rud_t *rud)
+	{
+	return MB(rud)->size;
+	}
+
+void mbox_free(rud_t *rud)
+	{
+	mailbox_t *mb = MB(rud);
+	if(!mb) return;
+	munmap(mb->mem, mb->memsize);
+	Free(mb);
+	rud->mailbox = NULL;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Lua functions                                                            |
+ *--------------------------------------------------------------------------*/
+
+static rud_t *CheckMailbox(lua_State *L, int arg)
+	{
+	rud_t *rud = rud_check(L, arg);
+	if(!rud->mailbox)
+		luaL_argerror(L, arg, "not a mailbox");
+	return rud;
+	}
+
+static int MailboxWrite(lua_State *L)
+/* ok = mailbox_write(mbox, data) */
+	{
+	size_t len;
+	rud_t *rud = CheckMailbox(L, 1);
+	const char *data = luaL_checklstring(L, 2, &len);
+	if(len > MB(rud)->size)
+		return luaL_argerror(L, 2, "data exceeds the mailbox size");
+	mbox_write(rud, data, len);
+	lua_pushboolean(L, 1);
+	return 1;
+	}
+
+static int MailboxRead(lua_State *L)
+/* data, fresh = mailbox_read(mbox) */
+	{
+	int fresh;
+	rud_t *rud = CheckMailbox(L, 1);
+	slot_t *slot = Fetch(MB(rud), &fresh);
+	if(!slot)
+		{ lua_pushnil(L); lua_pushboolean(L, 0); return 2; }
+	lua_pushlstring(L, SlotData(slot), slot->len);
+	lua_pushboolean(L, fresh);
+	return 2;
+	}
+
+static int Mailbox(lua_State *L)
+/* mbox = mailbox(client, size [, mlock]) */
+	{
+	rud_t *rud;
+	mailbox_t *mb;
+	void *mem;
+	cud_t *cud = cud_check(L, 1);
+	lua_Integer size = luaL_checkinteger(L, 2);
+	int mlock_ = lua_toboolean(L, 3);
+
+	luajack_checkcreate();
+	if(size < 0)
+		return luaL_argerror(L, 2, "invalid size");
+	if((mb = (mailbox_t*)Malloc(sizeof(mailbox_t))) == NULL)
+		return luaL_error(L, "cannot allocate memory");
+	memset(mb, 0, sizeof(mailbox_t));
+	mb->size = size;
+	mb->slotsize = ((sizeof(slot_t) + size + 63)/64)*64; /* no false sharing */
+	mb->memsize = 3*mb->slotsize;
+	mem = mmap(NULL, mb->memsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		{ Free(mb); return luaL_error(L, "cannot allocate memory"); }
+	if(mlock_ && (mlock(mem, mb->memsize) != 0))
+		luajack_verbose("cannot lock mailbox in memory (%s)\n", strerror(errno));
+	mb->mem = (char*)mem;
+	mb->back = 0;
+	mb->middle = 1;
+	mb->front = 2;
+
+	if((rud = rud_new()) == NULL)
+		{
+		munmap(mem, mb->memsize);
+		Free(mb);
+		return luaL_error(L, "cannot create userdata");
+		}
+	rud->cud = cud;
+	rud->pipefd[0] = rud->pipefd[1] = -1;
+	rud->mailbox = mb;
+	luajack_verbose("created mailbox %u (size=%u)\n", rud->key, (unsigned int)size);
+	lua_pushinteger(L, rud->key);
+	return 1;
+	}
+
+#define METHODS  \
+		{ "mailbox_write", MailboxWrite },	\
+		{ "mailbox_read", MailboxRead }		\
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "mailbox", Mailbox },
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+static const struct luaL_Reg PFunctions[] = 
+	{
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+static const struct luaL_Reg TFunctions[] = 
+	{
+		METHODS,
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_mailbox(lua_State *L, int state_type)
+	{
+	switch(state_type)
+		{
+		case ST_MAIN: luaL_setfuncs(L, MFunctions, 0); break;
+		case ST_PROCESS: luaL_setfuncs(L, PFunctions, 0); break;
+		case ST_THREAD: luaL_setfuncs(L, TFunctions, 0); break;
+		default:
+			break;
+		}
+	return 1;
+	}
+
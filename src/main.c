@@ -71,7 +71,7 @@ int luajack_exit_status = 0;
 #define EXITING		1
 #define CODE		2	/* os.exit() 'code' argument = true */
 #define ERRMSG		4	/* luajack_errmsg was set */
-static pthread_mutex_t luajack_errlock = PTHREAD_MUTEX_INITIALIZER;
+static int luajack_fatal = 0; /* set by the first fatal error */
 static int luajack_errpipe[2]; /* pipe for errors */
 int luajack_evtpipe[2]; /* pipe for non-rt callbacks queue */
 
@@ -91,43 +91,40 @@ static int luajack_errorv_(int code, const char *fmt, va_list ap)
  * the error will be processed.
  * To check if an error occurred, the main pthread uses luajack_checkerror().
  *
+ * Only the first error is registered (the others are ignored, since they may be
+ * a consequence), so no lock is needed: the first caller claims luajack_fatal,
+ * and publishes the exit status only after having stored the message.
+ * (Non-fatal errors are reported with luajack_report() instead, see errq.c).
+ *
  * Note that this mechanism works as long as the main script implements a loop
  * based on jack.sleep().
  */
 	{
 	int n, status;
-	if(pthread_mutex_trylock(&luajack_errlock) == 0)
-		/* if locked, an error is already being registered, so this one
-		 * is simply ignored (it may be a consequence) */
-		{
-		if(luajack_exiting()) /* already called by somebody */
-			{
-			pthread_mutex_unlock(&luajack_errlock);
-			return 0;
-			}
+	if(__atomic_exchange_n(&luajack_fatal, 1, __ATOMIC_ACQ_REL) != 0)
+		return 0;
 
-		status = EXITING;
-		if(code) status |= CODE;
+	status = EXITING;
+	if(code) status |= CODE;
 
-		if(!fmt)  /* no error message */
+	if(!fmt)  /* no error message */
+		luajack_errmsg[0] = '\0';
+	else
+		{
+		/* store message */
+		n = vsnprintf(luajack_errmsg, LUAJACK_ERRMSG_LEN-2, fmt, ap);
+		if(n<0) 
 			luajack_errmsg[0] = '\0';
 		else
 			{
-			/* store message */
-			n = vsnprintf(luajack_errmsg, LUAJACK_ERRMSG_LEN-2, fmt, ap);
-			if(n<0) 
-				luajack_errmsg[0] = '\0';
-			else
-				{
-				luajack_errmsg[n] = '\n';
-				luajack_errmsg[n+1] = '\0';
-				}
-			status |= ERRMSG;
+			if(n > LUAJACK_ERRMSG_LEN-3) n = LUAJACK_ERRMSG_LEN-3; /* truncated */
+			luajack_errmsg[n] = '\n';
+			luajack_errmsg[n+1] = '\0';
 			}
-		luajack_exit_status = status;
-		syncpipe_write(luajack_errpipe[1]); /* to make pselect() return */
-		pthread_mutex_unlock(&luajack_errlock);
+		status |= ERRMSG;
 		}
+	__atomic_store_n(&luajack_exit_status, status, __ATOMIC_RELEASE);
+	syncpipe_write(luajack_errpipe[1]); /* to make pselect() return */
 	return 0;
 	}
 
@@ -161,6 +158,7 @@ static int OriginalOsExit(lua_State *L, int code, int close)
 static int luajack_checkerror(lua_State *L)
 /* this shall be called only in the main thread */
 	{
+	errq_drain(L); /* deliver non-fatal errors first */
 	if(!luajack_exiting()) return 0;
 	if(luajack_exit_status & ERRMSG) /* someone raised an error */
 		{
@@ -405,7 +403,17 @@ static int main_open(lua_State* L, int state_type)
 	luajack_open_thread(L, state_type);
 	luajack_open_process(L, state_type);
 	luajack_open_buffer(L, state_type);
+	luajack_open_matrix(L, state_type);
+	luajack_open_rtalloc(L, state_type);
+	luajack_open_trace(L, state_type);
+	luajack_open_errq(L, state_type);
+	luajack_open_ahead(L, state_type);
+	luajack_open_worker(L, state_type);
 	luajack_open_session(L, state_type);
+	luajack_open_audioring(L, state_type);
+	luajack_open_mpsc(L, state_type);
+	luajack_open_mailbox(L, state_type);
+	luajack_open_bcast(L, state_type);
 	return 0;
 	}
 
@@ -465,9 +473,12 @@ int luaopen_luajack(lua_State *L)
 	if(syncpipe_new(luajack_errpipe) < 0)
 		luaL_error(L, "cannot create pipe");
 	AddReadfd(luajack_errpipe[0]);
+	errq_init(luajack_errpipe[1]);
 	if(syncpipe_new(luajack_evtpipe) < 0)
 		luaL_error(L, "cannot create pipe");
 	AddReadfd(luajack_evtpipe[0]);
+	if(evt_init() != 0)
+		luaL_error(L, "cannot create callback events queue");
 
 	/* block all signals */
 	sigprocmask(SIG_SETMASK, &Sigfullset, NULL);
@@ -0,0 +1,402 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Routing matrix															*
+ ****************************************************************************/
+
+#include "internal.h"
+
+/* A client may have a routing matrix, i.e. a sparse set of cells, each of which
+ * routes an audio input port to an audio output port with a given gain.
+ * The matrix is executed entirely in C at the beginning of the process callback
+ * (before the Lua or C process callback, if any): each output port in the matrix
+ * is set to the sum of the inputs routed to it, multiplied by the cells gains.
+ *
+ * The main script edits the matrix (which does not affect the running one) and
+ * then commits the edits. The commit creates a new matrix 'program' and publishes
+ * it lock-free to the real-time thread, which swaps it in at the beginning of the
+ * next process cycle. Gain changes are applied with a per-cell linear ramp.
+ *
+ * Memory is allocated and released in the main thread only: the rt-thread hands
+ * the replaced program back to the main thread via the 'retired' pointer.
+ */
+
+typedef struct {
+	pud_t 	*in;
+	pud_t	*out;
+	float	gain;	/* target gain (0 if muted) */
+	nframes_t ramp;	/* ramp length for gain changes (frames) */
+	/* rt-thread state: */
+	float	cur;	/* current gain */
+	nframes_t left;	/* frames left to complete the current ramp */
+} cell_t;
+
+typedef struct {
+	size_t	n;			/* no. of cells */
+	cell_t	cell[];		/* sorted by (out, in) */
+} prog_t;
+
+typedef struct {
+	pud_t 	*in;
+	pud_t	*out;
+	float	gain;
+	nframes_t ramp;
+	int 	mute;
+} edit_t;
+
+typedef struct {
+	/* main thread only: */
+	edit_t	*edit;		/* edited cells, sorted by (out, in) */
+	size_t	n;			/* no. of edited cells */
+	size_t	size;		/* allocated size of edit */
+	/* shared: */
+	prog_t	*pending;	/* published by the main thread, not yet swapped in */
+	prog_t	*retired;	/* released by the rt-thread, to be freed by the main thread */
+	/* rt-thread only: */
+	prog_t	*active;	/* the running program */
+} matrix_t;
+
+#define MATRIX(cud) ((matrix_t*)((cud)->matrix))
+
+static int cmp(pud_t *in1, pud_t *out1, pud_t *in2, pud_t *out2)
+	{
+	if(out1 != out2) return out1 < out2 ? -1 : 1;
+	if(in1 != in2) return in1 < in2 ? -1 : 1;
+	return 0;
+	}
+
+static size_t Search(matrix_t *m, pud_t *in, pud_t *out, int *found)
+/* binary search in the edited cells: returns the position of the cell, or
+ * the position where it should be inserted (found = 0) */
+	{
+	size_t lo = 0, hi = m->n, mid;
+	int c;
+	*found = 0;
+	while(lo < hi)
+		{
+		mid = (lo + hi)/2;
+		c = cmp(m->edit[mid].in, m->edit[mid].out, in, out);
+		if(c == 0) { *found = 1; return mid; }
+		if(c < 0) lo = mid + 1; else hi = mid;
+		}
+	return lo;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Real-time execution                             		            		|
+ *--------------------------------------------------------------------------*/
+
+static void Merge(prog_t *p, prog_t *old)
+/* initializes the rt-state of the cells of the new program p, carrying over
+ * the current gains of the cells already in the old program */
+	{
+	size_t i, j = 0;
+	int c = 1;
+	cell_t *cell, *oldcell = NULL;
+	for(i = 0; i < p->n; i++)
+		{
+		cell = &p->cell[i];
+		c = 1;
+		if(old)
+			{
+			while((j < old->n) && 
+				((c = cmp(old->cell[j].in, old->cell[j].out, cell->in, cell->out)) < 0))
+				j++;
+			if(j >= old->n) c = 1;
+			}
+		if(c == 0) /* existing cell */
+			{
+			oldcell = &old->cell[j];
+			cell->cur = oldcell->cur;
+			cell->left = (cell->gain == oldcell->gain) ? oldcell->left : cell->ramp;
+			}
+		else /* new cell: fade in from 0 */
+			{
+			cell->cur = 0;
+			cell->left = cell->ramp;
+			}
+		if(cell->left == 0)
+			cell->cur = cell->gain;
+		}
+	}
+
+static void Route(cell_t *cell, sample_t *dst, const sample_t *src, nframes_t nframes)
+	{
+	nframes_t i, k;
+	float g0, g1;
+	if(cell->left == 0)
+		{
+		if(cell->cur != 0)
+			dsp_mix(dst, src, nframes, cell->cur);
+		return;
+		}
+	/* ramp from cur to g1 in k frames, then keep g1 */
+	k = nframes < cell->left ? nframes : cell->left;
+	g0 = cell->cur;
+	g1 = g0 + (cell->gain - g0)*k/cell->left;
+	for(i = 0; i < k; i++)
+		dst[i] += src[i]*(g0 + (g1 - g0)*i/k);
+	cell->left -= k;
+	cell->cur = (cell->left == 0) ? cell->gain : g1;
+	if((k < nframes) && (cell->cur != 0))
+		dsp_mix(dst + k, src + k, nframes - k, cell->cur);
+	}
+
+void matrix_process(cud_t *cud, nframes_t nframes)
+/* executes the matrix (called at the beginning of the process callback) */
+	{
+	size_t i;
+	cell_t *cell;
+	pud_t *out = NULL;
+	prog_t *p;
+	sample_t *dst = NULL;
+	matrix_t *m = MATRIX(cud);
+
+	/* swap in the pending program, if any (and if the previous one was released) */
+	if((__atomic_load_n(&m->retired, __ATOMIC_ACQUIRE) == NULL) && 
+		((p = __atomic_exchange_n(&m->pending, NULL, __ATOMIC_ACQ_REL)) != NULL))
+		{
+		Merge(p, m->active);
+		__atomic_store_n(&m->retired, m->active, __ATOMIC_RELEASE);
+		m->active = p;
+		}
+
+	if((p = m->active) == NULL) return;
+
+	for(i = 0; i < p->n; i++)
+		{
+		cell = &p->cell[i];
+		if(cell->out != out) /* first cell of the next output port */
+			{
+			out = cell->out;
+			dst = IsPudValid(out) ? (sample_t*)jack_port_get_buffer(out->port, nframes) : NULL;
+			if(dst)
+				memset(dst, 0, sizeof(sample_t)*nframes);
+			}
+		if(dst && IsPudValid(cell->in))
+			Route(cell, dst, (sample_t*)jack_port_get_buffer(cell->in->port, nframes), nframes);
+		}
+	}
+
+/*--------------------------------------------------------------------------*
+ | Main thread                                     		            		|
+ *--------------------------------------------------------------------------*/
+
+static void Publish(matrix_t *m, prog_t *p)
+	{
+	prog_t *old;
+	if((old = __atomic_exchange_n(&m->retired, NULL, __ATOMIC_ACQ_REL)) != NULL)
+		Free(old);
+	if((old = __atomic_exchange_n(&m->pending, p, __ATOMIC_ACQ_REL)) != NULL)
+		Free(old); /* never seen by the rt-thread */
+	}
+
+void matrix_free(cud_t *cud)
+/* to be called with the client deactivated */
+	{
+	matrix_t *m = MATRIX(cud);
+	if(!m) return;
+	if(m->active) Free(m->active);
+	if(m->pending) Free(m->pending);
+	if(m->retired) Free(m->retired);
+	if(m->edit) Free(m->edit);
+	Free(m);
+	cud->matrix = NULL;
+	}
+
+static matrix_t *CheckMatrix(lua_State *L, cud_t *cud)
+	{
+	if(!cud->matrix)
+		luaL_error(L, "client has no routing matrix");
+	return MATRIX(cud);
+	}
+
+static void CheckPorts(lua_State *L, cud_t *cud, int arg, pud_t **in, pud_t **out)
+	{
+	*in = pud_check(L, arg);
+	*out = pud_check(L, arg + 1);
+	if(((*in)->cud != cud) || ((*out)->cud != cud))
+		luaL_error(L, "port is not owned by this client");
+	if(!PortIsAudio(*in) || !PortIsInput(*in))
+		luaL_argerror(L, arg, "audio input port expected");
+	if(!PortIsAudio(*out) || !PortIsOutput(*out))
+		luaL_argerror(L, arg + 1, "audio output port expected");
+	}
+
+static int Matrix(lua_State *L)
+/* matrix(client) */
+	{
+	matrix_t *m;
+	cud_t *cud = cud_check(L, 1);
+	luajack_checkcreate();
+	if(cud->matrix)
+		return luaL_error(L, "routing matrix already created");
+	if((m = (matrix_t*)Malloc(sizeof(matrix_t))) == NULL)
+		return luaL_error(L, "cannot allocate routing matrix");
+	memset(m, 0, sizeof(matrix_t));
+	dsp_init();
+	cud->matrix = m;
+	if(process_ccallback_matrix(cud) != 0)
+		{
+		matrix_free(cud);
+		return luaL_error(L, "cannot register process callback");
+		}
+	return 0;
+	}
+
+static int MatrixSet(lua_State *L)
+/* matrix_set(client, inport, outport, gain [, ramp])
+ * gain = nil removes the cell */
+	{
+	pud_t *in, *out;
+	size_t pos;
+	int found;
+	edit_t *edit;
+	cud_t *cud = cud_check(L, 1);
+	matrix_t *m = CheckMatrix(L, cud);
+	luajack_checkmain();
+	CheckPorts(L, cud, 2, &in, &out);
+	pos = Search(m, in, out, &found);
+	if(lua_isnoneornil(L, 4)) /* remove */
+		{
+		if(found)
+			{
+			memmove(&m->edit[pos], &m->edit[pos+1], (m->n - pos - 1)*sizeof(edit_t));
+			m->n--;
+			}
+		return 0;
+		}
+	if(!found)
+		{
+		if(m->n == m->size)
+			{
+			size_t size = m->size ? m->size*2 : 64;
+			if((edit = (edit_t*)Malloc(size*sizeof(edit_t))) == NULL)
+				return luaL_error(L, "cannot allocate memory");
+			if(m->n > 0)
+				memcpy(edit, m->edit, m->n*sizeof(edit_t));
+			if(m->edit) Free(m->edit);
+			m->edit = edit;
+			m->size = size;
+			}
+		memmove(&m->edit[pos+1], &m->edit[pos], (m->n - pos)*sizeof(edit_t));
+		m->n++;
+		m->edit[pos].in = in;
+		m->edit[pos].out = out;
+		m->edit[pos].mute = 0;
+		}
+	m->edit[pos].gain = luaL_checknumber(L, 4);
+	m->edit[pos].ramp = luaL_optinteger(L, 5, 0);
+	return 0;
+	}
+
+static int MatrixMute(lua_State *L)
+/* matrix_mute(client, inport, outport, onoff) */
+	{
+	pud_t *in, *out;
+	size_t pos;
+	int found;
+	cud_t *cud = cud_check(L, 1);
+	matrix_t *m = CheckMatrix(L, cud);
+	luajack_checkmain();
+	CheckPorts(L, cud, 2, &in, &out);
+	pos = Search(m, in, out, &found);
+	if(!found)
+		return luaL_error(L, "cell not found");
+	m->edit[pos].mute = luajack_checkonoff(L, 4);
+	return 0;
+	}
+
+static int MatrixGet(lua_State *L)
+/* gain, muted = matrix_get(client, inport, outport) */
+	{
+	pud_t *in, *out;
+	size_t pos;
+	int found;
+	cud_t *cud = cud_check(L, 1);
+	matrix_t *m = CheckMatrix(L, cud);
+	CheckPorts(L, cud, 2, &in, &out);
+	pos = Search(m, in, out, &found);
+	if(!found) return 0;
+	lua_pushnumber(L, m->edit[pos].gain);
+	lua_pushboolean(L, m->edit[pos].mute);
+	return 2;
+	}
+
+static int MatrixClear(lua_State *L)
+/* matrix_clear(client) */
+	{
+	cud_t *cud = cud_check(L, 1);
+	matrix_t *m = CheckMatrix(L, cud);
+	m->n = 0;
+	return 0;
+	}
+
+static int MatrixCommit(lua_State *L)
+/* matrix_commit(client) */
+	{
+	size_t i;
+	prog_t *p;
+	cud_t *cud = cud_check(L, 1);
+	matrix_t *m = CheckMatrix(L, cud);
+	luajack_checkmain();
+	if((p = (prog_t*)Malloc(sizeof(prog_t) + m->n*sizeof(cell_t))) == NULL)
+		return luaL_error(L, "cannot allocate memory");
+	memset(p, 0, sizeof(prog_t) + m->n*sizeof(cell_t));
+	p->n = m->n;
+	for(i = 0; i < m->n; i++)
+		{
+		p->cell[i].in = m->edit[i].in;
+		p->cell[i].out = m->edit[i].out;
+		p->cell[i].gain = m->edit[i].mute ? 0 : m->edit[i].gain;
+		p->cell[i].ramp = m->edit[i].ramp;
+		}
+	Publish(m, p);
+	return 0;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Registration                              								|
+ *--------------------------------------------------------------------------*/
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "matrix", Matrix },
+		{ "matrix_set", MatrixSet },
+		{ "matrix_mute", MatrixMute },
+		{ "matrix_get", MatrixGet },
+		{ "matrix_clear", MatrixClear },
+		{ "matrix_commit", MatrixCommit },
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_matrix(lua_State *L, int state_type)
+	{
+	if(state_type == ST_MAIN)
+		luaL_setfuncs(L, MFunctions, 0);
+	return 1;
+	}
+
@@ -0,0 +1,315 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Multi-producer ringbuffers												*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <sys/mman.h>
+
+/* An MPSC ringbuffer is a bounded queue of fixed-size cells that can be 
+ * written concurrently by any number of threads, and read by a single one 
+ * (typically the process callback). It carries the same tag/data messages
+ * as the ordinary ringbuffers (see ringbuffer.c), the only constraint being
+ * that the data length can not exceed the 'maxlen' given at creation.
+ *
+ * The algorithm is Vyukov's bounded queue: each cell has a sequence number
+ * telling whether it is free for the writer at position 'pos' (seq == pos)
+ * or holds the message written at that position (seq == pos+1).
+ * Writers claim a position with a CAS on 'tail' (lock-free), then fill the 
+ * cell and publish it by updating its seq. The reader only looks at the 
+ * cell at 'head' (wait-free): if it is not yet published, the queue is seen
+ * as empty.
+ */
+
+typedef struct {
+	size_t	seq;
+	uint32_t tag;
+	uint32_t len;	/* length of data that follow */
+} cell_t;
+
+#define CACHELINE 64
+
+struct mpsc_s {
+	size_t	mask;		/* ncells - 1 (ncells is a power of 2) */
+	size_t	cellsize;
+	size_t	maxlen;
+	size_t	memsize;
+	char	*cells;
+	rbstats_t *stats;	/* where to update the statistics */
+	char	pad1[CACHELINE];
+	size_t	tail;		/* next position to be claimed by writers */
+	char	pad2[CACHELINE];
+	size_t	head;		/* next position to be read (reader only) */
+};
+
+#define Cell(q, pos) ((cell_t*)((q)->cells + ((pos) & (q)->mask)*(q)->cellsize))
+#define CellData(cell) ((char*)((cell) + 1))
+
+mpsc_t *mpsc_new(size_t ncells, size_t maxlen, int mlock_, rbstats_t *stats)
+/* ncells is rounded up to a power of 2 */
+	{
+	size_t n, i;
+	mpsc_t *q;
+	void *mem;
+	if((ncells == 0) || (maxlen > UINT32_MAX)) return NULL;
+	for(n = 1; n < ncells; n <<= 1);
+	if((q = (mpsc_t*)Malloc(sizeof(mpsc_t))) == NULL)
+		return NULL;
+	memset(q, 0, sizeof(mpsc_t));
+	q->mask = n - 1;
+	q->maxlen = maxlen;
+	q->cellsize = ((sizeof(cell_t) + maxlen + CACHELINE - 1)/CACHELINE)*CACHELINE;
+	q->memsize = n*q->cellsize;
+	mem = mmap(NULL, q->memsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		{ Free(q); return NULL; }
+	if(mlock_ && (mlock(mem, q->memsize) != 0))
+		luajack_verbose("cannot lock MPSC ringbuffer in memory (%s)\n", strerror(errno));
+	q->cells = (char*)mem;
+	q->stats = stats;
+	for(i = 0; i < n; i++)
+		Cell(q, i)->seq = i;
+	return q;
+	}
+
+void mpsc_free(mpsc_t *q)
+	{
+	if(!q) return;
+	munmap(q->cells, q->memsize);
+	Free(q);
+	}
+
+static cell_t *Claim(mpsc_t *q)
+/* claims the next cell for writing, or returns NULL if the queue is full */
+	{
+	cell_t *cell;
+	intptr_t diff;
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	for(;;)
+		{
+		cell = Cell(q, pos);
+		diff = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+		if(diff == 0)
+			{
+			if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, 
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return cell;
+			/* else pos was updated with the current tail */
+			}
+		else if(diff < 0) /* the cell still holds the message written one lap ago */
+			return NULL;
+		else /* another writer claimed pos */
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+static void Publish(mpsc_t *q, cell_t *cell)
+/* the cell was claimed at position seq, and now holds its message */
+	{
+	size_t pos = cell->seq;
+	RbStatAdd(q->stats->written, 1);
+	RbStatAdd(q->stats->bytes_written, ringbuffer_header_len() + cell->len);
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	/* fill level in messages (may overestimate it, if other writers are late) */
+	RbStatPeak(q->stats->peak, pos + 1 - __atomic_load_n(&q->head, __ATOMIC_RELAXED));
+	}
+
+static cell_t *Next(mpsc_t *q)
+/* returns the cell at head, if it holds a published message, or NULL */
+	{
+	cell_t *cell = Cell(q, q->head);
+	if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+		return NULL;
+	return cell;
+	}
+
+static void Advance(mpsc_t *q, cell_t *cell)
+/* frees the cell at head for the writers of the next lap */
+	{
+	RbStatAdd(q->stats->read, 1);
+	RbStatAdd(q->stats->bytes_read, ringbuffer_header_len() + cell->len);
+	__atomic_store_n(&cell->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELAXED);
+	}
+
+size_t mpsc_maxlen(mpsc_t *q)
+	{
+	return q->maxlen;
+	}
+
+size_t mpsc_size(mpsc_t *q)
+/* capacity, in messages */
+	{
+	return q->mask + 1;
+	}
+
+size_t mpsc_fill(mpsc_t *q)
+/* messages currently in the queue (approximate, if called by a third thread) */
+	{
+	size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	return tail > head ? tail - head : 0;
+	}
+
+int mpsc_cwrite(mpsc_t *q, uint32_t tag, const void *data, size_t len)
+/* returns 1 on success, or 0 if the queue is full or len > maxlen */
+	{
+	cell_t *cell;
+	if(len > q->maxlen) return 0;
+	if((cell = Claim(q)) == NULL) 
+		{ RbStatAdd(q->stats->rejected, 1); return 0; }
+	cell->tag = tag;
+	cell->len = len;
+	if(len) memcpy(CellData(cell), data, len);
+	Publish(q, cell);
+	return 1;
+	}
+
+int mpsc_cread(mpsc_t *q, void *buf, size_t bufsz, int advance, uint32_t *tag, size_t *len)
+/* C version: returns 1 on success and 0 if there are no messages */
+	{
+	cell_t *cell;
+	if((cell = Next(q)) == NULL) return 0;
+	if(cell->len > bufsz)
+		return luajack_error("not enough space for ringbuffer_read() "
+						"(at least %u bytes needed)", cell->len);
+	*tag = cell->tag;
+	*len = cell->len;
+	if(cell->len)
+		memcpy(buf, CellData(cell), cell->len);
+	else if(bufsz > 0) 
+		((char*)buf)[0]='\0';
+	if(advance)
+		Advance(q, cell);
+	return 1;
+	}
+
+int mpsc_cread_advance(mpsc_t *q)
+	{
+	cell_t *cell;
+	if((cell = Next(q)) == NULL) return 0;
+	Advance(q, cell);
+	return 1;
+	}
+
+int mpsc_luawrite(mpsc_t *q, lua_State *L, int arg)
+/* same as ringbuffer_luawrite() */
+	{
+	cell_t *cell;
+	int isnum;
+	size_t len = 0;
+	const char *data;
+	uint32_t tag = (uint32_t)lua_tointegerx(L, arg, &isnum);
+	if(!isnum)
+		return luaL_error(L, "invalid tag");
+	data = luaL_optlstring(L, arg + 1, NULL, &len);
+	if(len > q->maxlen)
+		return luaL_error(L, "message too long for MPSC ringbuffer (max %d bytes)", (int)q->maxlen);
+	if((cell = Claim(q)) == NULL)
+		{ RbStatAdd(q->stats->rejected, 1); lua_pushboolean(L, 0); return 1; }
+	cell->tag = tag;
+	cell->len = len;
+	if(len) memcpy(CellData(cell), data, len);
+	Publish(q, cell);
+	lua_pushboolean(L, 1);
+	return 1;
+	}
+
+int mpsc_luaread(mpsc_t *q, lua_State *L, int advance)
+/* same as ringbuffer_luaread() */
+	{
+	cell_t *cell;
+	if((cell = Next(q)) == NULL)
+		{ lua_pushnil(L); return 1; }
+	lua_pushinteger(L, cell->tag);
+	lua_pushlstring(L, CellData(cell), cell->len);
+	if(advance)
+		Advance(q, cell);
+	return 2;
+	}
+
+int mpsc_luaread_advance(mpsc_t *q, lua_State *L)
+	{
+	lua_pushboolean(L, mpsc_cread_advance(q));
+	return 1;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Lua functions                                                            |
+ *--------------------------------------------------------------------------*/
+
+static int MpscRingbuffer(lua_State *L)
+/* rbuf = mpsc_ringbuffer(client, nmessages, maxlen [, mlock]) */
+	{
+	rud_t *rud;
+	mpsc_t *q;
+	cud_t *cud = cud_check(L, 1);
+	lua_Integer ncells = luaL_checkinteger(L, 2);
+	lua_Integer maxlen = luaL_checkinteger(L, 3);
+	int mlock_ = lua_toboolean(L, 4);
+
+	luajack_checkcreate();
+	if(ncells < 1)
+		return luaL_argerror(L, 2, "invalid number of messages");
+	if((maxlen < 0) || (maxlen > UINT32_MAX))
+		return luaL_argerror(L, 3, "invalid maximum length");
+
+	if((rud = rud_new()) == NULL)
+		return luaL_error(L, "cannot create userdata");
+	if((q = mpsc_new(ncells, maxlen, mlock_, &rud->stats)) == NULL)
+		{
+		CancelRudValid(rud);
+		return luaL_error(L, "cannot create ringbuffer");
+		}
+	rud->cud = cud;
+	rud->pipefd[0] = rud->pipefd[1] = -1;
+	rud->mpsc = q;
+	luajack_verbose("created MPSC ringbuffer %u (messages=%u, maxlen=%u, mlock=%d)\n",
+			rud->key, (unsigned int)(q->mask + 1), (unsigned int)maxlen, mlock_ ? 1 : 0);
+	lua_pushinteger(L, rud->key);
+	return 1;
+	}
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "mpsc_ringbuffer", MpscRingbuffer },
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_mpsc(lua_State *L, int state_type)
+	{
+	switch(state_type)
+		{
+		case ST_MAIN: luaL_setfuncs(L, MFunctions, 0); break;
+		case ST_PROCESS: 
+		case ST_THREAD: 
+		default:
+			break;
+		}
+	return 1;
+	}
+
@@ -50,7 +50,15 @@ static int ProcessLoad_(lua_State *L, int isscript)
 		luaL_error(L, "missing process chunk");
 
 	/* create the process_state (unrelated to the client state) */
-	if((P = luajack_newstate(L, ST_PROCESS, NULL, NULL)) == NULL)
+	if(cud->rtpool_size > 0)
+		{
+		if((cud->rtpool = rtalloc_new(cud->rtpool_size)) == NULL)
+			return luaL_error(L, "cannot create rt-allocator arena");
+		P = luajack_newstate(L, ST_PROCESS, rtalloc_allocf, cud->rtpool);
+		}
+	else
+		P = luajack_newstate(L, ST_PROCESS, NULL, NULL);
+	if(P == NULL)
 		return luaL_error(L, "cannot create Lua state");
 
 #if 0
@@ -88,6 +96,74 @@ static int ProcessLoad(lua_State *L)
 	{ return ProcessLoad_(L, 0); }
 
 
+/*--------------------------------------------------------------------------*
+ | Garbage collection                              		            		|
+ *--------------------------------------------------------------------------*/
+
+/* The process_state has the garbage collector stopped, and garbage collection
+ * is done explicitly at the end of each rt-callback, according to the client's
+ * gc policy (see jack.process_gc).
+ *
+ * With the GC_ADAPTIVE policy, the process callback executes as many gc steps 
+ * as fit in the time left before the end of the current period (minus a safety
+ * margin), using the cost of the previous steps as an estimate for the next one.
+ * Heavy cycles skip gc, light ones do more of it. To make sure that gc progresses
+ * anyway, one step is forced after GC_MAXSKIP consecutive cycles with no gc.
+ */
+
+#define GC_MAXSKIP	16
+#define GC_MAXSTEPS	64	/* max gc steps per cycle */
+#define GC_DEADLINE	(-1) /* gcwhat for the process callback */
+
+static void GcAdaptive(cud_t *cud)
+	{
+	jack_nframes_t current_frames;
+	jack_time_t current_usecs, next_usecs, now, t;
+	float period_usecs;
+	double budget, cost;
+	int n, done;
+	lua_State *P = cud->process_state;
+
+	if(ahead_cycle_times(cud, &current_frames, &current_usecs, 
+							&next_usecs, &period_usecs) != 0)
+		{ lua_gc(P, LUA_GCSTEP, 0); return; }
+
+	now = jack_get_time();
+	budget = (double)next_usecs - (double)now - cud->gcmargin*period_usecs;
+	if((budget < cud->gcstepcost) && (cud->gcskip < GC_MAXSKIP))
+		{ cud->gcskip++; cud->gcskipped++; return; }
+	cud->gcskip = 0;
+
+	for(n = 0; n < GC_MAXSTEPS; n++)
+		{
+		t = now;
+		done = lua_gc(P, LUA_GCSTEP, 0);
+		now = jack_get_time();
+		cost = (double)(now - t);
+		/* moving average, biased towards the most expensive steps */
+		cud->gcstepcost = cost > cud->gcstepcost ? cost : 0.9*cud->gcstepcost + 0.1*cost;
+		budget -= cost;
+		if(done || (budget < cud->gcstepcost)) /* cycle completed, or no time left */
+			break;
+		}
+	}
+
+static void Gc(cud_t *cud, int what)
+	{
+	if(what == LUA_GCCOLLECT)
+		{ lua_gc(cud->process_state, LUA_GCCOLLECT, 0); return; }
+	switch(cud->gcpolicy)
+		{
+		case GC_STEP: lua_gc(cud->process_state, LUA_GCSTEP, 0); break;
+		case GC_ADAPTIVE: /* other rt-callbacks leave gc to the process callback */
+				if(what == GC_DEADLINE) GcAdaptive(cud);
+				break;
+		case GC_OFF:
+		default:
+				break;
+		}
+	}
+
 /*--------------------------------------------------------------------------*
  | Callbacks                                    		            		|
  *--------------------------------------------------------------------------*/
@@ -97,8 +173,9 @@ static int ProcessLoad(lua_State *L)
 
 #define BEGIN(cb) 														\
 	double ts=0;														\
+	const int rtcb = RT_##cb;											\
 do {																	\
-	if(IsCudProfile(cud)) ts = luajack_now();							\
+	if(IsCudProfile(cud) || cud->trace) ts = luajack_now();			\
 	if(luajack_exiting()) return 0; 									\
 	if(!IsCudValid(cud)) return 0;										\
 	/* if(!P) return luajack_error("2 "UNEXPECTED_ERROR); */			\
@@ -108,33 +185,64 @@ do {																	\
 		return luajack_error("4 "UNEXPECTED_ERROR); 					\
 } while(0);
 
+#define FAIL(nres) do {												\
+	/* handle an error from lua_pcall() */								\
+	if(!IsCudReportErrors(cud))											\
+		return luajack_error(lua_tostring(P, -1));						\
+	/* report the error and go on as if nres nils were returned */		\
+	luajack_report(LUAJACK_ERROR, cud->key, rtcb, "%s", lua_tostring(P, -1));\
+	lua_settop(P, 0);													\
+	lua_settop(P, (nres));												\
+} while(0)
+
 #define EXEC(nargs, nres) do {											\
 	/* execute the script code */										\
 	if(lua_pcall(P, (nargs) , (nres), 0) != LUA_OK)						\
-		return luajack_error(lua_tostring(P, -1));						\
+		FAIL(nres);														\
 } while(0)
 
 #define END(rc_, gcwhat) do { 											\
-	lua_gc(P, (gcwhat), 0);												\
-	if(ts!=0) /* if(IsCudProfile(cud))	*/								\
-		luajack_stat_update(&(cud->stat), luajack_since(ts));			\
+	double tgc = 0, te;													\
+	if(ts!=0) tgc = luajack_now();										\
+	Gc(cud, (gcwhat));													\
+	if(ts!=0)															\
+		{																\
+		te = luajack_now();												\
+		if(IsCudProfile(cud))											\
+			{															\
+			luajack_stat_update(&(cud->stat), tgc - ts);				\
+			luajack_stat_update(&(cud->gcstat), te - tgc);				\
+			luajack_hist_update(&(cud->hist[rtcb]), te - ts);			\
+			}															\
+		if(cud->trace && (rtcb == RT_Process))							\
+			trace_record(cud, ts, te, te - tgc);						\
+		}																\
 	return (rc_);														\
 } while(0)
 
 static int 	Process(nframes_t nframes, void *arg)
 	{
+	int rc;
 	BEGIN(Process);
 	MarkProcessCallback(cud);
 	cud->buffer_size = cud->nframes = nframes;
+	if(cud->matrix && !cud->ahead) /* else executed by AProcess (see ahead.c) */
+		matrix_process(cud, nframes);
+	if(cud->workers)
+		worker_fork(cud, nframes);
 	lua_pushinteger(P, nframes);
-	EXEC(1, 0);
+	rc = lua_pcall(P, 1, 0, 0); /* not EXEC(): the workers must be joined also on error */
+	if(cud->workers)
+		worker_join(cud);
 	buffer_drop_all(cud);
 	cud->nframes = 0;
 	CancelProcessCallback(cud);
-	END(0, LUA_GCSTEP);
+	if(rc != LUA_OK)
+		FAIL(0);
+	END(0, GC_DEADLINE);
 	}
 
-static int BufferSize(nframes_t nframes, void *arg)
+static int BufferSize_(nframes_t nframes, void *arg)
 	{
 	/* the normal process cycle is suspended during this callback,
 	 * which may perform non real-time safe operations */
@@ -145,6 +253,15 @@ static int BufferSize(nframes_t nframes, void *arg)
 	END(0, LUA_GCCOLLECT); 
 	}
 
+static int BufferSize(nframes_t nframes, void *arg)
+	{
+	/* in compute-ahead mode the worker may be using the process_state:
+	 * wait until it is idle before touching it (see ahead.c) */
+	if(cud->ahead)
+		ahead_buffer_size(cud, nframes);
+	return BufferSize_(nframes, arg);
+	}
+
 static int	Sync(jack_transport_state_t state, jack_position_t *pos, void *arg)
 	{
 	int rc;
@@ -175,8 +292,13 @@ static void	Timebase(jack_transport_state_t state, jack_nframes_t nframes,
 #define TimebaseConditional Timebase
 
 #undef cud
+int process_run(cud_t *cud, nframes_t nframes)
+/* executes the Lua process callback (called by the compute-ahead worker) */
+	{ return Process(nframes, (void*)cud); }
+
 #undef P
 #undef BEGIN
+#undef FAIL
 #undef EXEC
 #undef END
 
@@ -184,7 +306,11 @@ static void	Timebase(jack_transport_state_t state, jack_nframes_t nframes,
  | Callbacks registration                          		            		|
  *--------------------------------------------------------------------------*/
 
-#define SetProcess jack_set_process_callback
+static int SetProcess(client_t *client, JackProcessCallback func, void *arg)
+	{ /* in compute-ahead mode the JACK process callback is AProcess (see ahead.c) */
+	if(((cud_t*)arg)->ahead) return 0;
+	return jack_set_process_callback(client, func, arg);
+	}
 #define SetBufferSize jack_set_buffer_size_callback
 #define SetSync	jack_set_sync_callback
 static int SetTimebase(client_t *client, JackTimebaseCallback func, void *arg)
@@ -219,11 +345,31 @@ static int SetTimebaseConditional(client_t *client, JackTimebaseCallback func, v
 		return luaL_error(P, "bad argument #2 (function expected)");	\
 } while(0)
 
+static int IsProcessState(lua_State *P, cud_t *cud)
+/* returns 1 if P is (a thread of) the client's process_state, and not for
+ * example the state of one of its process workers (whose registry is not the
+ * one where the callbacks references are looked up) */
+	{
+	lua_State *M;
+	lua_rawgeti(P, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	M = lua_tothread(P, -1);
+	lua_pop(P, 1);
+	return M == cud->process_state;
+	}
+
+#define CheckState() do {												\
+	if(!IsProcessState(P, cud))											\
+		return luaL_error(P, "callback must be registered in the client's process context");\
+} while(0)
+
 
 static int ProcessCallback(lua_State *P) 
 	{
 	cud_t *cud = cud_check(P, 1);
 	CheckFunction();
+	if(worker_callback(P, cud)) /* called in a process worker's state */
+		return 0;
+	CheckState();
 	Register(cud, Process, 2);
 	return 0;
 	}
@@ -232,14 +378,24 @@ static int BufferSizeCallback(lua_State *P)
 	{
 	cud_t *cud = cud_check(P, 1);
 	CheckFunction();
+	CheckState();
 	Register(cud, BufferSize, 2);
 	return 0;
 	}
 
+#define CheckNotAhead() do {											\
+	/* these callbacks are executed in the JACK thread, so they can not	\
+	 * share the process_state with the compute-ahead worker */			\
+	if(cud->ahead)														\
+		return luaL_error(P, "not available in compute-ahead mode");	\
+} while(0)
+
 static int SyncCallback(lua_State *P)
 	{
 	cud_t *cud = cud_check(P, 1);
 	CheckFunction();
+	CheckState();
+	CheckNotAhead();
 	Register(cud, Sync, 2);
 	return 0;
 	}
@@ -250,6 +406,8 @@ static int TimebaseCallback(lua_State *P)
 	int conditional;
 	cud_t *cud = cud_check(P, 1);
 	CheckFunction();
+	CheckState();
+	CheckNotAhead();
 	conditional = lua_toboolean(P, 3);
 	if(conditional)
 		Register(cud, TimebaseConditional, 2);
@@ -262,6 +420,7 @@ static int ReleaseTimebase(lua_State *P)
 	{
 	int rc;
 	cud_t *cud = cud_check(P, 1);
+	CheckState();
 	rc = jack_release_timebase(cud->client);	
 	Unregister(cud, Timebase);
 	Unregister(cud, TimebaseConditional);
@@ -279,16 +438,27 @@ static int ReleaseTimebase(lua_State *P)
 
 #define BEGIN(cb) 												\
 	double ts=0;												\
+	const int rtcb = RT_##cb;									\
 do {															\
-	if(IsCudProfile(cud)) ts = luajack_now();					\
+	if(IsCudProfile(cud) || cud->trace) ts = luajack_now();	\
 	if(luajack_exiting()) return 0; 							\
 	if(!IsCudValid(cud)) return 0;								\
 	/* if((cud->C##cb)==NULL)	return luajack_error("1 "UNEXPECTED_ERROR); */\
 } while(0);
 
 #define END(rc_) do { 											\
-	if(IsCudProfile(cud)) 										\
-		luajack_stat_update(&(cud->stat), luajack_since(ts));	\
+	double te;													\
+	if(ts!=0) 													\
+		{														\
+		te = luajack_now();										\
+		if(IsCudProfile(cud))									\
+			{													\
+			luajack_stat_update(&(cud->stat), te - ts);			\
+			luajack_hist_update(&(cud->hist[rtcb]), te - ts);	\
+			}													\
+		if(cud->trace && (rtcb == RT_Process))					\
+			trace_record(cud, ts, te, 0);						\
+		}														\
 	return (rc_);												\
 } while(0)
 
@@ -298,6 +468,8 @@ static int 	CProcess(nframes_t nframes, void *arg)
 	BEGIN(Process);
 	MarkProcessCallback(cud);
 	cud->buffer_size = cud->nframes = nframes;
+	if(cud->matrix)
+		matrix_process(cud, nframes);
 	rc = cud->CProcess(nframes, cud->CProcess_arg);
 	if(rc!=0)
 		return luajack_error("error in process() callback");
@@ -307,11 +479,22 @@ static int 	CProcess(nframes_t nframes, void *arg)
 	END(0);
 	}
 
+static int MProcess(nframes_t nframes, void *arg)
+/* process callback for clients with a routing matrix but no other process callback */
+	{
+	BEGIN(Process);
+	cud->buffer_size = nframes;
+	matrix_process(cud, nframes);
+	END(0);
+	}
+
 static int CBufferSize(nframes_t nframes, void *arg)
 	{
 	int rc;
 	BEGIN(BufferSize)
 	cud->buffer_size = nframes;
+	if(cud->ahead)
+		ahead_buffer_size(cud, nframes);
 	rc = cud->CBufferSize(nframes, cud->CBufferSize_arg);
 	if(rc!=0)
 		return luajack_error("error in buffer_size() callback");
@@ -353,6 +536,15 @@ int process_ccallback_process(cud_t *cud, JackProcessCallback cb, void *arg)
 	return jack_set_process_callback(cud->client, CProcess, (void*)cud);
 	}
 
+int process_ccallback_matrix(cud_t *cud)
+/* registers MProcess, unless a process callback was already registered
+ * (a process callback registered afterwards replaces MProcess) */
+	{
+	if((cud->Process != LUA_NOREF) || (cud->CProcess != NULL))
+		return 0;
+	return jack_set_process_callback(cud->client, MProcess, (void*)cud);
+	}
+
 int process_ccallback_buffer_size(cud_t *cud, JackBufferSizeCallback cb, void *arg)
 	{
 	cud->CBufferSize = cb;
@@ -390,6 +582,7 @@ int process_ccallback_release_timebase(cud_t *cud)
 
 static int Profile(lua_State *L)
 	{
+	int i;
 	const char* what;
 	cud_t *cud = cud_check(L, 1);
 	if(lua_isnoneornil(L, 2))
@@ -402,9 +595,23 @@ static int Profile(lua_State *L)
 		return 5;
 		}
 	what = luaL_checkstring(L, 2);
+	if(strcmp(what, "gc") == 0) /* exact match (prefixes select the modes below) */
+		{
+		lua_pushinteger(L, luajack_stat_n(&(cud->gcstat)));
+		lua_pushnumber(L, luajack_stat_min(&(cud->gcstat)));
+		lua_pushnumber(L, luajack_stat_max(&(cud->gcstat)));
+		lua_pushnumber(L, luajack_stat_mean(&(cud->gcstat)));
+		lua_pushnumber(L, luajack_stat_variance(&(cud->gcstat)));
+		lua_pushinteger(L, cud->gcskipped);
+		return 6;
+		}
 	if(strncmp(what, "start", strlen(what)) == 0)
 		{
 		luajack_stat_reset(&(cud->stat));
+		luajack_stat_reset(&(cud->gcstat));
+		for(i = 0; i < RT_NUM; i++)
+			luajack_hist_reset(&(cud->hist[i]));
+		cud->gcskipped = 0;
 		MarkCudProfile(cud);
 		}
 	else if(strncmp(what, "restart", strlen(what)) == 0)
@@ -418,6 +625,69 @@ static int Profile(lua_State *L)
 	return 0;
 	}
 
+static int ProfilePercentiles(lua_State *L)
+/* n, p50, p99, p999, max = profile_percentiles(client [, callback [, reset]]) */
+	{
+	hist_t *hist;
+	cud_t *cud = cud_check(L, 1);
+	const char *callback = luaL_optstring(L, 2, "process");
+	int reset = lua_toboolean(L, 3);
+	if(strcmp(callback, "process") == 0)
+		hist = &(cud->hist[RT_Process]);
+	else if(strcmp(callback, "buffer_size") == 0)
+		hist = &(cud->hist[RT_BufferSize]);
+	else if(strcmp(callback, "sync") == 0)
+		hist = &(cud->hist[RT_Sync]);
+	else if(strcmp(callback, "timebase") == 0)
+		hist = &(cud->hist[RT_Timebase]);
+	else
+		return luaL_argerror(L, 2, "invalid callback");
+	lua_pushinteger(L, luajack_hist_n(hist));
+	lua_pushnumber(L, luajack_hist_percentile(hist, 50));
+	lua_pushnumber(L, luajack_hist_percentile(hist, 99));
+	lua_pushnumber(L, luajack_hist_percentile(hist, 99.9));
+	lua_pushnumber(L, luajack_hist_max(hist));
+	if(reset)
+		luajack_hist_reset(hist);
+	return 5;
+	}
+
+static int ProcessErrors(lua_State *L)
+/* process_errors(client, mode) */
+	{
+	cud_t *cud = cud_check(L, 1);
+	const char *mode = luaL_checkstring(L, 2);
+	if(strcmp(mode, "exit") == 0)
+		CancelCudReportErrors(cud);
+	else if(strcmp(mode, "report") == 0)
+		MarkCudReportErrors(cud);
+	else
+		return luaL_argerror(L, 2, "invalid mode");
+	return 0;
+	}
+
+static int ProcessGc(lua_State *L)
+/* process_gc(client, policy [, margin]) */
+	{
+	const char *policy;
+	double margin;
+	cud_t *cud = cud_check(L, 1);
+	policy = luaL_checkstring(L, 2);
+	margin = luaL_optnumber(L, 3, 0.2);
+	if((margin < 0) || (margin >= 1))
+		return luaL_argerror(L, 3, "margin must be in the range [0, 1)");
+	if(strcmp(policy, "step") == 0)
+		cud->gcpolicy = GC_STEP;
+	else if(strcmp(policy, "adaptive") == 0)
+		cud->gcpolicy = GC_ADAPTIVE;
+	else if(strcmp(policy, "off") == 0)
+		cud->gcpolicy = GC_OFF;
+	else
+		return luaL_argerror(L, 2, "invalid gc policy");
+	cud->gcmargin = margin;
+	return 0;
+	}
+
 /*--------------------------------------------------------------------------*
  | Registration                              								|
  *--------------------------------------------------------------------------*/
@@ -439,6 +709,9 @@ static const struct luaL_Reg MFunctions[] =
 		{ "process_loadfile", ProcessLoadfile },
 		{ "process_load", ProcessLoad },
 		{ "profile", Profile },
+		{ "profile_percentiles", ProfilePercentiles },
+		{ "process_gc", ProcessGc },
+		{ "process_errors", ProcessErrors },
 		{ NULL, NULL } /* sentinel */
 	};
 
@@ -29,46 +29,24 @@
 
 #include "internal.h"
 
-static int cmp(pud_t *pud1, pud_t *pud2) /* the compare function */
-	{ return (pud1->key < pud2->key ? -1 : pud1->key > pud2->key); } 
+static handletab_t Tab;
 
-static RB_HEAD(pudtree_s, pud_s) Head = RB_INITIALIZER(&Head);
-
-RB_PROTOTYPE_STATIC(pudtree_s, pud_s, entry, cmp) 
-RB_GENERATE_STATIC(pudtree_s, pud_s, entry, cmp) 
- 
-static pud_t *pud_remove(pud_t *pud) 
-	{ return RB_REMOVE(pudtree_s, &Head, pud); }
-static pud_t *pud_insert(pud_t *pud) 
-	{ return RB_INSERT(pudtree_s, &Head, pud); }
 static pud_t *pud_search(uintptr_t key) 
-	{ pud_t tmp; tmp.key = key; return RB_FIND(pudtree_s, &Head, &tmp); }
+	{ return (pud_t*)handle_get(&Tab, key); }
 pud_t *pud_first(uintptr_t key) 
-	{ pud_t tmp; tmp.key = key; return RB_NFIND(pudtree_s, &Head, &tmp); }
+	{ return (pud_t*)handle_first(&Tab, key); }
 pud_t *pud_next(pud_t *pud)
-	{ return RB_NEXT(pudtree_s, &Head, pud); }
-#if 0
-pud_t *pud_prev(pud_t *pud)
-	{ return RB_PREV(pudtree_s, &Head, pud); }
-pud_t *pud_min(void)
-	{ return RB_MIN(pudtree_s, &Head); }
-pud_t *pud_max(void)
-	{ return RB_MAX(pudtree_s, &Head); }
-pud_t *pud_root(void)
-	{ return RB_ROOT(&Head); }
-#endif
+	{ return (pud_t*)handle_next(&Tab, pud->key); }
 pud_t *pud_new(cud_t *cud)
 	{
 	pud_t *pud;
 	if((pud = (pud_t*)Malloc(sizeof(pud_t))) == NULL) return NULL;
 	memset(pud, 0, sizeof(pud_t));
-	pud->key = (uintptr_t)pud;
-	if(pud_search(pud->key))
-		{ Free(pud); luajack_error(UNEXPECTED_ERROR); return NULL; }
+	if((pud->key = handle_new(&Tab, pud)) == 0)
+		{ Free(pud); return NULL; }
 	cud_fifo_insert(cud, pud);
 	pud->obj.type = LUAJACK_TPORT;
 	pud->obj.xud = (void*)pud;
-	pud_insert(pud);
 	MarkPudValid(pud);
 	return pud;
 	}
@@ -76,7 +54,7 @@ pud_t *pud_new(cud_t *cud)
 static void pud_free(pud_t* pud)
 	{
 	if(pud_search(pud->key) == pud)
-		pud_remove(pud);
+		handle_free(&Tab, pud->key);
 	cud_fifo_remove(pud);
 	Free(pud);	
 	DBG("pud_free()\n");
@@ -87,6 +65,7 @@ void pud_free_all(void)
 	pud_t *pud;
 	while((pud = pud_first(0)))
 		pud_free(pud);
+	handle_freetab(&Tab);
 	}
 
 
@@ -28,13 +28,162 @@
  ****************************************************************************/
 
 #include "internal.h"
+#include <sys/eventfd.h>
+#include <limits.h>
 
 #define rbuf_has_pipe(rud) ((rud)->pipefd[0] != -1)
 #define rbuf_readfd(rud) (rud)->pipefd[0]
 #define rbuf_writefd(rud) (rud)->pipefd[1]
 
+/* A ringbuffer may have a doorbell fd, usable with select(), of one of two kinds:
+ *
+ * RBUF_PIPE: a pipe where the writer writes a byte for each message, and the 
+ * reader reads one for each message it consumes. Simple, but it costs a couple
+ * of system calls per message on both sides.
+ *
+ * RBUF_EVENTFD: an eventfd, and a 'sleeping' flag shared by the two sides.
+ * The reader raises the flag (after clearing the eventfd) when it finds the 
+ * ringbuffer empty, i.e. when it is about to wait on the fd. The writer signals
+ * the eventfd only if the flag is raised, and there are at least 'watermark' 
+ * bytes to be read, so that in the common case it does no system calls at all.
+ * Since the reader raises the flag before checking the ringbuffer once more 
+ * (see rbuf_park), and the writer checks it after writing, a wakeup can not 
+ * be lost (unless the watermark is not reached).
+ */
+#define RBUF_PIPE		1
+#define RBUF_EVENTFD	2
+
+static int rbuf_newshm(lua_State *L, cud_t *cud, const char *name, size_t sz, int mlock, int usepipe, int attach)
+/* Creates a new ringbuffer backed by a named shared memory segment, or attaches 
+ * to an existing one (see shmring.c), and returns the key.
+ * On error, calls luaL_error
+ */
+	{
+	rud_t *rud;
+	if(usepipe == RBUF_EVENTFD)
+		return luaL_error(L, "eventfd doorbells can not be shared between processes");
+	if((rud = rud_new()) == NULL)
+		return luaL_error(L, "cannot create userdata");
+	rud->cud = cud;
+	rud->pipefd[0] = rud->pipefd[1] = -1;
+	rud->watermark = 1;
+	CancelRudValid(rud); /* until done */
+	if(attach)
+		shmring_attach(L, rud, name, mlock);
+	else
+		shmring_create(L, rud, name, sz, mlock, usepipe);
+	MarkRudValid(rud);
+	rud->doorbell = rbuf_has_pipe(rud) ? RBUF_PIPE : 0;
+	luajack_verbose("%s shared ringbuffer %u '%s' (size=%u, mlock=%d, usepipe=%d)\n", 
+		attach ? "attached" : "created", rud->key, name, rud->rbuf->size, mlock ? 1 : 0, rud->doorbell);
+	return rud->key;
+	}
+
+static rud_t *rbuf_check(lua_State *L, int arg)
+/* checks for a message ringbuffer (i.e. not an audio one, see audioring.c) */
+	{
+	rud_t *rud = rud_check(L, arg);
+	if(!rud->rbuf && !rud->mpsc)
+		luaL_argerror(L, arg, "not a message ringbuffer");
+	return rud;
+	}
+
+static rud_t *rbuf_checkspsc(lua_State *L, int arg)
+/* checks for an ordinary (single-producer) message ringbuffer */
+	{
+	rud_t *rud = rbuf_check(L, arg);
+	if(!rud->rbuf)
+		luaL_argerror(L, arg, "operation not supported by MPSC ringbuffers");
+	return rud;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Statistics                                                               |
+ *--------------------------------------------------------------------------*/
+
+/* Each ringbuffer keeps a few counters (rud->stats), updated lock-free by 
+ * the writer and by the reader. For ordinary ringbuffers the byte counts
+ * are derived from the movements of the jack ringbuffer pointers (so the
+ * callers only need to take note of the pointer before the operation), 
+ * and the fill level is in bytes. MPSC ringbuffers update their own
+ * counters (see mpsc.c), with the fill level in messages.
+ */
+
+#define rbuf_wptr(rud) ((rud)->rbuf ? (rud)->rbuf->write_ptr : 0)
+#define rbuf_rptr(rud) ((rud)->rbuf ? (rud)->rbuf->read_ptr : 0)
+/* 1 if the len bytes written at wptr are split across the end of the buffer */
+#define rbuf_wrapped(rbuf, wptr, len) ((wptr) + (len) > (rbuf)->size)
+
+void rbuf_wstats(rud_t *rud, size_t wptr, size_t nmsg, int rejected)
+/* updates the writer statistics after nmsg messages were written starting from
+ * the write pointer wptr, and possibly one was rejected for lack of space */
+	{
+	size_t n;
+	jack_ringbuffer_t *rbuf = rud->rbuf;
+	if(!rbuf) return; /* MPSC */
+	if(rejected)
+		RbStatAdd(rud->stats.rejected, 1);
+	if(nmsg == 0) return;
+	n = (rbuf->write_ptr - wptr) & rbuf->size_mask;
+	RbStatAdd(rud->stats.written, nmsg);
+	RbStatAdd(rud->stats.bytes_written, n);
+	if((nmsg == 1) && rbuf_wrapped(rbuf, wptr, n)) /* batches count them per message */
+		RbStatAdd(rud->stats.wraps, 1);
+	RbStatPeak(rud->stats.peak, jack_ringbuffer_read_space(rbuf));
+	}
 
-static int rbuf_new(lua_State *L, cud_t *cud, size_t sz, int mlock, int usepipe)
+void rbuf_rstats(rud_t *rud, size_t rptr, size_t nmsg)
+/* updates the reader statistics after nmsg messages were read starting from
+ * the read pointer rptr */
+	{
+	jack_ringbuffer_t *rbuf = rud->rbuf;
+	if(!rbuf || (nmsg == 0)) return;
+	RbStatAdd(rud->stats.read, nmsg);
+	RbStatAdd(rud->stats.bytes_read, (rbuf->read_ptr - rptr) & rbuf->size_mask);
+	}
+
+void rbuf_getstats(rud_t *rud, luajack_ringbuffer_stats_t *stats)
+	{
+	stats->written = RbStatGet(rud->stats.written);
+	stats->read = RbStatGet(rud->stats.read);
+	stats->bytes_written = RbStatGet(rud->stats.bytes_written);
+	stats->bytes_read = RbStatGet(rud->stats.bytes_read);
+	stats->rejected = RbStatGet(rud->stats.rejected);
+	stats->wraps = RbStatGet(rud->stats.wraps);
+	stats->peak = RbStatGet(rud->stats.peak);
+	if(rud->mpsc)
+		{
+		stats->fill = mpsc_fill(rud->mpsc);
+		stats->size = mpsc_size(rud->mpsc);
+		}
+	else
+		{
+		stats->fill = jack_ringbuffer_read_space(rud->rbuf);
+		stats->size = rud->rbuf->size - 1;
+		}
+	}
+
+/* The following dispatch the tag/data messages API to the ringbuffer type */
+
+static int rbuf_luawrite(rud_t *rud, lua_State *L, int arg)
+	{
+	if(rud->mpsc) return mpsc_luawrite(rud->mpsc, L, arg);
+	return ringbuffer_luawrite(rud->rbuf, L, arg);
+	}
+
+static int rbuf_luaread(rud_t *rud, lua_State *L, int advance)
+	{
+	if(rud->mpsc) return mpsc_luaread(rud->mpsc, L, advance);
+	return ringbuffer_luaread(rud->rbuf, L, advance);
+	}
+
+static int rbuf_luaread_advance(rud_t *rud, lua_State *L)
+	{
+	if(rud->mpsc) return mpsc_luaread_advance(rud->mpsc, L);
+	return ringbuffer_luaread_advance(rud->rbuf, L);
+	}
+
+static int rbuf_new(lua_State *L, cud_t *cud, size_t sz, int mlock, int usepipe, size_t watermark)
 /* Creates a new ringbuffer and returns the key.
  * On error, calls luaL_error
  */
@@ -42,12 +191,18 @@ static int rbuf_new(lua_State *L, cud_t *cud, size_t sz, int mlock, int usepipe)
 	int pipefd[2];
 	rud_t *rud;
 
-	if(usepipe)
+	if(usepipe == RBUF_PIPE)
 		{
 		/* create a pipe to associate with this ringbuffer */
 		if(syncpipe_new(pipefd) == -1)
 			return luaL_error(L, "cannot create pipe");
 		}
+	else if(usepipe == RBUF_EVENTFD)
+		{
+		if((pipefd[0] = eventfd(0, EFD_NONBLOCK)) == -1)
+			return luaL_error(L, "cannot create eventfd");
+		pipefd[1] = pipefd[0];
+		}
 	else
 		pipefd[0] = pipefd[1] = -1;
 	
@@ -57,22 +212,59 @@ static int rbuf_new(lua_State *L, cud_t *cud, size_t sz, int mlock, int usepipe)
 	rud->cud = cud;
 	rud->pipefd[0] = pipefd[0];
 	rud->pipefd[1] = pipefd[1];
+	rud->doorbell = usepipe;
+	rud->watermark = watermark > 0 ? watermark : 1;
 	
 	if((rud->rbuf = ringbuffer_new(sz, mlock)) == NULL)
 		{ 
-		if(usepipe) { close(pipefd[0]);	close(pipefd[1]); }
+		if(usepipe == RBUF_PIPE) { close(pipefd[0]);	close(pipefd[1]); }
+		if(usepipe == RBUF_EVENTFD) close(pipefd[0]);
 		CancelRudValid(rud);
 		return luaL_error(L, "cannot create ringbuffer");
 		}
 	luajack_verbose("created ringbuffer %u (size=%u, mlock=%d, usepipe=%d)\n", 
-			rud->key, sz, mlock ? 1 : 0, usepipe ? 1 : 0);
+			rud->key, sz, mlock ? 1 : 0, usepipe);
 
 	return rud->key;
 	}
 
+static void rbuf_ring(lua_State *L, rud_t *rud)
+/* RBUF_EVENTFD: signals the reader, if it is waiting (called after writing) */
+	{
+	uint64_t one = 1;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); /* pairs with the one in rbuf_park() */
+	if(!__atomic_load_n(&rud->sleeping, __ATOMIC_RELAXED))
+		return;
+	if(jack_ringbuffer_read_space(rud->rbuf) < rud->watermark)
+		return;
+	if(!__atomic_exchange_n(&rud->sleeping, 0, __ATOMIC_ACQ_REL))
+		return;
+	if((write(rbuf_writefd(rud), &one, sizeof(one)) < 0) && (errno != EAGAIN))
+		luaL_error(L, "rbuf eventfd error");
+	}
+
+static int rbuf_park(lua_State *L, rud_t *rud)
+/* RBUF_EVENTFD: to be called by the reader when it finds the ringbuffer empty.
+ * Clears the eventfd and raises the sleeping flag. Returns 1 if the caller must
+ * check the ringbuffer once more before waiting on the fd (RBUF_EVENTFD only).
+ */
+	{
+	uint64_t cnt;
+	if(rud->doorbell != RBUF_EVENTFD) return 0;
+	if(__atomic_load_n(&rud->sleeping, __ATOMIC_ACQUIRE))
+		return 1; /* already parked (and the eventfd was not signalled since) */
+	if((read(rbuf_readfd(rud), &cnt, sizeof(cnt)) < 0) && (errno != EAGAIN))
+		luaL_error(L, "rbuf eventfd error");
+	__atomic_store_n(&rud->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); /* pairs with the one in rbuf_ring() */
+	return 1;
+	}
+
 void rbuf_pipe_write(lua_State *L, rud_t *rud)
 	{
 	if(!rbuf_has_pipe(rud)) return;
+	if(rud->doorbell == RBUF_EVENTFD)
+		{ rbuf_ring(L, rud); return; }
 	if(syncpipe_write(rbuf_writefd(rud)) < 0)
 		luaL_error(L, "rbuf pipe error");
 	}
@@ -80,31 +272,78 @@ void rbuf_pipe_write(lua_State *L, rud_t *rud)
 void rbuf_pipe_read(lua_State *L, rud_t *rud)
 	{
 	if(!rbuf_has_pipe(rud)) return;
+	if(rud->doorbell == RBUF_EVENTFD) return; /* see rbuf_park() */
 	if(syncpipe_read(rbuf_readfd(rud)) < 0)
 		luaL_error(L, "rbuf pipe error");
 	}
 
+static void rbuf_pipe_writen(lua_State *L, rud_t *rud, size_t n)
+/* batch version of rbuf_pipe_write() (one byte per message, one syscall) */
+	{
+	if(!rbuf_has_pipe(rud) || (n == 0)) return;
+	if(rud->doorbell == RBUF_EVENTFD)
+		{ rbuf_ring(L, rud); return; }
+	if(syncpipe_writen(rbuf_writefd(rud), n) < 0)
+		luaL_error(L, "rbuf pipe error");
+	}
+
+static void rbuf_pipe_readn(lua_State *L, rud_t *rud, size_t n)
+	{
+	if(!rbuf_has_pipe(rud)) return;
+	if(rud->doorbell == RBUF_EVENTFD) return;
+	if(syncpipe_readn(rbuf_readfd(rud), n) < 0)
+		luaL_error(L, "rbuf pipe error");
+	}
+
+static void InvalidateRbView(rud_t *rud, int writable);
+
+static const char *const DoorbellTypes[] = { "pipe", "eventfd", NULL };
 
 static int Ringbuffer(lua_State *L)
+/* ringbuffer(client, size [, mlock [, usepipe [, watermark [, shmname]]]]) */
 	{
 	cud_t *cud;
-	size_t sz;
+	size_t sz, watermark;
 	int mlock, usepipe, key;
+	const char *shmname;
 
 	luajack_checkcreate();
 
 	cud = cud_check(L, 1);
 	sz = luaL_checkinteger(L, 2);
 	mlock = lua_toboolean(L, 3);
-	usepipe = lua_toboolean(L, 4);
-	key = rbuf_new(L, cud, sz, mlock, usepipe);
+	if(lua_type(L, 4) == LUA_TSTRING)
+		usepipe = RBUF_PIPE + luaL_checkoption(L, 4, NULL, DoorbellTypes);
+	else
+		usepipe = lua_toboolean(L, 4) ? RBUF_PIPE : 0;
+	watermark = luaL_optinteger(L, 5, 1);
+	shmname = luaL_optstring(L, 6, NULL);
+	if(shmname)
+		key = rbuf_newshm(L, cud, shmname, sz, mlock, usepipe, 0);
+	else
+		key = rbuf_new(L, cud, sz, mlock, usepipe, watermark);
+	lua_pushinteger(L, key);	
+	return 1;
+	}
+
+static int RingbufferAttach(lua_State *L)
+/* ringbuffer_attach(client, shmname [, mlock]) */
+	{
+	cud_t *cud;
+	const char *shmname;
+	int mlock, key;
+	luajack_checkcreate();
+	cud = cud_check(L, 1);
+	shmname = luaL_checkstring(L, 2);
+	mlock = lua_toboolean(L, 3);
+	key = rbuf_newshm(L, cud, shmname, 0, mlock, 0, 1);
 	lua_pushinteger(L, key);	
 	return 1;
 	}
 
 static int RingbufferGetFd(lua_State *L)
 	{
-	rud_t *rud = rud_check(L, 1);
+	rud_t *rud = rbuf_check(L, 1);
 	if(!rbuf_has_pipe(rud)) return 0;
 	lua_pushinteger(L, rbuf_readfd(rud));
 	return 1;
@@ -113,8 +352,14 @@ static int RingbufferGetFd(lua_State *L)
 static int RingbufferWrite(lua_State *L)
 	{
 	int rc;
-	rud_t *rud = rud_check(L, 1);
-	rc = ringbuffer_luawrite(rud->rbuf, L, 2);
+	rud_t *rud = rbuf_check(L, 1);
+	size_t wptr = rbuf_wptr(rud);
+	InvalidateRbView(rud, 1); /* this replaces any pending reservation */
+	rc = rbuf_luawrite(rud, L, 2);
+	if(lua_toboolean(L, -1))
+		rbuf_wstats(rud, wptr, 1, 0);
+	else
+		rbuf_wstats(rud, wptr, 0, 1);
 	rbuf_pipe_write(L, rud);
 	return rc;
 	}
@@ -122,47 +367,626 @@ static int RingbufferWrite(lua_State *L)
 static int RingbufferRead(lua_State *L)
 	{
 	int rc;
-	rud_t *rud = rud_check(L, 1);
-	rc = ringbuffer_luaread(rud->rbuf, L, 1);
+	rud_t *rud = rbuf_check(L, 1);
+	size_t rptr = rbuf_rptr(rud);
+	InvalidateRbView(rud, 0);
+	rc = rbuf_luaread(rud, L, 1);
+	if(lua_isnil(L, -1) && rbuf_park(L, rud))
+		{ lua_pop(L, 1); rc = rbuf_luaread(rud, L, 1); }
+	if(rc == 2)
+		rbuf_rstats(rud, rptr, 1);
 	rbuf_pipe_read(L, rud);
 	return rc;
 	}
 
+static int RingbufferReadAll(lua_State *L)
+/* n, out = ringbuffer_read_all(rbuf [, max [, out]])
+ * out = { tag1, data1, tag2, data2, ... } */
+	{
+	lua_Integer n = 0;
+	int parked = 0;
+	rud_t *rud = rbuf_check(L, 1);
+	size_t rptr = rbuf_rptr(rud);
+	lua_Integer max = luaL_optinteger(L, 2, LUA_MAXINTEGER);
+	if(lua_isnoneornil(L, 3))
+		{ lua_settop(L, 2); lua_newtable(L); }
+	else
+		{ luaL_checktype(L, 3, LUA_TTABLE); lua_settop(L, 3); }
+	InvalidateRbView(rud, 0);
+	while(n < max)
+		{
+		rbuf_luaread(rud, L, 1);
+		if(lua_isnil(L, -1))
+			{
+			lua_pop(L, 1);
+			if(!parked && (parked = rbuf_park(L, rud))) continue;
+			break;
+			}
+		n++;
+		lua_rawseti(L, 3, 2*n); /* data */
+		lua_rawseti(L, 3, 2*n - 1); /* tag */
+		}
+	rbuf_rstats(rud, rptr, n);
+	rbuf_pipe_readn(L, rud, n);
+	lua_pushinteger(L, n);
+	lua_insert(L, 3);
+	return 2;
+	}
+
+static int RingbufferWriteMany(lua_State *L)
+/* n = ringbuffer_write_many(rbuf, msgs [, count])
+ * msgs = { tag1, data1, tag2, data2, ... } (data = nil or false for no data) */
+	{
+	int isnum, t;
+	lua_Integer i, n = 0, count;
+	rud_t *rud = rbuf_check(L, 1);
+	size_t wptr = rbuf_wptr(rud);
+	size_t mptr = wptr, wraps = 0;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	count = luaL_optinteger(L, 3, (luaL_len(L, 2) + 1)/2);
+	lua_settop(L, 2);
+	/* check all the messages first, so that an error does not leave
+	 * the batch half written (with no stats and no doorbell) */
+	for(i = 1; i <= count; i++)
+		{
+		lua_rawgeti(L, 2, 2*i - 1);
+		lua_tointegerx(L, -1, &isnum);
+		if(!isnum)
+			return luaL_error(L, "invalid tag (message %d)", (int)i);
+		t = lua_rawgeti(L, 2, 2*i);
+		if((t != LUA_TNIL) && (t != LUA_TBOOLEAN) && (t != LUA_TSTRING) && (t != LUA_TNUMBER))
+			return luaL_error(L, "invalid data (message %d)", (int)i);
+		lua_pop(L, 2);
+		}
+	InvalidateRbView(rud, 1);
+	for(i = 1; i <= count; i++)
+		{
+		lua_rawgeti(L, 2, 2*i - 1); /* tag (at index 3) */
+		if(lua_rawgeti(L, 2, 2*i) == LUA_TBOOLEAN) /* data (at index 4) */
+			{ lua_pop(L, 1); lua_pushnil(L); }
+		rbuf_luawrite(rud, L, 3);
+		if(!lua_toboolean(L, -1)) /* no space left */
+			break;
+		lua_settop(L, 2);
+		n++;
+		if(rud->rbuf) /* count the messages split across the end of the buffer */
+			{
+			if(rbuf_wrapped(rud->rbuf, mptr, (rud->rbuf->write_ptr - mptr) & rud->rbuf->size_mask))
+				wraps++;
+			mptr = rud->rbuf->write_ptr;
+			}
+		}
+	lua_settop(L, 2);
+	if(wraps > 0)
+		RbStatAdd(rud->stats.wraps, wraps);
+	rbuf_wstats(rud, wptr, n, n < count);
+	rbuf_pipe_writen(L, rud, n);
+	lua_pushinteger(L, n);
+	return 1;
+	}
+
 static int RingbufferPeek(lua_State *L)
 	{
 	int rc;
-	rud_t *rud = rud_check(L, 1);
-	rc = ringbuffer_luaread(rud->rbuf, L, 0);
+	rud_t *rud = rbuf_check(L, 1);
+	InvalidateRbView(rud, 0);
+	rc = rbuf_luaread(rud, L, 0);
+	if(lua_isnil(L, -1) && rbuf_park(L, rud))
+		{ lua_pop(L, 1); rc = rbuf_luaread(rud, L, 0); }
 	return rc;
 	}
 
 static int RingbufferReadAdvance(lua_State *L)
 	{
 	int rc;
-	rud_t *rud = rud_check(L, 1);
-	rc = ringbuffer_luaread_advance(rud->rbuf, L);
+	rud_t *rud = rbuf_check(L, 1);
+	size_t rptr = rbuf_rptr(rud);
+	InvalidateRbView(rud, 0);
+	rc = rbuf_luaread_advance(rud, L);
+	if(lua_toboolean(L, -1))
+		rbuf_rstats(rud, rptr, 1);
 	rbuf_pipe_read(L, rud);
 	return rc;
 	}
 
 static int RingbufferReset(lua_State *L)
 	{
-	rud_t *rud = rud_check(L, 1);
+	rud_t *rud = rbuf_checkspsc(L, 1);
 	luajack_verbose("reset ringbuffer %u\n", rud->key);
+	InvalidateRbView(rud, 0);
+	InvalidateRbView(rud, 1);
 	return ringbuffer_creset(rud->rbuf);
 	}
 
+/*--------------------------------------------------------------------------*
+ | Zero-copy views                                                          |
+ *--------------------------------------------------------------------------*/
+
+/* ringbuffer_reserve() and ringbuffer_acquire() return a view over the data
+ * part of a message, directly in the ringbuffer memory (see ringbuffer.c). 
+ * A view is valid until the message is committed or released, respectively.
+ * Views are cached in the registry of the state that uses them, so that no
+ * allocations are needed after the first reserve/acquire.
+ */
+
+#define RBVIEW_MT "luajack_rbview"
+#define RBVIEWS "luajack_rbviews" /* views cache (in the registry) */
+
+typedef struct {
+	rud_t	*rud;
+	jack_ringbuffer_data_t vec[2];	/* data segments */
+	size_t	len;		/* data length (0 if the view is not valid) */
+	int		valid;
+	int		writable;
+} rbview_t;
+
+#define CheckRbView(L, view) do {												\
+	if(!(view)->valid)															\
+		luaL_error((L), "ringbuffer view is not valid (already committed or released?)");\
+} while(0)
+
+static rbview_t* PushRbView(lua_State *L, rud_t *rud, int writable)
+	{
+	rbview_t *view;
+	lua_Integer key = (lua_Integer)rud->key*2 + writable;
+	if(lua_getfield(L, LUA_REGISTRYINDEX, RBVIEWS) != LUA_TTABLE)
+		{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, RBVIEWS);
+		}
+	if(lua_rawgeti(L, -1, key) != LUA_TUSERDATA)
+		{
+		lua_pop(L, 1);
+		view = (rbview_t*)lua_newuserdata(L, sizeof(rbview_t));
+		memset(view, 0, sizeof(rbview_t));
+		view->rud = rud;
+		view->writable = writable;
+		luaL_setmetatable(L, RBVIEW_MT);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, key);
+		}
+	else
+		view = (rbview_t*)lua_touserdata(L, -1);
+	lua_remove(L, -2);
+	rud->view[writable] = view;
+	return view;
+	}
+
+static void InvalidateRbView(rud_t *rud, int writable)
+	{
+	rbview_t *view = (rbview_t*)rud->view[writable];
+	if(view) view->valid = 0;
+	rud->view[writable] = NULL;
+	}
+
+static void CopyOut(rbview_t *view, size_t off, void *dst, size_t n)
+	{
+	size_t n0 = 0;
+	if(off < view->vec[0].len)
+		{
+		n0 = view->vec[0].len - off;
+		if(n0 > n) n0 = n;
+		memcpy(dst, view->vec[0].buf + off, n0);
+		}
+	if(n > n0)
+		memcpy((char*)dst + n0, view->vec[1].buf + (off + n0 - view->vec[0].len), n - n0);
+	}
+
+static void CopyIn(rbview_t *view, size_t off, const void *src, size_t n)
+	{
+	size_t n0 = 0;
+	if(off < view->vec[0].len)
+		{
+		n0 = view->vec[0].len - off;
+		if(n0 > n) n0 = n;
+		memcpy(view->vec[0].buf + off, src, n0);
+		}
+	if(n > n0)
+		memcpy(view->vec[1].buf + (off + n0 - view->vec[0].len), (const char*)src + n0, n - n0);
+	}
+
+static size_t CheckPos(lua_State *L, rbview_t *view, int arg, size_t n)
+/* checks that the n bytes starting at position arg (1-based) are in the view,
+ * and returns the corresponding offset */
+	{
+	lua_Integer i = luaL_checkinteger(L, arg);
+	if((i < 1) || ((size_t)(i - 1) + n > view->len))
+		luaL_error(L, "position is out of range");
+	return (size_t)(i - 1);
+	}
+
+static int RbViewIndex(lua_State *L)
+/* byte = view[i] (or method lookup) */
+	{
+	int isnum;
+	lua_Integer i;
+	unsigned char c;
+	rbview_t *view = (rbview_t*)lua_touserdata(L, 1);
+	i = lua_tointegerx(L, 2, &isnum);
+	if(!isnum) /* method */
+		{
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		return 1;
+		}
+	CheckRbView(L, view);
+	if((i < 1) || (i > (lua_Integer)view->len))
+		{ lua_pushnil(L); return 1; }
+	CopyOut(view, i - 1, &c, 1);
+	lua_pushinteger(L, c);
+	return 1;
+	}
+
+static int RbViewNewindex(lua_State *L)
+/* view[i] = byte */
+	{
+	unsigned char c;
+	rbview_t *view = (rbview_t*)lua_touserdata(L, 1);
+	CheckRbView(L, view);
+	if(!view->writable)
+		return luaL_error(L, "ringbuffer view is read-only");
+	c = (unsigned char)luaL_checkinteger(L, 3);
+	CopyIn(view, CheckPos(L, view, 2, 1), &c, 1);
+	return 0;
+	}
+
+static int RbViewLen(lua_State *L)
+	{
+	rbview_t *view = (rbview_t*)lua_touserdata(L, 1);
+	lua_pushinteger(L, view->valid ? view->len : 0);
+	return 1;
+	}
+
+static int RbViewGc(lua_State *L)
+/* the state the view is cached in is being closed */
+	{
+	rbview_t *view = (rbview_t*)lua_touserdata(L, 1);
+	if(view->rud && (view->rud->view[view->writable] == view))
+		view->rud->view[view->writable] = NULL;
+	return 0;
+	}
+
+static int RbViewRead(lua_State *L)
+/* s = view:read([i [, j]]) */
+	{
+	luaL_Buffer b;
+	lua_Integer i, j;
+	rbview_t *view = (rbview_t*)luaL_checkudata(L, 1, RBVIEW_MT);
+	CheckRbView(L, view);
+	i = luaL_optinteger(L, 2, 1);
+	j = luaL_optinteger(L, 3, view->len);
+	if(i < 1) i = 1;
+	if(j > (lua_Integer)view->len) j = view->len;
+	if(i > j)
+		{ lua_pushstring(L, ""); return 1; }
+	CopyOut(view, i - 1, luaL_buffinitsize(L, &b, j - i + 1), j - i + 1);
+	luaL_pushresultsize(&b, j - i + 1);
+	return 1;
+	}
+
+static int RbViewWrite(lua_State *L)
+/* view:write(i, s) */
+	{
+	size_t len;
+	rbview_t *view = (rbview_t*)luaL_checkudata(L, 1, RBVIEW_MT);
+	const char *s = luaL_checklstring(L, 3, &len);
+	CheckRbView(L, view);
+	if(!view->writable)
+		return luaL_error(L, "ringbuffer view is read-only");
+	CopyIn(view, CheckPos(L, view, 2, len), s, len);
+	return 0;
+	}
+
+static const char *const RbTypes[] = { "i8", "u8", "i16", "u16", "i32", "u32", "i64", "f32", "f64", NULL };
+static const size_t RbSizes[] = { 1, 1, 2, 2, 4, 4, 8, 4, 8 };
+
+typedef union {
+	int8_t i8; uint8_t u8; int16_t i16; uint16_t u16; int32_t i32; uint32_t u32; int64_t i64;
+	float f32; double f64;
+} rbvalue_t;
+
+static int RbViewGet(lua_State *L)
+/* value = view:get(type, i)  (native byte order) */
+	{
+	rbvalue_t v;
+	rbview_t *view = (rbview_t*)luaL_checkudata(L, 1, RBVIEW_MT);
+	int t = luaL_checkoption(L, 2, NULL, RbTypes);
+	CheckRbView(L, view);
+	CopyOut(view, CheckPos(L, view, 3, RbSizes[t]), &v, RbSizes[t]);
+	switch(t)
+		{
+		case 0: lua_pushinteger(L, v.i8); break;
+		case 1: lua_pushinteger(L, v.u8); break;
+		case 2: lua_pushinteger(L, v.i16); break;
+		case 3: lua_pushinteger(L, v.u16); break;
+		case 4: lua_pushinteger(L, v.i32); break;
+		case 5: lua_pushinteger(L, v.u32); break;
+		case 6: lua_pushinteger(L, v.i64); break;
+		case 7: lua_pushnumber(L, v.f32); break;
+		case 8: lua_pushnumber(L, v.f64); break;
+		}
+	return 1;
+	}
+
+static int RbViewSet(lua_State *L)
+/* view:set(type, i, value)  (native byte order) */
+	{
+	rbvalue_t v;
+	rbview_t *view = (rbview_t*)luaL_checkudata(L, 1, RBVIEW_MT);
+	int t = luaL_checkoption(L, 2, NULL, RbTypes);
+	size_t off;
+	CheckRbView(L, view);
+	if(!view->writable)
+		return luaL_error(L, "ringbuffer view is read-only");
+	off = CheckPos(L, view, 3, RbSizes[t]);
+	switch(t)
+		{
+		case 0: v.i8 = luaL_checkinteger(L, 4); break;
+		case 1: v.u8 = luaL_checkinteger(L, 4); break;
+		case 2: v.i16 = luaL_checkinteger(L, 4); break;
+		case 3: v.u16 = luaL_checkinteger(L, 4); break;
+		case 4: v.i32 = luaL_checkinteger(L, 4); break;
+		case 5: v.u32 = luaL_checkinteger(L, 4); break;
+		case 6: v.i64 = luaL_checkinteger(L, 4); break;
+		case 7: v.f32 = luaL_checknumber(L, 4); break;
+		case 8: v.f64 = luaL_checknumber(L, 4); break;
+		}
+	CopyIn(view, off, &v, RbSizes[t]);
+	return 0;
+	}
+
+static const struct luaL_Reg RbViewMethods [] = 
+	{
+		{ "read", RbViewRead },
+		{ "write", RbViewWrite },
+		{ "get", RbViewGet },
+		{ "set", RbViewSet },
+		{ NULL, NULL } /* sentinel */
+	};
+
+static void RbViewCreateMetatable(lua_State *L)
+	{
+	if(luaL_newmetatable(L, RBVIEW_MT))
+		{
+		lua_newtable(L); /* methods table (upvalue for __index) */
+		luaL_setfuncs(L, RbViewMethods, 0);
+		lua_pushcclosure(L, RbViewIndex, 1);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, RbViewNewindex);
+		lua_setfield(L, -2, "__newindex");
+		lua_pushcfunction(L, RbViewLen);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, RbViewGc);
+		lua_setfield(L, -2, "__gc");
+		}
+	lua_pop(L, 1);
+	}
+
+static int RingbufferReserve(lua_State *L)
+/* view = ringbuffer_reserve(rbuf, len) */
+	{
+	rbview_t *view;
+	jack_ringbuffer_data_t vec[2];
+	rud_t *rud = rbuf_checkspsc(L, 1);
+	lua_Integer len = luaL_checkinteger(L, 2);
+	if(len < 0)
+		return luaL_argerror(L, 2, "invalid length");
+	InvalidateRbView(rud, 1); /* a new reservation replaces the pending one */
+	if(!ringbuffer_creserve(rud->rbuf, len, vec))
+		{ rbuf_wstats(rud, 0, 0, 1); lua_pushnil(L); return 1; }
+	view = PushRbView(L, rud, 1);
+	view->vec[0] = vec[0];
+	view->vec[1] = vec[1];
+	view->len = len;
+	view->valid = 1;
+	return 1;
+	}
+
+static int RingbufferCommit(lua_State *L)
+/* ok = ringbuffer_commit(rbuf, tag [, len]) */
+	{
+	int isnum;
+	uint32_t tag;
+	size_t wptr;
+	lua_Integer len;
+	rud_t *rud = rbuf_checkspsc(L, 1);
+	rbview_t *view = (rbview_t*)rud->view[1];
+	tag = (uint32_t)lua_tointegerx(L, 2, &isnum);
+	if(!isnum)
+		return luaL_error(L, "invalid tag");
+	if(!view)
+		return luaL_error(L, "no reserved message to commit");
+	len = luaL_optinteger(L, 3, view->len);
+	if((len < 0) || ((size_t)len > view->len))
+		return luaL_argerror(L, 3, "invalid length");
+	InvalidateRbView(rud, 1);
+	wptr = rbuf_wptr(rud);
+	if(!ringbuffer_ccommit(rud->rbuf, tag, len))
+		{ lua_pushboolean(L, 0); return 1; }
+	rbuf_wstats(rud, wptr, 1, 0);
+	rbuf_pipe_write(L, rud);
+	lua_pushboolean(L, 1);
+	return 1;
+	}
+
+static int RingbufferAcquire(lua_State *L)
+/* tag, view = ringbuffer_acquire(rbuf) */
+	{
+	rbview_t *view;
+	uint32_t tag;
+	jack_ringbuffer_data_t vec[2];
+	rud_t *rud = rbuf_checkspsc(L, 1);
+	InvalidateRbView(rud, 0);
+	if(!ringbuffer_cacquire(rud->rbuf, &tag, vec) &&
+		!(rbuf_park(L, rud) && ringbuffer_cacquire(rud->rbuf, &tag, vec)))
+		{ lua_pushnil(L); return 1; }
+	lua_pushinteger(L, (int32_t)tag);
+	view = PushRbView(L, rud, 0);
+	view->vec[0] = vec[0];
+	view->vec[1] = vec[1];
+	view->len = vec[0].len + vec[1].len;
+	view->valid = 1;
+	return 2;
+	}
+
+static int RingbufferRelease(lua_State *L)
+/* ok = ringbuffer_release(rbuf) */
+	{
+	size_t rptr;
+	rud_t *rud = rbuf_checkspsc(L, 1);
+	if(!rud->view[0])
+		return luaL_error(L, "no acquired message to release");
+	InvalidateRbView(rud, 0);
+	rptr = rbuf_rptr(rud);
+	lua_pushboolean(L, ringbuffer_cread_advance(rud->rbuf));
+	if(lua_toboolean(L, -1))
+		rbuf_rstats(rud, rptr, 1);
+	rbuf_pipe_read(L, rud);
+	return 1;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Tables                                                                   |
+ *--------------------------------------------------------------------------*/
+
+#define CODEC_MAXDEPTH 32
+
+static int RingbufferWriteTable(lua_State *L)
+/* ok = ringbuffer_write_table(rbuf, tag, value [, maxdepth [, maxsize]]) 
+ * Encodes value (see codec.c) directly in the ringbuffer. Returns false if 
+ * there is not enough space, or if the encoded value exceeds maxsize bytes.
+ */
+	{
+	int isnum;
+	uint32_t tag;
+	size_t len, wptr;
+	jack_ringbuffer_data_t vec[2];
+	rud_t *rud = rbuf_checkspsc(L, 1);
+	lua_Integer maxdepth = luaL_optinteger(L, 4, CODEC_MAXDEPTH);
+	lua_Integer maxsize = luaL_optinteger(L, 5, UINT32_MAX);
+	tag = (uint32_t)lua_tointegerx(L, 2, &isnum);
+	if(!isnum)
+		return luaL_error(L, "invalid tag");
+	luaL_checkany(L, 3);
+	if((maxdepth < 1) || (maxdepth > INT_MAX))
+		return luaL_argerror(L, 4, "invalid depth");
+	if(maxsize < 0)
+		return luaL_argerror(L, 5, "invalid size");
+	lua_settop(L, 3);
+	if((len = codec_size(L, 3, maxdepth, maxsize)) == 0)
+		{ lua_pushboolean(L, 0); return 1; }
+	InvalidateRbView(rud, 1); /* this replaces any pending reservation */
+	wptr = rbuf_wptr(rud);
+	if(!ringbuffer_creserve(rud->rbuf, len, vec))
+		{ rbuf_wstats(rud, 0, 0, 1); lua_pushboolean(L, 0); return 1; }
+	codec_encode(L, 3, vec);
+	ringbuffer_ccommit(rud->rbuf, tag, len);
+	rbuf_wstats(rud, wptr, 1, 0);
+	rbuf_pipe_write(L, rud);
+	lua_pushboolean(L, 1);
+	return 1;
+	}
+
+typedef struct {
+	jack_ringbuffer_data_t *vec;
+	int maxdepth;
+	int ok;
+} decode_t;
+
+static int DecodeMessage(lua_State *L)
+/* codec_decode() in protected mode (see RingbufferReadTable) */
+	{
+	decode_t *d = (decode_t*)lua_touserdata(L, 1);
+	d->ok = codec_decode(L, d->vec, lua_isnil(L, 2) ? 0 : 2, d->maxdepth);
+	return d->ok ? 1 : 0;
+	}
+
+static int RingbufferReadTable(lua_State *L)
+/* tag, value = ringbuffer_read_table(rbuf [, target [, maxdepth]]) 
+ * If the value is a table and target is given, the value is decoded in target.
+ */
+	{
+	int rc;
+	uint32_t tag;
+	size_t rptr;
+	decode_t d;
+	jack_ringbuffer_data_t vec[2];
+	rud_t *rud = rbuf_checkspsc(L, 1);
+	int target = lua_isnoneornil(L, 2) ? 0 : 2;
+	lua_Integer maxdepth = luaL_optinteger(L, 3, CODEC_MAXDEPTH);
+	if(target)
+		luaL_checktype(L, 2, LUA_TTABLE);
+	if((maxdepth < 1) || (maxdepth > INT_MAX))
+		return luaL_argerror(L, 3, "invalid depth");
+	InvalidateRbView(rud, 0);
+	rptr = rbuf_rptr(rud);
+	if(!ringbuffer_cacquire(rud->rbuf, &tag, vec) &&
+		!(rbuf_park(L, rud) && ringbuffer_cacquire(rud->rbuf, &tag, vec)))
+		{ lua_pushnil(L); return 1; }
+	lua_pushinteger(L, (int32_t)tag);
+	/* the message is consumed even if decoding it raises an error
+	 * (e.g. out of memory), otherwise it would block the ringbuffer */
+	d.vec = vec;
+	d.maxdepth = (int)maxdepth;
+	d.ok = 0;
+	lua_pushcfunction(L, DecodeMessage);
+	lua_pushlightuserdata(L, &d);
+	if(target) lua_pushvalue(L, target); else lua_pushnil(L);
+	rc = lua_pcall(L, 2, 1, 0);
+	ringbuffer_cread_advance(rud->rbuf);
+	rbuf_rstats(rud, rptr, 1);
+	rbuf_pipe_read(L, rud);
+	if(rc != LUA_OK)
+		return lua_error(L);
+	if(!d.ok)
+		return luaL_error(L, "malformed table message (tag=%d)", (int32_t)tag);
+	return 2;
+	}
+
+static int RingbufferStats(lua_State *L)
+/* stats = ringbuffer_stats(rbuf) */
+	{
+	luajack_ringbuffer_stats_t stats;
+	rud_t *rud = rbuf_check(L, 1);
+	rbuf_getstats(rud, &stats);
+	lua_newtable(L);
+#define F(name) do { lua_pushinteger(L, (lua_Integer)stats.name); lua_setfield(L, -2, #name); } while(0)
+	F(written);
+	F(read);
+	F(bytes_written);
+	F(bytes_read);
+	F(rejected);
+	F(wraps);
+	F(fill);
+	F(peak);
+	F(size);
+#undef F
+	return 1;
+	}
+
 #define METHODS  \
 		{ "ringbuffer_getfd", RingbufferGetFd },	\
+		{ "ringbuffer_stats", RingbufferStats },	\
+		{ "ringbuffer_write_table", RingbufferWriteTable },	\
+		{ "ringbuffer_read_table", RingbufferReadTable },	\
 		{ "ringbuffer_write", RingbufferWrite },	\
 		{ "ringbuffer_read", RingbufferRead },		\
+		{ "ringbuffer_read_all", RingbufferReadAll },	\
+		{ "ringbuffer_write_many", RingbufferWriteMany },	\
 		{ "ringbuffer_peek", RingbufferPeek },		\
 		{ "ringbuffer_read_advance", RingbufferReadAdvance },	\
-		{ "ringbuffer_reset", RingbufferReset }		\
+		{ "ringbuffer_reset", RingbufferReset },	\
+		{ "ringbuffer_reserve", RingbufferReserve },	\
+		{ "ringbuffer_commit", RingbufferCommit },	\
+		{ "ringbuffer_acquire", RingbufferAcquire },	\
+		{ "ringbuffer_release", RingbufferRelease }	\
 
 static const struct luaL_Reg MFunctions[] = 
 	{
 		{ "ringbuffer", Ringbuffer },
+		{ "ringbuffer_attach", RingbufferAttach },
 		METHODS,
 		{ NULL, NULL } /* sentinel */
 	};
@@ -177,7 +1001,21 @@ static const struct luaL_Reg TFunctions[] =
 
 static void rbuf_free(rud_t *rud)
 	{
-	ringbuffer_free(rud->rbuf);
+	/* the views cached in the registry must not refer to freed memory */
+	InvalidateRbView(rud, 0);
+	InvalidateRbView(rud, 1);
+	if(rud->audio)
+		audioring_free(rud);
+	else if(rud->mpsc)
+		mpsc_free(rud->mpsc);
+	else if(rud->shm)
+		shmring_free(rud);
+	else if(rud->mailbox)
+		mbox_free(rud);
+	else if(rud->bcast || rud->bcreader)
+		bcast_free(rud);
+	else
+		ringbuffer_free(rud->rbuf);
 	CancelRudValid(rud);
 	}
 
@@ -194,6 +1032,7 @@ void rbuf_free_all(cud_t *cud)
 
 int luajack_open_rbuf(lua_State *L, int state_type)
 	{
+	RbViewCreateMetatable(L);
 	switch(state_type)
 		{
 		case ST_MAIN: luaL_setfuncs(L, MFunctions, 0); break;
@@ -333,3 +333,98 @@ size_t ringbuffer_read_space(jack_ringbuffer_t *rbuf)
 	return jack_ringbuffer_read_space(rbuf);
 	}
 
+
+
+/*--------------------------------------------------------------------------*
+ | Zero-copy access                                                         |
+ *--------------------------------------------------------------------------*/
+
+/* A message can be written in place by first reserving space for it, then
+ * filling the data part directly in the ringbuffer, and finally committing it.
+ * Similarly, it can be read in place by acquiring it, accessing the data part
+ * directly in the ringbuffer, and then releasing it.
+ * The data part of a message may wrap around the end of the buffer, so it is 
+ * described by up to two segments (vec[0] and vec[1], the latter with len=0 
+ * if the data part is contiguous).
+ */
+
+static void Segments(jack_ringbuffer_data_t vec[2], size_t len)
+/* transforms the read/write vector vec into the segments for the data part of
+ * a message of len bytes (starting right after its header) */
+	{
+	size_t skip = sizeof(hdr_t);
+	if(vec[0].len > skip)
+		{
+		vec[0].buf += skip;
+		vec[0].len -= skip;
+		}
+	else
+		{
+		skip -= vec[0].len;
+		vec[0].buf = vec[1].buf + skip;
+		vec[0].len = vec[1].len - skip;
+		vec[1].len = 0;
+		}
+	if(vec[0].len >= len)
+		{ vec[0].len = len; vec[1].len = 0; }
+	else
+		vec[1].len = len - vec[0].len;
+	}
+
+int ringbuffer_creserve(jack_ringbuffer_t *rbuf, size_t len, jack_ringbuffer_data_t vec[2])
+/* Reserves space for a message with len bytes of data, and returns in vec the
+ * segments where to write the data. Nothing is visible to the reader until the
+ * message is committed. Returns 1 on success, or 0 if there is not enough space.
+ */
+	{
+	if(len > UINT32_MAX) return 0;
+	if(jack_ringbuffer_write_space(rbuf) < (sizeof(hdr_t) + len))
+		return 0;
+	jack_ringbuffer_get_write_vector(rbuf, vec);
+	Segments(vec, len);
+	return 1;
+	}
+
+int ringbuffer_ccommit(jack_ringbuffer_t *rbuf, uint32_t tag, size_t len)
+/* Commits a message previously reserved with ringbuffer_creserve() (len may be
+ * less than the reserved length). Returns 1 on success, or 0 on error.
+ */
+	{
+	jack_ringbuffer_data_t vec[2];
+	hdr_t hdr;
+	if(len > UINT32_MAX) return 0;
+	if(jack_ringbuffer_write_space(rbuf) < (sizeof(hdr) + len))
+		return 0;
+	hdr.tag = tag;
+	hdr.len = len;
+	/* write the header in place (it may wrap too), then publish all at once */
+	jack_ringbuffer_get_write_vector(rbuf, vec);
+	if(vec[0].len >= sizeof(hdr))
+		memcpy(vec[0].buf, &hdr, sizeof(hdr));
+	else
+		{
+		memcpy(vec[0].buf, &hdr, vec[0].len);
+		memcpy(vec[1].buf, (char*)&hdr + vec[0].len, sizeof(hdr) - vec[0].len);
+		}
+	jack_ringbuffer_write_advance(rbuf, sizeof(hdr) + len);
+	return 1;
+	}
+
+int ringbuffer_cacquire(jack_ringbuffer_t *rbuf, uint32_t *tag, jack_ringbuffer_data_t vec[2])
+/* Acquires the next message, returning its tag and the segments containing its
+ * data (the message stays in the ringbuffer until released with 
+ * ringbuffer_cread_advance()). Returns 1 on success, or 0 if there is no
+ * complete message available.
+ */
+	{
+	hdr_t hdr;
+	if(jack_ringbuffer_peek(rbuf, (char*)&hdr, sizeof(hdr)) != sizeof(hdr))
+		return 0;
+	if(jack_ringbuffer_read_space(rbuf) < (sizeof(hdr) + hdr.len))
+		return 0;
+	*tag = hdr.tag;
+	jack_ringbuffer_get_read_vector(rbuf, vec);
+	Segments(vec, hdr.len);
+	return 1;
+	}
+
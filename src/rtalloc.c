@@ -0,0 +1,388 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Real-time memory allocator for the process and thread states				*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <sys/mman.h>
+
+/* By default, the process and thread Lua states inherit the memory allocator 
+ * from the main state, so that every table or string created in the rt-callbacks
+ * goes through the system malloc(), which is not real-time safe.
+ *
+ * This module provides an opt-in alternative: a TLSF (Two-Level Segregated Fit)
+ * allocator working on a dedicated arena, which is preallocated and locked in 
+ * memory when the state is created, and whose operations are all O(1).
+ *
+ * Each arena is used by a single Lua state, and thus by a single thread at a 
+ * time, so no locking is needed.
+ *
+ * Rfr: M. Masmano et al, "TLSF: a New Dynamic Memory Allocator for Real-Time Systems".
+ */
+
+#define ALIGN_LOG2	4
+#define ALIGN		(1 << ALIGN_LOG2)
+#define SL_LOG2		4	/* log2 of the number of second-level lists */
+#define SL_COUNT	(1 << SL_LOG2)
+#define FL_SHIFT	(SL_LOG2 + ALIGN_LOG2)
+#define SMALL		(1 << FL_SHIFT) /* blocks smaller than this are all in fl = 0 */
+#define FL_MAX		40	/* log2 of the max block size */
+#define FL_COUNT	(FL_MAX - FL_SHIFT + 1)
+#define MIN_ARENA	(64*1024)
+
+typedef struct block_s {
+	struct block_s *prev;		/* previous physical block */
+	size_t	size;				/* block size (header included) | FREE */
+	/* the following are used only in free blocks, and overlap the payload: */
+	struct block_s *next_free;
+	struct block_s *prev_free;
+} block_t;
+
+#define FREE	((size_t)1)
+#define HDR		offsetof(block_t, next_free)
+#define MIN_BLOCK sizeof(block_t)
+
+#define BSIZE(b)	((b)->size & ~FREE)
+#define ISFREE(b)	((b)->size & FREE)
+#define NEXT(b)		((block_t*)((char*)(b) + BSIZE(b)))
+#define PAYLOAD(b)	((void*)((char*)(b) + HDR))
+#define BLOCK(p)	((block_t*)((char*)(p) - HDR))
+
+struct luajack_rtpool_s {
+	void	*mem;		/* mmap'ed arena */
+	size_t	memsize;
+	int		locked;		/* 1 if mlock() succeeded */
+	size_t	size;		/* total size available for blocks */
+	size_t	used;		/* currently allocated (blocks headers included) */
+	size_t	peak;		/* high watermark of used */
+	size_t	failures;	/* no. of failed allocations */
+	unsigned long fl_bitmap;
+	unsigned int sl_bitmap[FL_COUNT];
+	block_t *heads[FL_COUNT][SL_COUNT];
+};
+
+/*--------------------------------------------------------------------------*
+ | TLSF                                                                     |
+ *--------------------------------------------------------------------------*/
+
+static int Fls(size_t x) /* x > 0 */
+	{ return (int)(sizeof(unsigned long)*8) - 1 - __builtin_clzl((unsigned long)x); }
+
+static void Mapping(size_t size, int *fl, int *sl)
+	{
+	int f;
+	if(size < SMALL)
+		{
+		*fl = 0;
+		*sl = (int)(size / (SMALL / SL_COUNT));
+		return;
+		}
+	f = Fls(size);
+	*sl = (int)((size >> (f - SL_LOG2)) ^ SL_COUNT);
+	*fl = f - FL_SHIFT + 1;
+	}
+
+static void InsertFree(rtpool_t *pool, block_t *b)
+	{
+	int fl, sl;
+	Mapping(BSIZE(b), &fl, &sl);
+	b->prev_free = NULL;
+	b->next_free = pool->heads[fl][sl];
+	if(b->next_free)
+		b->next_free->prev_free = b;
+	pool->heads[fl][sl] = b;
+	pool->fl_bitmap |= 1UL << fl;
+	pool->sl_bitmap[fl] |= 1U << sl;
+	}
+
+static void RemoveFree(rtpool_t *pool, block_t *b)
+	{
+	int fl, sl;
+	Mapping(BSIZE(b), &fl, &sl);
+	if(b->next_free)
+		b->next_free->prev_free = b->prev_free;
+	if(b->prev_free)
+		b->prev_free->next_free = b->next_free;
+	else
+		{
+		pool->heads[fl][sl] = b->next_free;
+		if(!b->next_free)
+			{
+			pool->sl_bitmap[fl] &= ~(1U << sl);
+			if(!pool->sl_bitmap[fl])
+				pool->fl_bitmap &= ~(1UL << fl);
+			}
+		}
+	}
+
+static block_t *FindSuitable(rtpool_t *pool, size_t size)
+/* returns a free block of at least the given size (not removed from its list) */
+	{
+	int fl, sl;
+	unsigned int sl_map;
+	unsigned long fl_map;
+	if(size >= SMALL) /* round up to the next list, so that any block in it fits */
+		size += ((size_t)1 << (Fls(size) - SL_LOG2)) - 1;
+	Mapping(size, &fl, &sl);
+	if(fl >= FL_COUNT) 
+		return NULL;
+	sl_map = pool->sl_bitmap[fl] & (~0U << sl);
+	if(!sl_map)
+		{
+		fl_map = pool->fl_bitmap & (~0UL << (fl + 1));
+		if(!fl_map) 
+			return NULL;
+		fl = __builtin_ctzl(fl_map);
+		sl_map = pool->sl_bitmap[fl];
+		}
+	sl = __builtin_ctz(sl_map);
+	return pool->heads[fl][sl];
+	}
+
+static void Trim(rtpool_t *pool, block_t *b, size_t size)
+/* shrinks the used block b to size, releasing the remainder (if big enough) */
+	{
+	block_t *r, *next;
+	if(BSIZE(b) - size < MIN_BLOCK)
+		return;
+	r = (block_t*)((char*)b + size);
+	r->size = BSIZE(b) - size;
+	r->prev = b;
+	b->size = size;
+	next = NEXT(r);
+	if(ISFREE(next))
+		{
+		RemoveFree(pool, next);
+		r->size += BSIZE(next);
+		}
+	NEXT(r)->prev = r;
+	r->size |= FREE;
+	InsertFree(pool, r);
+	}
+
+static size_t BlockSize(size_t nsize)
+	{
+	size_t size = (nsize + HDR + ALIGN - 1) & ~((size_t)ALIGN - 1);
+	if(size < nsize) return 0; /* overflow */
+	return size < MIN_BLOCK ? MIN_BLOCK : size;
+	}
+
+static void *PoolMalloc(rtpool_t *pool, size_t nsize)
+	{
+	block_t *b;
+	size_t size = BlockSize(nsize);
+	if((size == 0) || ((b = FindSuitable(pool, size)) == NULL))
+		return NULL;
+	RemoveFree(pool, b);
+	b->size &= ~FREE;
+	Trim(pool, b, size);
+	pool->used += BSIZE(b);
+	if(pool->used > pool->peak) 
+		pool->peak = pool->used;
+	return PAYLOAD(b);
+	}
+
+static void PoolFree(rtpool_t *pool, void *ptr)
+	{
+	block_t *next, *b = BLOCK(ptr);
+	pool->used -= BSIZE(b);
+	if(b->prev && ISFREE(b->prev))
+		{
+		RemoveFree(pool, b->prev);
+		b->prev->size = BSIZE(b->prev) + BSIZE(b);
+		b = b->prev;
+		}
+	next = NEXT(b);
+	if(ISFREE(next))
+		{
+		RemoveFree(pool, next);
+		b->size = BSIZE(b) + BSIZE(next);
+		}
+	NEXT(b)->prev = b;
+	b->size |= FREE;
+	InsertFree(pool, b);
+	}
+
+static void *PoolRealloc(rtpool_t *pool, void *ptr, size_t nsize)
+	{
+	void *q;
+	block_t *next, *b = BLOCK(ptr);
+	size_t cur = BSIZE(b);
+	size_t size = BlockSize(nsize);
+	if(size == 0) 
+		return NULL;
+	if(size > cur)
+		{
+		/* try to grow in place, by absorbing the next block */
+		next = NEXT(b);
+		if(!ISFREE(next) || (cur + BSIZE(next) < size))
+			{
+			if((q = PoolMalloc(pool, nsize)) == NULL)
+				return NULL;
+			memcpy(q, ptr, cur - HDR);
+			PoolFree(pool, ptr);
+			return q;
+			}
+		RemoveFree(pool, next);
+		b->size = cur + BSIZE(next);
+		NEXT(b)->prev = b;
+		}
+	Trim(pool, b, size);
+	pool->used = pool->used - cur + BSIZE(b);
+	if(pool->used > pool->peak) 
+		pool->peak = pool->used;
+	return ptr;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Arena                                                                    |
+ *--------------------------------------------------------------------------*/
+
+rtpool_t *rtalloc_new(size_t size)
+/* creates a pool with an arena of (at least) the given size */
+	{
+	rtpool_t *pool;
+	block_t *first, *last;
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	void *mem;
+
+	if(size < MIN_ARENA) size = MIN_ARENA;
+	size = (size + pagesize - 1) & ~(pagesize - 1);
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		return NULL;
+	pool = (rtpool_t*)mem;
+	memset(pool, 0, sizeof(rtpool_t));
+	pool->mem = mem;
+	pool->memsize = size;
+	if(mlock(mem, size) == 0)
+		pool->locked = 1;
+	else
+		luajack_verbose("cannot lock rt-allocator arena in memory (%s)\n", strerror(errno));
+	/* touch all pages, so to have no page faults later on */
+	memset((char*)mem + sizeof(rtpool_t), 0, size - sizeof(rtpool_t));
+
+	/* one big free block followed by a used sentinel header */
+	first = (block_t*)(((uintptr_t)mem + sizeof(rtpool_t) + ALIGN - 1) & ~((uintptr_t)ALIGN - 1));
+	last = (block_t*)(((uintptr_t)mem + size - HDR) & ~((uintptr_t)ALIGN - 1));
+	first->prev = NULL;
+	first->size = (size_t)((char*)last - (char*)first);
+	last->prev = first;
+	last->size = 0;
+	pool->size = first->size;
+	first->size |= FREE;
+	InsertFree(pool, first);
+	luajack_verbose("created rt-allocator arena (size=%lu, locked=%d)\n", 
+				(unsigned long)size, pool->locked);
+	return pool;
+	}
+
+void rtalloc_free(rtpool_t *pool)
+/* releases the arena (the Lua state using it must have been closed) */
+	{
+	if(!pool) return;
+	if(pool->locked)
+		munlock(pool->mem, pool->memsize);
+	munmap(pool->mem, pool->memsize);
+	}
+
+void *rtalloc_allocf(void *ud, void *ptr, size_t osize, size_t nsize)
+/* lua_Alloc function (ud = pool) */
+	{
+	void *q;
+	rtpool_t *pool = (rtpool_t*)ud;
+	(void)osize;
+	if(nsize == 0)
+		{
+		if(ptr) PoolFree(pool, ptr);
+		return NULL;
+		}
+	q = ptr ? PoolRealloc(pool, ptr, nsize) : PoolMalloc(pool, nsize);
+	if(!q) 
+		pool->failures++;
+	return q;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Lua functions                                                            |
+ *--------------------------------------------------------------------------*/
+
+static int RtAllocator(lua_State *L)
+/* rt_allocator(client, size [, thread_size]) */
+	{
+	cud_t *cud = cud_check(L, 1);
+	lua_Integer size = luaL_checkinteger(L, 2);
+	lua_Integer thread_size = luaL_optinteger(L, 3, 0);
+	luajack_checkmain();
+	if((size < 0) || (thread_size < 0))
+		return luaL_error(L, "invalid arena size");
+	if(cud->process_state)
+		return luaL_error(L, "process chunk already loaded");
+	cud->rtpool_size = (size_t)size;
+	cud->rtpool_thread_size = (size_t)thread_size;
+	return 0;
+	}
+
+static int RtAllocatorStats(lua_State *L)
+/* size, used, peak, failures, locked = rt_allocator_stats(client [, thread]) */
+	{
+	rtpool_t *pool;
+	tud_t *tud;
+	cud_t *cud = cud_check(L, 1);
+	if(lua_isnoneornil(L, 2))
+		pool = cud->rtpool;
+	else
+		{
+		tud = tud_check(L, 2);
+		if(tud->cud != cud)
+			return luaL_error(L, "thread is not owned by this client");
+		pool = tud->rtpool;
+		}
+	if(!pool) 
+		return 0;
+	lua_pushinteger(L, pool->size);
+	lua_pushinteger(L, pool->used);
+	lua_pushinteger(L, pool->peak);
+	lua_pushinteger(L, pool->failures);
+	lua_pushboolean(L, pool->locked);
+	return 5;
+	}
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "rt_allocator", RtAllocator },
+		{ "rt_allocator_stats", RtAllocatorStats },
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_rtalloc(lua_State *L, int state_type)
+	{
+	if(state_type == ST_MAIN)
+		luaL_setfuncs(L, MFunctions, 0);
+	return 1;
+	}
+
@@ -29,46 +29,24 @@
 
 #include "internal.h"
 
-static int cmp(rud_t *rud1, rud_t *rud2) /* the compare function */
-	{ return (rud1->key < rud2->key ? -1 : rud1->key > rud2->key); } 
+static handletab_t Tab;
 
-static RB_HEAD(rudtree_s, rud_s) Head = RB_INITIALIZER(&Head);
-
-RB_PROTOTYPE_STATIC(rudtree_s, rud_s, entry, cmp) 
-RB_GENERATE_STATIC(rudtree_s, rud_s, entry, cmp) 
- 
-static rud_t *rud_remove(rud_t *rud) 
-	{ return RB_REMOVE(rudtree_s, &Head, rud); }
-static rud_t *rud_insert(rud_t *rud) 
-	{ return RB_INSERT(rudtree_s, &Head, rud); }
 static rud_t *rud_search(uintptr_t key) 
-	{ rud_t tmp; tmp.key = key; return RB_FIND(rudtree_s, &Head, &tmp); }
+	{ return (rud_t*)handle_get(&Tab, key); }
 rud_t *rud_first(uintptr_t key) 
-	{ rud_t tmp; tmp.key = key; return RB_NFIND(rudtree_s, &Head, &tmp); }
+	{ return (rud_t*)handle_first(&Tab, key); }
 rud_t *rud_next(rud_t *rud)
-	{ return RB_NEXT(rudtree_s, &Head, rud); }
-#if 0
-rud_t *rud_prev(rud_t *rud)
-	{ return RB_PREV(rudtree_s, &Head, rud); }
-rud_t *rud_min(void)
-	{ return RB_MIN(rudtree_s, &Head); }
-rud_t *rud_max(void)
-	{ return RB_MAX(rudtree_s, &Head); }
-rud_t *rud_root(void)
-	{ return RB_ROOT(&Head); }
-#endif
+	{ return (rud_t*)handle_next(&Tab, rud->key); }
 
 rud_t *rud_new(void)
 	{
 	rud_t *rud;
 	if((rud = (rud_t*)Malloc(sizeof(rud_t))) == NULL)  return NULL;
 	memset(rud, 0, sizeof(rud_t));
-	rud->key = (uintptr_t)rud;
-	if(rud_search(rud->key))
-		{ Free(rud); luajack_error(UNEXPECTED_ERROR); return NULL; }
+	if((rud->key = handle_new(&Tab, rud)) == 0)
+		{ Free(rud); return NULL; }
 	rud->obj.type = LUAJACK_TRINGBUFFER;
 	rud->obj.xud = (void*)rud;
-	rud_insert(rud);
 	MarkRudValid(rud);
 	return rud;
 	}
@@ -76,7 +54,7 @@ rud_t *rud_new(void)
 static void rud_free(rud_t* rud)
 	{
 	if(rud_search(rud->key) == rud)
-		rud_remove(rud);
+		handle_free(&Tab, rud->key);
 	Free(rud);	
 	DBG("rud_free()\n");
 	}
@@ -86,6 +64,7 @@ void rud_free_all(void)
 	rud_t *rud;
 	while((rud = rud_first(0)))
 		rud_free(rud);
+	handle_freetab(&Tab);
 	}
 
 
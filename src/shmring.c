@@ -0,0 +1,259 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Shared-memory ringbuffers												*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A shared-memory ringbuffer is an ordinary jack ringbuffer whose control 
+ * fields and data live in a named POSIX shm segment, so that it can be used 
+ * by two LuaJack processes (one writing and one reading, as usual) with the
+ * same protocol and functions as the local ones (see ringbuffer.c).
+ *
+ * The jack_ringbuffer_t struct can not be shared as is, because its first
+ * field (buf) is a pointer that is valid only in the process that set it. 
+ * So each process maps a private page followed by the shared segment, and 
+ * places the struct so that buf falls at the end of the private page while
+ * the other fields (write_ptr, read_ptr, size, ...) fall at the beginning of
+ * the shared segment:
+ *
+ *    | private page       | shared segment                                  |
+ *    |          ...  buf  | write_ptr read_ptr ... | shmhdr_t | ... | data  |
+ *                                                              (next page)
+ *
+ * The doorbell, if any, is a FIFO named after the segment, opened in both
+ * processes in read-write mode, so that it behaves as the pipe of a local
+ * ringbuffer (see rbuf.c) and never blocks on open.
+ */
+
+#define SHMRING_MAGIC	0x4c4a5242 /* "LJRB" */
+#define SHMRING_PREFIX	"/luajack-"
+#define SHMRING_FIFODIR "/dev/shm"
+#define SHMRING_MAXNAME	128
+
+typedef struct {	/* follows the shared part of jack_ringbuffer_t */
+	uint32_t magic;		/* set last by the creator */
+	uint32_t ptrsize;	/* sizeof(size_t) of the creator */
+	uint32_t fifo;		/* 1 if a FIFO doorbell is associated */
+	uint32_t unused;
+	uint64_t datasize;
+} shmhdr_t;
+
+typedef struct {
+	void	*base;		/* reserved region (private page + shared segment) */
+	size_t	maplen;		/* length of the reserved region */
+	size_t	pagesz;
+	int		owner;		/* 1 if this process created the segment */
+	char	name[SHMRING_MAXNAME + sizeof(SHMRING_PREFIX)];
+	char	fifo[SHMRING_MAXNAME + sizeof(SHMRING_PREFIX) + sizeof(SHMRING_FIFODIR) + 5];
+} shmring_t;
+
+#define RBOFFSET offsetof(jack_ringbuffer_t, write_ptr) /* start of the shared part */
+#define HDROFFSET ((sizeof(jack_ringbuffer_t) - RBOFFSET + 63) & ~(size_t)63)
+
+static shmhdr_t *Hdr(shmring_t *shm)
+	{
+	return (shmhdr_t*)((char*)shm->base + shm->pagesz + HDROFFSET);
+	}
+
+static int Map(shmring_t *shm, int fd, size_t shmlen, int mlock_)
+/* maps the private page and the segment (of length shmlen) */
+	{
+	char *base, *p;
+	shm->maplen = shm->pagesz + shmlen;
+	base = mmap(NULL, shm->maplen, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED)
+		return -1;
+	shm->base = base;
+	p = mmap(base, shm->pagesz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if(p == MAP_FAILED)
+		return -1;
+	p = mmap(base + shm->pagesz, shmlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+	if(p == MAP_FAILED)
+		return -1;
+	if(mlock_ && (mlock(base, shm->maplen) != 0))
+		luajack_verbose("cannot lock shared ringbuffer in memory (%s)\n", strerror(errno));
+	return 0;
+	}
+
+static jack_ringbuffer_t *RingbufferOf(shmring_t *shm)
+	{
+	jack_ringbuffer_t *rbuf;
+	rbuf = (jack_ringbuffer_t*)((char*)shm->base + shm->pagesz - RBOFFSET);
+	rbuf->buf = (char*)shm->base + 2*shm->pagesz; /* private */
+	return rbuf;
+	}
+
+static int OpenFifo(shmring_t *shm, int create)
+	{
+	int fd;
+	struct stat st;
+	if(create && (mkfifo(shm->fifo, 0600) != 0) && (errno != EEXIST)) /* may be stale */
+		return -1;
+	if((fd = open(shm->fifo, O_RDWR | O_NONBLOCK | O_NOFOLLOW)) < 0)
+		return -1;
+	/* the path may be pre-existing: make sure it is a FIFO of ours */
+	if((fstat(fd, &st) != 0) || !S_ISFIFO(st.st_mode) || (st.st_uid != geteuid()))
+		{ close(fd); errno = EPERM; return -1; }
+	return fd;
+	}
+
+static void Destroy(shmring_t *shm, int unlink_)
+	{
+	if(shm->base)
+		munmap(shm->base, shm->maplen);
+	if(unlink_)
+		{
+		shm_unlink(shm->name);
+		unlink(shm->fifo);
+		}
+	Free(shm);
+	}
+
+static shmring_t *New(lua_State *L, const char *name)
+	{
+	shmring_t *shm;
+	if((strlen(name) == 0) || (strlen(name) > SHMRING_MAXNAME) || strchr(name, '/'))
+		luaL_error(L, "invalid shared ringbuffer name '%s'", name);
+	if((shm = (shmring_t*)Malloc(sizeof(shmring_t))) == NULL)
+		luaL_error(L, "cannot allocate memory");
+	memset(shm, 0, sizeof(shmring_t));
+	shm->pagesz = sysconf(_SC_PAGESIZE);
+	snprintf(shm->name, sizeof(shm->name), SHMRING_PREFIX"%s", name);
+	snprintf(shm->fifo, sizeof(shm->fifo), SHMRING_FIFODIR SHMRING_PREFIX"%s.fifo", name);
+	return shm;
+	}
+
+#define Fail(what) do { 													\
+	int errno_ = errno;														\
+	if(fd >= 0) close(fd);													\
+	Destroy(shm, owner);													\
+	return luaL_error(L, "cannot %s shared ringbuffer '%s' (%s)", (what), name, strerror(errno_));\
+} while(0)
+
+int shmring_create(lua_State *L, rud_t *rud, const char *name, size_t sz, int mlock_, int usepipe)
+/* creates the named segment and sets rud->rbuf, rud->shm and rud->pipefd
+ * (with the FIFO, if usepipe is true). On error, calls luaL_error */
+	{
+	jack_ringbuffer_t *rbuf;
+	shmhdr_t *hdr;
+	size_t datasz;
+	int fd = -1, owner = 0;
+	shmring_t *shm = New(L, name);
+
+	if((RBOFFSET < offsetof(jack_ringbuffer_t, buf) + sizeof(char*)) ||
+		(HDROFFSET + sizeof(shmhdr_t) > shm->pagesz))
+		{ Destroy(shm, 0); return luaL_error(L, "shared ringbuffers not supported"); }
+
+	for(datasz = 1; datasz < sz; datasz <<= 1); /* same as jack_ringbuffer_create() */
+
+	if((fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+		Fail("create");
+	owner = 1;
+	if(ftruncate(fd, shm->pagesz + datasz) != 0)
+		Fail("size");
+	if(Map(shm, fd, shm->pagesz + datasz, mlock_) != 0)
+		Fail("map");
+	close(fd);
+	fd = -1;
+
+	rbuf = RingbufferOf(shm);
+	rbuf->size = datasz;
+	rbuf->size_mask = datasz - 1;
+	rbuf->write_ptr = 0;
+	rbuf->read_ptr = 0;
+	rbuf->mlocked = 0; /* we never call jack_ringbuffer_free() on it */
+	hdr = Hdr(shm);
+	hdr->ptrsize = sizeof(size_t);
+	hdr->datasize = datasz;
+	hdr->fifo = usepipe ? 1 : 0;
+
+	if(usepipe && ((fd = OpenFifo(shm, 1)) < 0))
+		Fail("create doorbell for");
+
+	__atomic_store_n(&hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+	shm->owner = 1;
+	rud->shm = shm;
+	rud->rbuf = rbuf;
+	rud->pipefd[0] = rud->pipefd[1] = fd;
+	return 0;
+	}
+
+int shmring_attach(lua_State *L, rud_t *rud, const char *name, int mlock_)
+/* attaches to the named segment and sets rud->rbuf, rud->shm and rud->pipefd
+ * (with the FIFO, if the creator associated one). On error, calls luaL_error */
+	{
+	struct stat st;
+	shmhdr_t *hdr;
+	int fd = -1, owner = 0;
+	shmring_t *shm = New(L, name);
+
+	if((fd = shm_open(shm->name, O_RDWR, 0)) < 0)
+		Fail("open");
+	if(fstat(fd, &st) != 0)
+		Fail("stat");
+	if((size_t)st.st_size <= shm->pagesz)
+		{ errno = EINVAL; Fail("attach to"); }
+	if(Map(shm, fd, st.st_size, mlock_) != 0)
+		Fail("map");
+	close(fd);
+	fd = -1;
+
+	hdr = Hdr(shm);
+	if((__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC) || 
+		(hdr->ptrsize != sizeof(size_t)) ||
+		(hdr->datasize != (size_t)st.st_size - shm->pagesz))
+		{ errno = EINVAL; Fail("attach to"); }
+
+	if(hdr->fifo && ((fd = OpenFifo(shm, 0)) < 0))
+		Fail("open doorbell of");
+
+	rud->shm = shm;
+	rud->rbuf = RingbufferOf(shm);
+	rud->pipefd[0] = rud->pipefd[1] = fd;
+	return 0;
+	}
+
+#undef Fail
+
+void shmring_free(rud_t *rud)
+/* detaches from the segment (and removes it, if this process created it) */
+	{
+	shmring_t *shm = (shmring_t*)rud->shm;
+	if(!shm) return;
+	if(rud->pipefd[0] >= 0)
+		close(rud->pipefd[0]);
+	rud->pipefd[0] = rud->pipefd[1] = -1;
+	Destroy(shm, shm->owner);
+	rud->shm = NULL;
+	rud->rbuf = NULL;
+	}
+
@@ -53,6 +53,9 @@
 #define evt_t		luajack_evt_t
 #define evt_s		luajack_evt_s
 #define stat_t luajack_stat_t
+#define rtpool_t	luajack_rtpool_t
+#define hist_t	luajack_hist_t
+#define trace_t	luajack_trace_t
 
 
 typedef struct { 
@@ -64,18 +67,67 @@ typedef struct {
 	double m2;
 } luajack_stat_t;
 
+/* Log-linear latency histogram (see utils.c).
+ * Samples are in nanoseconds. Values below HIST_SUB go in linear buckets, 
+ * above that each power of 2 is split in HIST_SUB buckets (~6% resolution). 
+ * The counters are written by the rt-thread only, and read by the main thread,
+ * which resets a window by taking a baseline copy of them. */
+#define HIST_SUB_LOG2	4
+#define HIST_SUB		(1 << HIST_SUB_LOG2)
+#define HIST_MAX_LOG2	40	/* samples above 2^40 ns (~18 min) go in the last bucket */
+#define HIST_BUCKETS	(HIST_SUB*(HIST_MAX_LOG2 - HIST_SUB_LOG2 + 2))
+typedef struct {
+	/* rt-thread (writer) */
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n;
+	uint64_t max;	/* max sample in the current window (reset by the reader) */
+	/* main thread (reader) */
+	uint64_t base[HIST_BUCKETS];
+	uint64_t basen;
+} luajack_hist_t;
+
+/* rt-callbacks (histograms indices) */
+#define RT_Process		0
+#define RT_BufferSize	1
+#define RT_Sync			2
+#define RT_Timebase		3
+#define RT_NUM			4
+
+/* Handle tables (see handle.c) */
+#define HANDLE_INDEX_BITS	16
+#define HANDLE_MAX			(1 << HANDLE_INDEX_BITS) /* max no. of slots */
+#define HANDLE_PAGE_LOG2	8
+#define HANDLE_PAGE			(1 << HANDLE_PAGE_LOG2) /* slots per page */
+#define HANDLE_NPAGES		(HANDLE_MAX / HANDLE_PAGE)
+#define handleslot_t luajack_handleslot_t
+#define handletab_t luajack_handletab_t
+typedef struct {
+	void		*ptr;		/* the object (NULL if the slot is free) */
+	uintptr_t	gen;		/* generation */
+	uint32_t	nextfree;	/* free list link (index + 1, 0 = none) */
+} luajack_handleslot_t;
+
+typedef struct {
+	luajack_handleslot_t *page[HANDLE_NPAGES];
+	uint32_t	n;			/* no. of slots used so far */
+	uint32_t	freelist;	/* first released slot (index + 1, 0 = none) */
+} luajack_handletab_t;
+
 #define luajack_cud_t struct luajack_cud_s /* client 'userdata' */
 #define luajack_pud_t struct luajack_pud_s /* port 'userdata' */
 #define luajack_tud_t struct luajack_tud_s /* thread 'userdata' */
 #define luajack_rud_t struct luajack_rud_s /* ringbuffer 'userdata' */
+#define luajack_rtpool_t struct luajack_rtpool_s /* rt-allocator pool (see rtalloc.c) */
+struct luajack_rtpool_s;
+#define luajack_trace_t struct luajack_trace_s /* trace recorder (see trace.c) */
+struct luajack_trace_s;
 
 struct luajack_pud_s;
 #define luajack_pudfifo_t struct luajack_pudfifo_s /* ports queue */
 SIMPLEQ_HEAD(luajack_pudfifo_s, luajack_pud_s); /* ports queue */
 
 struct luajack_cud_s {
-	RB_ENTRY(luajack_cud_s) entry;
-	uintptr_t	key;			/* search key */
+	uintptr_t	key;			/* handle (see handle.c) */
 	uint32_t 	marks;
 	client_t	*client; 		/* it's identity at the Jack level */
 	lua_State   *process_state;	/* dedicated state for rt-callbacks (process() etc) */
@@ -95,6 +147,7 @@ struct luajack_cud_s {
 	int Shutdown;
 	int Latency;
 	int Session;
+	uint32_t batched; /* (1 << CT_xxx) flags of non-rt callbacks in batched mode */
 	/* references for rt callbacks in process_state Lua registry */
 	int Process;
 	int BufferSize;
@@ -111,9 +164,30 @@ struct luajack_cud_s {
 	void *CSync_arg;
 	void *CTimebase_arg;
 	luajack_t obj; /* object for raw interface */
-	luajack_stat_t	stat; 	/* for profiling */
+	luajack_stat_t	stat; 	/* for profiling (callbacks time, gc excluded) */
+	luajack_stat_t	gcstat;	/* for profiling (gc time in callbacks) */
+	luajack_hist_t	hist[RT_NUM]; /* for profiling (per rt-callback latency histograms) */
+	/* process_state gc (see process.c) */
+	int		gcpolicy;		/* GC_XXX */
+	float	gcmargin;		/* safety margin (fraction of period) for GC_ADAPTIVE */
+	double	gcstepcost;		/* estimated cost of a gc step (usecs) */
+	unsigned int gcskip;	/* consecutive cycles with no gc */
+	size_t	gcskipped;		/* total cycles with no gc (since last profile start) */
+	void	*matrix;		/* routing matrix (see matrix.c) */
+	/* rt-allocator (0 = use the main state allocator) */
+	size_t	rtpool_size;		/* arena size for process_state */
+	size_t	rtpool_thread_size;	/* arena size for thread states */
+	rtpool_t *rtpool;			/* process_state's pool */
+	trace_t	*trace;				/* trace recorder (if in trace mode) */
+	void	*ahead;				/* compute-ahead mode (see ahead.c) */
+	void	*workers;			/* process workers (see worker.c) */
 };
 
+/* process_state gc policies */
+#define GC_STEP			0	/* one gc step at the end of each rt-callback (default) */
+#define GC_ADAPTIVE		1	/* gc steps in the time left before the end of the period */
+#define GC_OFF			2	/* no gc in rt-callbacks */
+
 #define IsCudValid(cud) 			MarkGet((cud)->marks, 0)
 #define MarkCudValid(cud) 			MarkSet((cud)->marks, 0) 
 #define CancelCudValid(cud)  		MarkReset((cud)->marks, 0)
@@ -126,10 +200,13 @@ struct luajack_cud_s {
 #define MarkCudProfile(cud) 		MarkSet((cud)->marks, 2) 
 #define CancelCudProfile(cud)  		MarkReset((cud)->marks, 2)
 
+#define IsCudReportErrors(cud) 		MarkGet((cud)->marks, 3)
+#define MarkCudReportErrors(cud) 	MarkSet((cud)->marks, 3) 
+#define CancelCudReportErrors(cud)  MarkReset((cud)->marks, 3)
+
 struct luajack_pud_s {
-	RB_ENTRY(luajack_pud_s) entry;
 	SIMPLEQ_ENTRY(luajack_pud_s) cudfifoentry; /* entry for cud->fifo */
-	uintptr_t	key;			/* search key */
+	uintptr_t	key;			/* handle (see handle.c) */
 	uint32_t 	marks;
 	luajack_t obj; /* object for raw interface */
 	port_t		*port;
@@ -139,6 +216,10 @@ struct luajack_pud_s {
 	nframes_t	nframes;	/* buffer size (number of frames) */
 	nframes_t	bufp;	/* position in buffer ( 0 ... nframes-1 ) */
 	unsigned long 	samplesize; /* the buffer_size passed to jack_port_register() */
+	void	*view;	/* buffer view userdata (in process_state, see buffer.c) */
+	int		viewref; /* reference of the view in the process_state registry */
+	unsigned int ahead; /* index+1 of the port's blocks in compute-ahead mode (0 = none) */
+	unsigned int worker; /* index of the process worker owning the port (0 = none) */
 };
 
 #define IsPudValid(pud) 			MarkGet((pud)->marks, 0)
@@ -163,8 +244,7 @@ struct luajack_pud_s {
 
 
 struct luajack_tud_s {
-	RB_ENTRY(luajack_tud_s) entry;
-	uintptr_t	key;			/* search key */
+	uintptr_t	key;			/* handle (see handle.c) */
 	uint32_t 	marks;
 	luajack_t obj; /* object for raw interface */
 	volatile int status;	/* tud status (TUD_XXX codes) */
@@ -173,20 +253,51 @@ struct luajack_tud_s {
 	lua_State	*state; 	/* thread state (unrelated to parent's state) */
 	pthread_mutex_t	lock;
 	pthread_cond_t cond;
+	rtpool_t *rtpool;		/* state's pool, if any (see rtalloc.c) */
 };
 
 #define IsTudValid(tud) 			MarkGet((tud)->marks, 0)
 #define MarkTudValid(tud) 			MarkSet((tud)->marks, 0) 
 #define CancelTudValid(tud)  		MarkReset((tud)->marks, 0)
 
+typedef struct {	/* ringbuffer statistics (see rbuf.c) */
+	uint64_t written;		/* messages written */
+	uint64_t read;			/* messages read */
+	uint64_t bytes_written;	/* bytes written (headers included) */
+	uint64_t bytes_read;	/* bytes read (headers included) */
+	uint64_t rejected;		/* writes failed for lack of space */
+	uint64_t wraps;			/* messages split across the end of the buffer */
+	uint64_t peak;			/* max fill level seen by the writer */
+} rbstats_t;
+
+/* counters are updated lock-free from both ends, and possibly read by a third thread */
+#define RbStatAdd(field, n) __atomic_add_fetch(&(field), (n), __ATOMIC_RELAXED)
+#define RbStatGet(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define RbStatPeak(field, fill) do {											\
+	uint64_t fill_ = (uint64_t)(fill);											\
+	uint64_t old_ = __atomic_load_n(&(field), __ATOMIC_RELAXED);				\
+	while((fill_ > old_) && !__atomic_compare_exchange_n(&(field), &old_,		\
+			fill_, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));						\
+} while(0)
+
 struct luajack_rud_s {
-	RB_ENTRY(luajack_rud_s) entry;
-	uintptr_t key; 	/* search key */
+	uintptr_t key; 	/* handle (see handle.c) */
 	uint32_t 	marks;
 	luajack_t obj; /* object for raw interface */
 	cud_t	*cud;	/* the client it belongs to */
 	jack_ringbuffer_t	*rbuf;
 	int	pipefd[2];
+	void	*view[2];	/* current read (0) and write (1) views (see rbuf.c) */
+	int		doorbell;	/* kind of fd in pipefd (RBUF_PIPE or RBUF_EVENTFD, see rbuf.c) */
+	int		sleeping;	/* RBUF_EVENTFD: 1 if the reader is waiting on the fd */
+	size_t	watermark;	/* RBUF_EVENTFD: min bytes to be read before signalling */
+	void	*audio;		/* audio ringbuffer (see audioring.c), rbuf = NULL */
+	void	*mpsc;		/* MPSC ringbuffer (see mpsc.c), rbuf = NULL */
+	void	*shm;		/* shared memory segment backing rbuf, if any (see shmring.c) */
+	void	*mailbox;	/* mailbox (see mailbox.c), rbuf = NULL */
+	void	*bcast;		/* broadcast ring (see bcast.c), rbuf = NULL */
+	void	*bcreader;	/* broadcast ring reader (see bcast.c), rbuf = NULL */
+	rbstats_t stats;
 };
 
 #define IsRudValid(rud) 			MarkGet((rud)->marks, 0)
@@ -197,9 +308,10 @@ struct luajack_rud_s {
 #define rbuf_readfd(rud) (rud)->pipefd[0]
 #define rbuf_writefd(rud) (rud)->pipefd[1]
 
+#define EVT_POOLSIZE 512 /* max no. of queued callback events (a power of 2) */
+#define EVT_ARGLEN 384 /* max length of names in events, incl. '\0' (longer ones are truncated) */
 #define luajack_evt_t struct luajack_evt_s /* callback entry */
 struct luajack_evt_s {
-	SIMPLEQ_ENTRY(luajack_evt_s) entry;
 	uintptr_t client_key;
 	int	type;		/* CT_ codes */
 	/* parameters */
@@ -208,8 +320,8 @@ struct luajack_evt_s {
 	jack_status_t code;
 	jack_latency_callback_mode_t mode;
 	jack_session_event_t *session_event;
-	char *arg1;
-	char *arg2;
+	char arg1[EVT_ARGLEN];	/* must be the first of the inline names (see evt_new) */
+	char arg2[EVT_ARGLEN];
 };
 
 /* callback types */
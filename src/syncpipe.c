@@ -83,6 +83,52 @@ int syncpipe_read(int readfd)
 	return -1; /* EPIPE, EBADF, ... : all fatal errors */
 	}
 
+#define SYNCPIPE_BATCH 512
+
+int syncpipe_writen(int writefd, size_t n)
+/* write n bytes to the pipe, one per message of a batch (with a single write()
+ * call, for batches of up to SYNCPIPE_BATCH messages) */
+	{
+	static const char zeros[SYNCPIPE_BATCH];
+	int rc = 0;
+	ssize_t cnt;
+	size_t chunk;
+	sigset_t oldset;
+	if(n == 0) return 0;
+	pthread_sigmask(SIG_BLOCK, &Sigpipe, &oldset);
+	while(n > 0)
+		{
+		chunk = n < SYNCPIPE_BATCH ? n : SYNCPIPE_BATCH;
+		if((cnt = write(writefd, zeros, chunk)) < 0)
+			{
+			rc = (errno == EAGAIN) ? 0 : -1; /* pipe full (skip the rest) or fatal error */
+			break;
+			}
+		rc += cnt;
+		n -= cnt;
+		}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	return rc;
+	}
+
+int syncpipe_readn(int readfd, size_t n)
+/* read up to n bytes from the pipe (the counterpart of syncpipe_writen) */
+	{
+	char buf[SYNCPIPE_BATCH];
+	ssize_t cnt;
+	size_t chunk;
+	while(n > 0)
+		{
+		chunk = n < SYNCPIPE_BATCH ? n : SYNCPIPE_BATCH;
+		cnt = read(readfd, buf, chunk);
+		if(cnt == 0) return -1; /* pipe is closed */
+		if(cnt < 0) return (errno == EAGAIN) ? 0 : -1;
+		if((size_t)cnt < chunk) return 0; /* pipe drained */
+		n -= cnt;
+		}
+	return 0;
+	}
+
 int syncpipe_init(void)
 	{
 	sigemptyset(&Sigpipe);
@@ -125,10 +125,17 @@ static void* ThreadFunc(void *arg)
  | luajack functions                             		            		|
  *--------------------------------------------------------------------------*/
 
+static void CloseState(lua_State *T, rtpool_t *pool)
+	{
+	lua_close(T);
+	rtalloc_free(pool); /* after the state, which uses it */
+	}
+
 static int ThreadCreate_(lua_State *L, int isscript)
 	{
 	tud_t *tud;
 	lua_State *T;
+	rtpool_t *pool = NULL;
 	int rc;
 	int chunk_index, nlast;
 	cud_t *cud;
@@ -143,8 +150,19 @@ static int ThreadCreate_(lua_State *L, int isscript)
 		luaL_error(L, "missing thread script");
 
 	/* create the thread's state (unrelated to the client state) */
-	if((T = luajack_newstate(L, ST_THREAD, NULL, NULL)) == NULL)
+	if(cud->rtpool_thread_size > 0)
+		{
+		if((pool = rtalloc_new(cud->rtpool_thread_size)) == NULL)
+			return luaL_error(L, "cannot create rt-allocator arena");
+		T = luajack_newstate(L, ST_THREAD, rtalloc_allocf, pool);
+		}
+	else
+		T = luajack_newstate(L, ST_THREAD, NULL, NULL);
+	if(T == NULL)
+		{
+		rtalloc_free(pool);
 		return luaL_error(L, "cannot create Lua state for thread");
+		}
 
 	nlast = lua_gettop(L); /* last optional argument */
 
@@ -156,7 +174,7 @@ static int ThreadCreate_(lua_State *L, int isscript)
 
 	if((tud = tud_new()) == NULL)
 		{
-		lua_close(T);
+		CloseState(T, pool);
 		return luaL_error(L, "cannot create userdata for thread");
 		}
 	tud->cud = cud;
@@ -165,13 +183,13 @@ static int ThreadCreate_(lua_State *L, int isscript)
 	/* create lock and condition variable */
 	if(pthread_mutex_init(&(tud->lock), NULL) != 0)
 		{
-		lua_close(T);
+		CloseState(T, pool);
 		return luaL_error(L, "cannot initialize mutex");
 		}
 	if(pthread_cond_init(&(tud->cond), NULL) != 0)
 		{
 		pthread_mutex_destroy(&(tud->lock));
-		lua_close(T);
+		CloseState(T, pool);
 		return luaL_error(L, "cannot initialize condition");
 		}
 
@@ -182,13 +200,14 @@ static int ThreadCreate_(lua_State *L, int isscript)
 		{
 		pthread_mutex_destroy(&(tud->lock));
 		pthread_cond_destroy(&(tud->cond));
-		lua_close(T);
+		CloseState(T, pool);
 		return luaL_error(L, "jack_client_create_thread returned %d", rc);
 		}
 
 	DBG("new thread: tud=%p, thread=%lu\n", (void*)tud,tud->key);
 	luajack_verbose("created client thread %u\n", tud->key);
 
+	tud->rtpool = pool;
 	tud->status = TUD_READY; /* now ThreadFunc() can finally execute the script */		
 	lua_pushinteger(L, tud->key);
 	return 1;
@@ -373,6 +392,8 @@ static void thread_free(tud_t *tud)
 	pthread_cancel(tud->thread);
 	pthread_join(tud->thread, NULL);
 	if(tud->state) lua_close(tud->state);
+	rtalloc_free(tud->rtpool);
+	tud->rtpool = NULL;
 	pthread_mutex_destroy(&(tud->lock));
 	pthread_cond_destroy(&(tud->cond));
 	CancelTudValid(tud);
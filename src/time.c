@@ -105,7 +105,7 @@ static int CycleTimes(lua_State *L)
 	int rc;
 	cud_t *cud = cud_check(L, 1);
 	CheckProcess(L, cud);
-	rc = jack_get_cycle_times(cud->client, 
+	rc = ahead_cycle_times(cud, 
 			&current_frames, &current_usecs,&next_usecs, &period_usecs);
 	if(rc)
 		luaL_error(L, "jack_get_cycle_times() returned %d", rc);
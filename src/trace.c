@@ -0,0 +1,189 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Per-cycle trace recorder													*
+ ****************************************************************************/
+
+#include "internal.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* In trace mode, each process cycle of the client appends a fixed-size record
+ * to a circular buffer that is a memory-mapped file, so that the last cycles 
+ * before a problem (e.g. an xrun) can be analyzed post-mortem, even if the 
+ * application crashed. The rt-thread makes no system calls: it only writes 
+ * the record into the mapping and then advances the header's count.
+ *
+ * The file layout is described by trace_hdr_t and trace_rec_t (all fields in
+ * native byte order). See luajack/trace.lua for a reader.
+ */
+
+#define TRACE_MAGIC		"LJTRACE1"
+#define TRACE_VERSION	1
+
+typedef struct {
+	char 	 magic[8];		/* TRACE_MAGIC */
+	uint32_t version;		/* TRACE_VERSION */
+	uint32_t recsize;		/* sizeof(trace_rec_t) */
+	uint32_t nrecords;		/* capacity of the ring */
+	uint32_t sample_rate;
+	uint64_t count;			/* records written so far (the next goes at count % nrecords) */
+	uint8_t	 reserved[32];
+} trace_hdr_t; /* 64 bytes */
+
+typedef struct {
+	uint64_t seq;			/* record sequence number */
+	uint32_t frame;			/* frame time at the start of the cycle */
+	uint32_t nframes;		/* frames processed in the cycle */
+	double	 start;			/* callback start time (seconds, CLOCK_MONOTONIC) */
+	double	 end;			/* callback end time (gc included) */
+	double	 gc;			/* time spent in gc (seconds) */
+	uint64_t mem;			/* Lua memory in use in the process state (bytes) */
+	uint32_t xrun;			/* 1 if one or more cycles were missed before this one */
+	uint32_t reserved;
+	uint64_t usecs;			/* JACK time at the start of the cycle (usecs) */
+} trace_rec_t; /* 64 bytes */
+
+struct luajack_trace_s {
+	trace_hdr_t	*hdr;
+	trace_rec_t	*rec;
+	size_t		size;		/* mapping size */
+	int			fd;
+	/* rt-thread only: */
+	uint64_t	count;
+	nframes_t	lastframe;
+	nframes_t	lastnframes;
+};
+
+void trace_record(cud_t *cud, double start, double end, double gc)
+/* appends a record for the current process cycle (rt-thread) */
+	{
+	jack_nframes_t frame;
+	jack_time_t usecs, next_usecs;
+	float period_usecs;
+	trace_rec_t *rec;
+	trace_t *trace = cud->trace;
+	lua_State *P = cud->process_state;
+
+	if(ahead_cycle_times(cud, &frame, &usecs, &next_usecs, &period_usecs) != 0)
+		{ frame = cud->ahead ? 0 : jack_last_frame_time(cud->client); usecs = 0; }
+
+	rec = &trace->rec[trace->count % trace->hdr->nrecords];
+	rec->seq = trace->count;
+	rec->frame = frame;
+	rec->nframes = cud->buffer_size;
+	rec->start = start;
+	rec->end = end;
+	rec->gc = gc;
+	rec->mem = P ? ((uint64_t)lua_gc(P, LUA_GCCOUNT, 0)*1024 + lua_gc(P, LUA_GCCOUNTB, 0)) : 0;
+	rec->xrun = (trace->count > 0) && (frame != trace->lastframe + trace->lastnframes);
+	rec->usecs = usecs;
+	trace->lastframe = frame;
+	trace->lastnframes = cud->buffer_size;
+	trace->count++;
+	__atomic_store_n(&trace->hdr->count, trace->count, __ATOMIC_RELEASE);
+	}
+
+void trace_close(cud_t *cud)
+/* to be called with the client deactivated */
+	{
+	trace_t *trace = cud->trace;
+	if(!trace) return;
+	cud->trace = NULL;
+	msync(trace->hdr, trace->size, MS_ASYNC);
+	munmap(trace->hdr, trace->size);
+	close(trace->fd);
+	Free(trace);
+	}
+
+static int Trace(lua_State *L)
+/* trace(client, filename [, nrecords]) */
+	{
+	trace_t *trace;
+	void *mem;
+	size_t size;
+	int fd;
+	cud_t *cud = cud_check(L, 1);
+	const char *filename = luaL_checkstring(L, 2);
+	lua_Integer nrecords = luaL_optinteger(L, 3, 65536);
+	luajack_checkcreate();
+	if(cud->trace)
+		return luaL_error(L, "trace mode already enabled");
+	if((nrecords < 1) || (nrecords > UINT32_MAX))
+		return luaL_argerror(L, 3, "invalid number of records");
+	size = sizeof(trace_hdr_t) + (size_t)nrecords*sizeof(trace_rec_t);
+
+	if((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		return luaL_error(L, "cannot open '%s' (%s)", filename, strerror(errno));
+	if(ftruncate(fd, size) != 0)
+		{
+		close(fd);
+		return luaL_error(L, "cannot resize '%s' (%s)", filename, strerror(errno));
+		}
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mem == MAP_FAILED)
+		{
+		close(fd);
+		return luaL_error(L, "cannot map '%s' (%s)", filename, strerror(errno));
+		}
+	if((trace = (trace_t*)Malloc(sizeof(trace_t))) == NULL)
+		{
+		munmap(mem, size);
+		close(fd);
+		return luaL_error(L, "cannot allocate memory");
+		}
+	memset(trace, 0, sizeof(trace_t));
+	trace->hdr = (trace_hdr_t*)mem;
+	trace->rec = (trace_rec_t*)((char*)mem + sizeof(trace_hdr_t));
+	trace->size = size;
+	trace->fd = fd;
+	/* write the whole file now, so that pages are allocated and mapped in */
+	memset(mem, 0, size);
+	if(mlock(mem, size) != 0)
+		luajack_verbose("cannot lock trace file in memory (%s)\n", strerror(errno));
+	memcpy(trace->hdr->magic, TRACE_MAGIC, sizeof(trace->hdr->magic));
+	trace->hdr->version = TRACE_VERSION;
+	trace->hdr->recsize = sizeof(trace_rec_t);
+	trace->hdr->nrecords = (uint32_t)nrecords;
+	trace->hdr->sample_rate = jack_get_sample_rate(cud->client);
+	luajack_verbose("tracing to '%s' (%u records)\n", filename, (unsigned int)nrecords);
+	cud->trace = trace;
+	return 0;
+	}
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "trace", Trace },
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_trace(lua_State *L, int state_type)
+	{
+	if(state_type == ST_MAIN)
+		luaL_setfuncs(L, MFunctions, 0);
+	return 1;
+	}
+
@@ -29,46 +29,24 @@
 
 #include "internal.h"
 
-static int cmp(tud_t *tud1, tud_t *tud2) /* the compare function */
-	{ return (tud1->key < tud2->key ? -1 : tud1->key > tud2->key); } 
+static handletab_t Tab;
 
-static RB_HEAD(tudtree_s, tud_s) Head = RB_INITIALIZER(&Head);
-
-RB_PROTOTYPE_STATIC(tudtree_s, tud_s, entry, cmp) 
-RB_GENERATE_STATIC(tudtree_s, tud_s, entry, cmp) 
- 
-static tud_t *tud_remove(tud_t *tud) 
-	{ return RB_REMOVE(tudtree_s, &Head, tud); }
-static tud_t *tud_insert(tud_t *tud) 
-	{ return RB_INSERT(tudtree_s, &Head, tud); }
 static tud_t *tud_search(uintptr_t key) 
-	{ tud_t tmp; tmp.key = key; return RB_FIND(tudtree_s, &Head, &tmp); }
+	{ return (tud_t*)handle_get(&Tab, key); }
 tud_t *tud_first(uintptr_t key) 
-	{ tud_t tmp; tmp.key = key; return RB_NFIND(tudtree_s, &Head, &tmp); }
+	{ return (tud_t*)handle_first(&Tab, key); }
 tud_t *tud_next(tud_t *tud)
-	{ return RB_NEXT(tudtree_s, &Head, tud); }
-#if 0
-tud_t *tud_prev(tud_t *tud)
-	{ return RB_PREV(tudtree_s, &Head, tud); }
-tud_t *tud_min(void)
-	{ return RB_MIN(tudtree_s, &Head); }
-tud_t *tud_max(void)
-	{ return RB_MAX(tudtree_s, &Head); }
-tud_t *tud_root(void)
-	{ return RB_ROOT(&Head); }
-#endif
+	{ return (tud_t*)handle_next(&Tab, tud->key); }
 
 tud_t *tud_new(void)
 	{
 	tud_t *tud;
 	if((tud = (tud_t*)Malloc(sizeof(tud_t))) == NULL) return NULL;
 	memset(tud, 0, sizeof(tud_t));
-	tud->key = (uintptr_t)tud;
-	if(tud_search(tud->key))
-		{ Free(tud); luajack_error(UNEXPECTED_ERROR); return NULL; }
+	if((tud->key = handle_new(&Tab, tud)) == 0)
+		{ Free(tud); return NULL; }
 	tud->obj.type = LUAJACK_TTHREAD;
 	tud->obj.xud = (void*)tud;
-	tud_insert(tud);
 	MarkTudValid(tud);
 	return tud;
 	}
@@ -76,7 +54,7 @@ tud_t *tud_new(void)
 static void tud_free(tud_t* tud)
 	{
 	if(tud_search(tud->key) == tud)
-		tud_remove(tud);
+		handle_free(&Tab, tud->key);
 	Free(tud);	
 	DBG("tud_free()\n");
 	}
@@ -86,6 +64,7 @@ void tud_free_all(void)
 	tud_t *tud;
 	while((tud = tud_first(0)))
 		tud_free(tud);
+	handle_freetab(&Tab);
 	}
 
 
@@ -273,3 +273,87 @@ double luajack_stat_variance(stat_t *stat)
 #undef max
 #undef mean
 #undef m2
+
+/*------------------------------------------------------------------------------*
+ | Latency histograms      														|
+ *------------------------------------------------------------------------------*/
+
+/* The rt-thread is the only writer of count[], n and max, so it can update them
+ * with plain load/store pairs (relaxed atomics are used only to avoid torn reads
+ * on 32-bit platforms). The reader takes windows by subtracting a baseline. */
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static int HistIndex(uint64_t v)
+	{
+	int e;
+	if(v < HIST_SUB) return (int)v;
+	e = 63 - __builtin_clzll(v);
+	if(e > HIST_MAX_LOG2) return HIST_BUCKETS - 1;
+	return (e - HIST_SUB_LOG2 + 1)*HIST_SUB + (int)((v >> (e - HIST_SUB_LOG2)) & (HIST_SUB - 1));
+	}
+
+static uint64_t HistUpper(int i)
+/* upper bound of the i-th bucket */
+	{
+	int e;
+	if(i < HIST_SUB) return (uint64_t)i;
+	e = i/HIST_SUB - 1 + HIST_SUB_LOG2;
+	return (((uint64_t)(HIST_SUB + i%HIST_SUB) + 1) << (e - HIST_SUB_LOG2)) - 1;
+	}
+
+void luajack_hist_update(hist_t *hist, double sample)
+/* sample in seconds (rt-thread) */
+	{
+	uint64_t v = sample > 0 ? (uint64_t)(sample*1e9) : 0;
+	int i = HistIndex(v);
+	STORE(hist->count[i], LOAD(hist->count[i]) + 1);
+	STORE(hist->n, LOAD(hist->n) + 1);
+	if(v > LOAD(hist->max)) 
+		STORE(hist->max, v);
+	}
+
+void luajack_hist_reset(hist_t *hist)
+/* starts a new window (main thread) */
+	{
+	int i;
+	for(i = 0; i < HIST_BUCKETS; i++)
+		hist->base[i] = LOAD(hist->count[i]);
+	hist->basen = LOAD(hist->n);
+	STORE(hist->max, 0);
+	}
+
+uint64_t luajack_hist_n(hist_t *hist)
+/* no. of samples in the current window */
+	{ return LOAD(hist->n) - hist->basen; }
+
+double luajack_hist_percentile(hist_t *hist, double p)
+/* p-th percentile (0 <= p <= 100) in the current window, in seconds (upper bound 
+ * of the bucket containing it, capped to the window max) */
+	{
+	int i;
+	uint64_t c, sum = 0, rank, total = 0, max = LOAD(hist->max), v;
+	for(i = 0; i < HIST_BUCKETS; i++)
+		total += LOAD(hist->count[i]) - hist->base[i];
+	if(total == 0) return 0;
+	rank = (uint64_t)(p/100.0*total);
+	if(rank < 1) rank = 1;
+	if(rank > total) rank = total;
+	for(i = 0; i < HIST_BUCKETS; i++)
+		{
+		c = LOAD(hist->count[i]) - hist->base[i];
+		if((sum += c) >= rank)
+			break;
+		}
+	v = HistUpper(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+	if(max && v > max) v = max;
+	return v*1e-9;
+	}
+
+double luajack_hist_max(hist_t *hist)
+/* max sample in the current window, in seconds */
+	{ return LOAD(hist->max)*1e-9; }
+
+#undef LOAD
+#undef STORE
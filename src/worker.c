@@ -0,0 +1,388 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2015 Stefano Trettel
+ *
+ * Software repository: LuaJack, https://github.com/stetre/luajack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/****************************************************************************
+ * Process workers (fork-join parallel process callback)					*
+ ****************************************************************************/
+
+#define _GNU_SOURCE /* for pthread_setaffinity_np() */
+#include "internal.h"
+#include <jack/thread.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <limits.h>
+
+/* A client can have, besides its process context, a pool of process workers,
+ * each with its own Lua state and its own process chunk, running in a dedicated
+ * real-time thread (optionally pinned to a cpu), and owning a disjoint set of 
+ * the client's ports.
+ *
+ * At each cycle, the process callback forks the workers (by bumping the 'gen'
+ * counter), executes the process context's own callback concurrently with them,
+ * and then joins them (by waiting for the 'pending' counter to go to zero) 
+ * before returning to JACK. Both waits first spin for a while, and then sleep
+ * on a futex; a futex wakeup is issued only if the other side is sleeping.
+ * The main thread is never involved.
+ */
+
+#define MAX_WORKERS	64
+#define SPIN		4000	/* busy-wait iterations before sleeping on the futex */
+
+typedef struct workers_s workers_t;
+
+typedef struct {
+	workers_t	*ws;
+	unsigned int index;		/* 1, 2, ... */
+	lua_State	*state;
+	rtpool_t	*rtpool;	/* state's pool, if any (see rtalloc.c) */
+	int			ref;		/* process callback reference in the state's registry */
+	uint32_t	gen;		/* last fork generation seen */
+	jack_native_thread_t thread;
+} worker_t;
+
+struct workers_s {
+	cud_t		*cud;
+	unsigned int n;
+	worker_t	*worker[MAX_WORKERS];
+	nframes_t	nframes;	/* for the current cycle */
+	uint32_t	gen;		/* fork generation (futex) */
+	uint32_t	pending;	/* workers not joined yet (futex) */
+	int			sleepers;	/* workers sleeping on gen */
+	int			joining;	/* 1 if the process thread is sleeping on pending */
+	int			stop;		/* tells the workers to exit */
+};
+
+#define WORKERS(cud) ((workers_t*)(cud)->workers)
+
+static pthread_key_t key_worker; /* only the workers have data bound to this key */
+
+static void FutexWait(uint32_t *addr, uint32_t val)
+	{ syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0); }
+
+static void FutexWake(uint32_t *addr, int n)
+	{ syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0); }
+
+unsigned int worker_self(void)
+/* returns the index of the current worker, or 0 if not called in a worker */
+	{
+	worker_t *w = (worker_t*)pthread_getspecific(key_worker);
+	return w ? w->index : 0;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Workers                                         		            		|
+ *--------------------------------------------------------------------------*/
+
+static uint32_t Wait(workers_t *ws, uint32_t gen)
+/* waits for the next fork, and returns its generation */
+	{
+	int i;
+	uint32_t g;
+	for(i = 0; i < SPIN; i++)
+		if((g = __atomic_load_n(&ws->gen, __ATOMIC_ACQUIRE)) != gen) return g;
+	__atomic_add_fetch(&ws->sleepers, 1, __ATOMIC_SEQ_CST);
+	while((g = __atomic_load_n(&ws->gen, __ATOMIC_SEQ_CST)) == gen)
+		FutexWait(&ws->gen, gen);
+	__atomic_sub_fetch(&ws->sleepers, 1, __ATOMIC_SEQ_CST);
+	return g;
+	}
+
+static void Run(worker_t *w, nframes_t nframes)
+	{
+	lua_State *W = w->state;
+	cud_t *cud = w->ws->cud;
+	if(lua_rawgeti(W, LUA_REGISTRYINDEX, w->ref) != LUA_TFUNCTION)
+		{ lua_pop(W, 1); return; } /* no callback registered */
+	lua_pushinteger(W, nframes);
+	if(lua_pcall(W, 1, 0, 0) != LUA_OK)
+		{
+		if(!IsCudReportErrors(cud))
+			{ luajack_error(lua_tostring(W, -1)); return; }
+		luajack_report(LUAJACK_ERROR, cud->key, RT_Process, "worker %u: %s", 
+					w->index, lua_tostring(W, -1));
+		lua_settop(W, 0);
+		}
+	if(cud->gcpolicy != GC_OFF)
+		lua_gc(W, LUA_GCSTEP, 0);
+	}
+
+static void* WorkerFunc(void *arg)
+	{
+	worker_t *w = (worker_t*)arg;
+	workers_t *ws = w->ws;
+
+	luajack_sigblock();
+	pthread_setspecific(key_worker, w);
+	for(;;)
+		{
+		w->gen = Wait(ws, w->gen);
+		if(__atomic_load_n(&ws->stop, __ATOMIC_ACQUIRE))
+			break;
+		Run(w, ws->nframes);
+		if((__atomic_sub_fetch(&ws->pending, 1, __ATOMIC_SEQ_CST) == 0) &&
+				__atomic_load_n(&ws->joining, __ATOMIC_SEQ_CST))
+			FutexWake(&ws->pending, 1);
+		}
+	return NULL;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Fork and join (process thread)                  		            		|
+ *--------------------------------------------------------------------------*/
+
+void worker_fork(cud_t *cud, nframes_t nframes)
+	{
+	workers_t *ws = WORKERS(cud);
+	ws->nframes = nframes;
+	__atomic_store_n(&ws->pending, ws->n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ws->gen, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ws->sleepers, __ATOMIC_SEQ_CST) > 0)
+		FutexWake(&ws->gen, INT_MAX);
+	}
+
+void worker_join(cud_t *cud)
+	{
+	int i;
+	uint32_t n;
+	workers_t *ws = WORKERS(cud);
+	for(i = 0; i < SPIN; i++)
+		if(__atomic_load_n(&ws->pending, __ATOMIC_ACQUIRE) == 0) return;
+	__atomic_store_n(&ws->joining, 1, __ATOMIC_SEQ_CST);
+	while((n = __atomic_load_n(&ws->pending, __ATOMIC_SEQ_CST)) != 0)
+		FutexWait(&ws->pending, n);
+	__atomic_store_n(&ws->joining, 0, __ATOMIC_RELAXED);
+	}
+
+int worker_callback(lua_State *L, cud_t *cud)
+/* registers the function at index 2 as process callback of the worker the state
+ * L belongs to (returns 0 if L does not belong to one of the client's workers) */
+	{
+	unsigned int i;
+	lua_State *M;
+	worker_t *w = NULL;
+	workers_t *ws = WORKERS(cud);
+	if(!ws) return 0;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	M = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	for(i = 0; i < ws->n; i++)
+		if(ws->worker[i]->state == M) { w = ws->worker[i]; break; }
+	if(!w) return 0;
+	if(w->ref != LUA_NOREF)
+		luaL_unref(L, LUA_REGISTRYINDEX, w->ref);
+	lua_pushvalue(L, 2);
+	w->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return 1;
+	}
+
+/*--------------------------------------------------------------------------*
+ | Main thread                                     		            		|
+ *--------------------------------------------------------------------------*/
+
+static void CloseState(lua_State *W, rtpool_t *pool)
+	{
+	lua_close(W);
+	rtalloc_free(pool);
+	}
+
+void worker_free(cud_t *cud)
+/* to be called with the client deactivated */
+	{
+	unsigned int i;
+	pud_t *pud;
+	workers_t *ws = WORKERS(cud);
+	if(!ws) return;
+	__atomic_store_n(&ws->stop, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&ws->gen, 1, __ATOMIC_SEQ_CST);
+	FutexWake(&ws->gen, INT_MAX);
+	for(i = 0; i < ws->n; i++)
+		{
+		pthread_join(ws->worker[i]->thread, NULL);
+		CloseState(ws->worker[i]->state, ws->worker[i]->rtpool);
+		Free(ws->worker[i]);
+		}
+	for(pud = SIMPLEQ_FIRST(&(cud->fifo)); pud; pud = SIMPLEQ_NEXT(pud, cudfifoentry))
+		pud->worker = 0;
+	Free(ws);
+	cud->workers = NULL;
+	}
+
+static void CheckPorts(lua_State *L, cud_t *cud, int arg)
+	{
+	pud_t *pud;
+	lua_Integer i, n;
+	luaL_checktype(L, arg, LUA_TTABLE);
+	n = luaL_len(L, arg);
+	for(i = 1; i <= n; i++)
+		{
+		lua_rawgeti(L, arg, i);
+		pud = pud_check(L, -1);
+		lua_pop(L, 1);
+		if(pud->cud != cud)
+			luaL_error(L, "port is not owned by this client");
+		if(pud->worker != 0)
+			luaL_error(L, "port is already owned by a process worker");
+		}
+	}
+
+static int WorkerLoad_(lua_State *L, int isscript)
+/* process_worker_load(client, ports, cpu, chunk, ...) */
+	{
+	int rc, realtime, priority;
+	lua_Integer i, n;
+	rtpool_t *pool = NULL;
+	lua_State *W;
+	worker_t *w;
+	workers_t *ws;
+	cpu_set_t cpuset;
+	int chunk_index = 4;
+	cud_t *cud = cud_check(L, 1);
+	int cpu = luaL_optinteger(L, 3, -1);
+
+	luajack_checkcreate();
+	CheckPorts(L, cud, 2);
+	if(cud->ahead)
+		return luaL_error(L, "process workers not available in compute-ahead mode");
+	if(!cud->process_state || cud->Process == LUA_NOREF)
+		return luaL_error(L, "missing process callback");
+	if(cud->workers && WORKERS(cud)->n == MAX_WORKERS)
+		return luaL_error(L, "too many process workers");
+	if(lua_type(L, chunk_index) != LUA_TSTRING)
+		return luaL_error(L, "missing worker chunk");
+
+	if(!cud->workers)
+		{
+		if((ws = (workers_t*)Malloc(sizeof(workers_t))) == NULL)
+			return luaL_error(L, "cannot allocate memory");
+		memset(ws, 0, sizeof(workers_t));
+		ws->cud = cud;
+		cud->workers = ws;
+		}
+	ws = WORKERS(cud);
+
+	/* create the worker's state (unrelated to the client state) */
+	if(cud->rtpool_size > 0)
+		{
+		if((pool = rtalloc_new(cud->rtpool_size)) == NULL)
+			return luaL_error(L, "cannot create rt-allocator arena");
+		W = luajack_newstate(L, ST_PROCESS, rtalloc_allocf, pool);
+		}
+	else
+		W = luajack_newstate(L, ST_PROCESS, NULL, NULL);
+	if(W == NULL)
+		{
+		rtalloc_free(pool);
+		return luaL_error(L, "cannot create Lua state");
+		}
+
+	/* load the chunk, and copy it with its arguments on the worker's state */
+	luajack_loadchunk(W, L, chunk_index, isscript);
+	luajack_xmove(W, L, chunk_index, lua_gettop(L));
+
+	if((w = (worker_t*)Malloc(sizeof(worker_t))) == NULL)
+		{
+		CloseState(W, pool);
+		return luaL_error(L, "cannot allocate memory");
+		}
+	memset(w, 0, sizeof(worker_t));
+	w->ws = ws;
+	w->index = ws->n + 1;
+	w->state = W;
+	w->rtpool = pool;
+	w->ref = LUA_NOREF;
+	w->gen = ws->gen;
+	ws->worker[ws->n++] = w; /* so that worker_callback() finds it */
+
+	/* execute the chunk (we still are in the main thread) */
+	if(lua_pcall(W, lua_gettop(W) - 1, 0, 0) != LUA_OK)
+		{
+		lua_pushstring(L, lua_tostring(W, -1));
+		ws->n--;
+		CloseState(W, pool);
+		Free(w);
+		return lua_error(L);
+		}
+	lua_gc(W, LUA_GCCOLLECT, 0);
+	lua_gc(W, LUA_GCSTOP, 0);
+
+	/* workers run at the same priority as the process thread, that waits for them */
+	realtime = jack_is_realtime(cud->client);
+	priority = realtime ? jack_client_real_time_priority(cud->client) : 0;
+	if(priority < 0) priority = 0;
+	rc = jack_client_create_thread(cud->client, &w->thread, priority, realtime, WorkerFunc, w);
+	if(rc)
+		{
+		ws->n--;
+		CloseState(W, pool);
+		Free(w);
+		return luaL_error(L, "jack_client_create_thread returned %d", rc);
+		}
+	if(cpu >= 0)
+		{
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		if(pthread_setaffinity_np(w->thread, sizeof(cpuset), &cpuset) != 0)
+			luajack_verbose("cannot pin process worker %u to cpu %d\n", w->index, cpu);
+		}
+
+	/* assign the ports */
+	n = luaL_len(L, 2);
+	for(i = 1; i <= n; i++)
+		{
+		lua_rawgeti(L, 2, i);
+		pud_check(L, -1)->worker = w->index;
+		lua_pop(L, 1);
+		}
+
+	luajack_verbose("created process worker %u\n", w->index);
+	lua_pushinteger(L, w->index);
+	return 1;
+	}
+
+static int WorkerLoadfile(lua_State *L)
+	{ return WorkerLoad_(L, 1); }
+
+static int WorkerLoad(lua_State *L)
+	{ return WorkerLoad_(L, 0); }
+
+static const struct luaL_Reg MFunctions[] = 
+	{
+		{ "process_worker_load", WorkerLoad },
+		{ "process_worker_loadfile", WorkerLoadfile },
+		{ NULL, NULL } /* sentinel */
+	};
+
+int luajack_open_worker(lua_State *L, int state_type)
+	{
+	int rc;
+	if(state_type == ST_MAIN)
+		{
+		if((rc = pthread_key_create(&key_worker, NULL)) != 0)
+			return luaL_error(L, "pthread_key_create returned %d", rc);
+		luaL_setfuncs(L, MFunctions, 0);
+		}
+	return 1;
+	}
+